@@ -0,0 +1,193 @@
+#include "kvdb_bench_connection.hpp"
+
+#include <iostream>
+#include <boost/asio.hpp>
+
+namespace bench
+{
+
+constexpr std::chrono::seconds Connection::DRAIN;
+
+Connection::Connection( boost::asio::io_service& io_service, RunSettings const& settings, Results& results, std::uint64_t seed )
+    : mSocket( io_service )
+    , mTimer( io_service )
+    , mDrain( io_service )
+    , mSettings( settings )
+    , mResults( results )
+    , mRandom( seed )
+    , mHeader( network::DecodedResponseHeader( Status::stInvalid, 0 ) )
+{
+}
+
+void Connection::Start( Clock::time_point start )
+{
+    mDrain.expires_at( mSettings.mEnd + DRAIN );
+    mDrain.async_wait( [ this ]( boost::system::error_code const& ec )
+    {
+        if( !ec && !mClosed )
+        {
+            std::cerr << "Warning: replies did not come in " << DRAIN.count() << " seconds after the end, the connection is closed" << std::endl;
+            Close( boost::asio::error::timed_out );
+        }
+    } );
+
+    if( mSettings.mInterval == Clock::duration::zero() )
+    {
+        Clock::time_point now = Clock::now();
+        for( size_t i = 0; i < mSettings.mPipeline; i++ )
+            Issue( now );
+        Flush();
+        return;
+    }
+    mFirst = start;
+    mTimer.expires_at( mFirst );
+    mTimer.async_wait( [ this ]( boost::system::error_code const& ec )
+    {
+        if( !ec )
+            Schedule();
+    } );
+}
+
+void Connection::Issue( Clock::time_point start )
+{
+    Opcode op = mSettings.mWorkload->NextOpcode( mRandom );
+    mSettings.mWorkload->AppendRequest( mOut, op, ++mRequestId, *mSettings.mKeys, mRandom );
+    mPending.push_back( Pending{ op, start } );
+    if( !mReading )
+        ReadHeader();
+}
+
+void Connection::Flush()
+{
+    if( mClosed || !mWriting.empty() || mOut.empty() )
+        return;
+    mWriting.swap( mOut );
+    boost::asio::async_write( mSocket, boost::asio::buffer( mWriting ), [ this ]( boost::system::error_code const& ec, size_t )
+    {
+        if( ec )
+        {
+            Close( ec );
+            return;
+        }
+        mWriting.clear();
+        Flush();
+    } );
+}
+
+void Connection::Schedule()
+{
+    // Requests that fell due while the thread was busy go at once, each with its own scheduled time
+    Clock::time_point now = Clock::now();
+    Clock::time_point next = mFirst + mSettings.mInterval * mScheduled;
+    while( next <= now && next < mSettings.mEnd )
+    {
+        Issue( next );
+        next = mFirst + mSettings.mInterval * ++mScheduled;
+    }
+    Flush();
+    if( next >= mSettings.mEnd )
+    {
+        if( mPending.empty() )
+            Close( {} );
+        return;
+    }
+    mTimer.expires_at( next );
+    mTimer.async_wait( [ this ]( boost::system::error_code const& ec )
+    {
+        if( !ec )
+            Schedule();
+    } );
+}
+
+void Connection::ReadHeader()
+{
+    if( mClosed )
+        return;
+    mReading = true;
+    boost::asio::async_read( mSocket, boost::asio::buffer( &mHeader, sizeof( mHeader ) ), [ this ]( boost::system::error_code const& ec, size_t )
+    {
+        if( ec )
+        {
+            Close( ec );
+            return;
+        }
+        network::DecodedResponseHeader h{ mHeader };
+        if( h.mStatus == Status::stInvalid || mPending.empty() || h.mRequestId != mRequestId - mPending.size() + 1 )
+        {
+            std::cerr << "Error: malformed reply or reply out of order" << std::endl;
+            Close( boost::asio::error::invalid_argument );
+            return;
+        }
+        mBody.resize( h.mValueLength );
+        if( mBody.empty() )
+            Complete();
+        else
+            ReadBody();
+    } );
+}
+
+void Connection::ReadBody()
+{
+    boost::asio::async_read( mSocket, boost::asio::buffer( &mBody[ 0 ], mBody.size() ), [ this ]( boost::system::error_code const& ec, size_t )
+    {
+        if( ec )
+        {
+            Close( ec );
+            return;
+        }
+        Complete();
+    } );
+}
+
+void Connection::Complete()
+{
+    network::DecodedResponseHeader h{ mHeader };
+    if( h.mStatus == Status::stPartial )
+    {
+        ReadHeader(); // more of the SCAN follows
+        return;
+    }
+
+    Clock::time_point now = Clock::now();
+    Pending done = mPending.front();
+    mPending.pop_front();
+    size_t i = static_cast< size_t >( done.mOpcode );
+    ( h.mStatus == Status::stSuccess ? mResults.mSuccess[ i ] : mResults.mFailure[ i ] )++;
+    auto latency = std::chrono::duration_cast< std::chrono::nanoseconds >( now - done.mStart ).count();
+    stats::Histogram::Record( mResults.mLatency[ i ], static_cast< std::uint64_t >( std::max< decltype( latency ) >( latency, 0 ) ) );
+
+    bool closed_loop = mSettings.mInterval == Clock::duration::zero();
+    if( closed_loop && now < mSettings.mEnd )
+    {
+        Issue( now );
+        Flush();
+    }
+    if( !mPending.empty() )
+    {
+        ReadHeader();
+        return;
+    }
+    mReading = false;
+    if( closed_loop || mFirst + mSettings.mInterval * mScheduled >= mSettings.mEnd )
+        Close( {} );
+}
+
+void Connection::Close( boost::system::error_code const& ec )
+{
+    if( mClosed )
+        return;
+    mClosed = true;
+    if( ec )
+    {
+        mResults.mBroken++;
+        if( ec != boost::asio::error::timed_out && ec != boost::asio::error::invalid_argument )
+            std::cerr << "Error: connection failed: " << ec.message() << std::endl;
+    }
+    boost::system::error_code ignored;
+    mSocket.shutdown( boost::asio::ip::tcp::socket::shutdown_both, ignored );
+    mSocket.close( ignored );
+    mTimer.cancel( ignored );
+    mDrain.cancel( ignored );
+}
+
+} // namespace bench
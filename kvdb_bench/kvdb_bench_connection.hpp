@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <array>
+#include <deque>
+#include <chrono>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "../kvdb_data_models/kvdb_data_models.hpp"
+#include "../kvdb_server/kvdb_server_histogram.hpp"
+#include "kvdb_bench_workload.hpp"
+
+namespace bench
+{
+
+typedef std::chrono::steady_clock Clock;
+
+// Results of the connections of one thread, merged when the run is over
+struct Results
+{
+    std::array< stats::Histogram::Counters, Workload::OPCODES > mLatency{}; // nanoseconds
+    std::array< std::uint64_t, Workload::OPCODES > mSuccess{};
+    std::array< std::uint64_t, Workload::OPCODES > mFailure{};
+    size_t mBroken = 0; // connections lost before the end
+};
+
+struct RunSettings
+{
+    Workload const* mWorkload = nullptr;
+    KeyChooser const* mKeys = nullptr;
+    size_t mPipeline = 1; // requests in flight of a closed loop connection
+    Clock::duration mInterval{}; // between requests of an open loop connection, zero for a closed loop
+    Clock::time_point mEnd;
+};
+
+// Load of one connection. A closed loop keeps mPipeline requests in flight, a reply lets the next request go.
+// An open loop sends requests on a fixed schedule whether replies came or not, and latency is counted from the scheduled time,
+// so a stalled server is charged for the requests that were due while it stalled (no coordinated omission).
+// All handlers run on the thread of the io_service, with no locks.
+class Connection
+{
+public:
+    static constexpr std::chrono::seconds DRAIN{ 10 }; // for replies after the end
+
+    Connection( boost::asio::io_service& io_service, RunSettings const& settings, Results& results, std::uint64_t seed );
+    boost::asio::ip::tcp::socket& Socket()
+    {
+        return mSocket;
+    }
+    // The first open loop request goes at start
+    void Start( Clock::time_point start );
+
+private:
+    struct Pending
+    {
+        Opcode mOpcode;
+        Clock::time_point mStart;
+    };
+
+    void Issue( Clock::time_point start );
+    void Flush();
+    void Schedule();
+    void ReadHeader();
+    void ReadBody();
+    void Complete();
+    void Close( boost::system::error_code const& ec );
+
+    boost::asio::ip::tcp::socket mSocket;
+    boost::asio::steady_timer mTimer; // of the open loop schedule
+    boost::asio::steady_timer mDrain;
+    RunSettings const& mSettings;
+    Results& mResults;
+    Random mRandom;
+
+    std::uint64_t mRequestId = 0;
+    std::deque< Pending > mPending;
+    std::string mOut; // requests to send
+    std::string mWriting; // requests being sent
+    bool mReading = false;
+    bool mClosed = false;
+    Clock::time_point mFirst;
+    std::uint64_t mScheduled = 0; // open loop requests issued
+
+    network::ResponseHeaderV2 mHeader;
+    std::string mBody;
+};
+
+} // namespace bench
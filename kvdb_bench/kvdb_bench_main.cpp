@@ -0,0 +1,238 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <boost/program_options.hpp>
+#include <boost/asio.hpp>
+#include "kvdb_bench_workload.hpp"
+#include "kvdb_bench_connection.hpp"
+
+namespace
+{
+
+constexpr std::array< double, 5 > PERCENTILES{ 50, 90, 99, 99.9, 100 };
+constexpr std::array< char const*, 5 > PERCENTILE_NAMES{ "p50", "p90", "p99", "p99.9", "max" };
+
+// Inserts every key with MSET batches before the run, over one connection
+bool Load( boost::asio::ip::tcp::resolver::results_type const& endpoints, bench::Workload const& workload, size_t keys )
+{
+    boost::asio::io_service io_service;
+    boost::asio::ip::tcp::socket s( io_service );
+    boost::asio::connect( s, endpoints );
+    bench::Random random( 0 );
+    std::string request, body;
+    size_t batch = workload.LoadBatchCount();
+    bench::Clock::time_point started = bench::Clock::now();
+    for( size_t first = 0; first < keys; first += batch )
+    {
+        request.clear();
+        workload.AppendLoadRequest( request, first, std::min( batch, keys - first ), first + 1, random );
+        // A rejected request is answered before the server closes the connection, so its reply is read after a failed write too
+        boost::system::error_code write_ec, ec;
+        boost::asio::write( s, boost::asio::buffer( request ), write_ec );
+        network::ResponseHeaderV2 rh{ network::DecodedResponseHeader( Status::stInvalid, 0 ) };
+        boost::asio::read( s, boost::asio::buffer( &rh, sizeof( rh ) ), ec );
+        if( ec )
+        {
+            std::cerr << "Error: loading keys failed: " << ( write_ec ? write_ec : ec ).message() << std::endl;
+            return false;
+        }
+        network::DecodedResponseHeader h{ rh };
+        if( h.mStatus != Status::stSuccess || write_ec )
+        {
+            std::cerr << "Error: loading keys failed with status " << static_cast< int >( h.mStatus ) << std::endl;
+            return false;
+        }
+        body.resize( h.mValueLength );
+        boost::asio::read( s, boost::asio::buffer( body ) );
+    }
+    std::cout << "Loaded " << keys << " keys in " << std::chrono::duration< double >( bench::Clock::now() - started ).count() << " s" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main( int argc, char *argv[] )
+{
+    std::string v_address, v_mix, v_key_size, v_value_size, v_distribution;
+    size_t v_connections = 0, v_threads = 0, v_duration = 0, v_keys = 0, v_pipeline = 0, v_batch = 0, v_seed = 0;
+    double v_rate = 0, v_theta = 0;
+    std::uint32_t v_scan_limit = 0, v_ttl = 0;
+    boost::program_options::options_description od( "Allowed options" );
+    od.add_options()
+            ( "help,h", "Show this help message" )
+            ( "address,a", boost::program_options::value< std::string >( &v_address )->default_value( "127.0.0.1:10223" ), "<host>:<port> of a running kvdb_server" )
+            ( "connections,c", boost::program_options::value< size_t >( &v_connections )->default_value( 16 ), "Number of connections" )
+            ( "threads,t", boost::program_options::value< size_t >( &v_threads )->default_value( 1 ), "Number of threads, connections are spread over them" )
+            ( "duration,d", boost::program_options::value< size_t >( &v_duration )->default_value( 10 ), "Run time in seconds" )
+            ( "mix", boost::program_options::value< std::string >( &v_mix )->default_value( "get=90,update=10" ), "Operation weights: insert, update, delete, get, mget, mset, mdel, scan, stats" )
+            ( "keys,k", boost::program_options::value< size_t >( &v_keys )->default_value( 100000 ), "Number of distinct keys" )
+            ( "key-size", boost::program_options::value< std::string >( &v_key_size )->default_value( "16" ), "Key size: N, MIN-MAX (uniform) or MIN-MAX:log (log-uniform)" )
+            ( "value-size", boost::program_options::value< std::string >( &v_value_size )->default_value( "100" ), "Value size: N, MIN-MAX (uniform) or MIN-MAX:log (log-uniform)" )
+            ( "distribution", boost::program_options::value< std::string >( &v_distribution )->default_value( "uniform" ), "Key popularity: uniform or zipf" )
+            ( "zipf-theta", boost::program_options::value< double >( &v_theta )->default_value( 0.99 ), "Skew of the Zipfian popularity, 0 < theta < 1" )
+            ( "rate,r", boost::program_options::value< double >( &v_rate )->default_value( 0 ), "Open loop: requests per second of all connections on a fixed schedule, 0 for a closed loop" )
+            ( "pipeline", boost::program_options::value< size_t >( &v_pipeline )->default_value( 1 ), "Closed loop: requests in flight per connection" )
+            ( "batch", boost::program_options::value< size_t >( &v_batch )->default_value( 16 ), "Keys of MGET, MSET and MDEL" )
+            ( "scan-limit", boost::program_options::value< std::uint32_t >( &v_scan_limit )->default_value( 100 ), "Keys of a SCAN" )
+            ( "ttl", boost::program_options::value< std::uint32_t >( &v_ttl )->default_value( 0 ), "Time to live of written keys in seconds, 0 - no expiry" )
+            ( "load", "Insert all keys before the run" )
+            ( "seed", boost::program_options::value< size_t >( &v_seed )->default_value( 1 ), "Random seed" )
+            ;
+    boost::program_options::variables_map vm;
+    try
+    {
+        boost::program_options::store( boost::program_options::parse_command_line( argc, argv, od ), vm );
+        boost::program_options::notify( vm );
+    }
+    catch( std::exception const& ex )
+    {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+    if( vm.count( "help" ) > 0 )
+    {
+        std::cout << od << std::endl;
+        return 0;
+    }
+
+    bench::Workload workload;
+    if( !workload.ParseMix( v_mix ) )
+    {
+        std::cerr << "Error: wrong operation mix \"" << v_mix << "\"" << std::endl;
+        return 1;
+    }
+    if( !workload.mKeySize.Parse( v_key_size ) || workload.mKeySize.Max() > static_cast< size_t >( network::DecodedHeader::MAX_KEY_SIZE ) )
+    {
+        std::cerr << "Error: wrong key size \"" << v_key_size << "\", keys are up to " << network::DecodedHeader::MAX_KEY_SIZE << " bytes" << std::endl;
+        return 1;
+    }
+    if( !workload.mValueSize.Parse( v_value_size ) || workload.mValueSize.Max() > static_cast< size_t >( network::DecodedHeader::MAX_VALUE_SIZE ) )
+    {
+        std::cerr << "Error: wrong value size \"" << v_value_size << "\", values are up to " << network::DecodedHeader::MAX_VALUE_SIZE << " bytes" << std::endl;
+        return 1;
+    }
+    if( v_distribution != "uniform" && ( v_distribution != "zipf" || v_theta <= 0 || v_theta >= 1 ) )
+    {
+        std::cerr << "Error: key popularity must be uniform or zipf with 0 < theta < 1" << std::endl;
+        return 1;
+    }
+    if( v_batch < 1 || v_batch > static_cast< size_t >( network::DecodedHeader::MAX_BATCH_COUNT ) )
+    {
+        v_batch = std::min< size_t >( std::max< size_t >( v_batch, 1 ), network::DecodedHeader::MAX_BATCH_COUNT );
+        std::cout << "Warning: batch size is set to " << v_batch << ", allowed range is [1.." << network::DecodedHeader::MAX_BATCH_COUNT << "]" << std::endl;
+    }
+    workload.mBatch = v_batch;
+    workload.mScanLimit = v_scan_limit;
+    workload.mTtl = v_ttl;
+    workload.Prepare();
+    v_connections = std::max< size_t >( v_connections, 1 );
+    v_threads = std::min( std::max< size_t >( v_threads, 1 ), v_connections );
+    v_keys = std::max< size_t >( v_keys, 1 );
+
+    size_t p = v_address.find( ':' );
+    if( p == std::string::npos )
+    {
+        std::cerr << "Error: service address must be <host>:<port>" << std::endl;
+        return 1;
+    }
+
+    try
+    {
+        boost::asio::io_service resolver_io;
+        boost::asio::ip::tcp::resolver resolver( resolver_io );
+        auto endpoints = resolver.resolve( boost::asio::ip::tcp::v4(), v_address.substr( 0, p ), v_address.substr( p + 1 ) );
+
+        if( vm.count( "load" ) > 0 && !Load( endpoints, workload, v_keys ) )
+            return 1;
+
+        // Zipfian constants take a pass over all keys, they are computed once for all connections
+        bench::KeyChooser keys( v_keys, v_distribution == "zipf" ? v_theta : 0 );
+
+        // Connections are spread over threads with an io_service each, a connection stays on its thread
+        std::vector< std::unique_ptr< boost::asio::io_service > > io_services;
+        std::vector< std::unique_ptr< bench::Results > > results;
+        for( size_t i = 0; i < v_threads; i++ )
+        {
+            io_services.push_back( std::make_unique< boost::asio::io_service >( 1 ) );
+            results.push_back( std::make_unique< bench::Results >() );
+        }
+        bench::RunSettings settings;
+        settings.mWorkload = &workload;
+        settings.mKeys = &keys;
+        settings.mPipeline = std::max< size_t >( v_pipeline, 1 );
+        if( v_rate > 0 )
+            settings.mInterval = std::chrono::duration_cast< bench::Clock::duration >( std::chrono::duration< double >( double( v_connections ) / v_rate ) );
+        std::vector< std::unique_ptr< bench::Connection > > connections;
+        for( size_t i = 0; i < v_connections; i++ )
+        {
+            connections.push_back( std::make_unique< bench::Connection >( *io_services[ i % v_threads ], settings, *results[ i % v_threads ], v_seed * 1000003 + i ) );
+            boost::asio::connect( connections.back()->Socket(), endpoints );
+            connections.back()->Socket().set_option( boost::asio::ip::tcp::no_delay( true ) );
+        }
+
+        if( v_rate > 0 )
+            std::cout << "Running " << v_duration << " s, open loop at " << v_rate << " requests/s over " << v_connections << " connections..." << std::endl;
+        else
+            std::cout << "Running " << v_duration << " s, closed loop with " << settings.mPipeline << " requests in flight on each of " << v_connections << " connections..." << std::endl;
+        bench::Clock::time_point started = bench::Clock::now();
+        settings.mEnd = started + std::chrono::seconds( v_duration );
+        for( size_t i = 0; i < v_connections; i++ )
+        {
+            // Open loop connections are staggered over one interval, so the requests do not go in bursts
+            connections[ i ]->Start( started + settings.mInterval * i / v_connections );
+        }
+        std::vector< std::thread > threads;
+        for( size_t i = 0; i < v_threads; i++ )
+            threads.emplace_back( [ &, i ](){ io_services[ i ]->run(); } );
+        for( std::thread& t : threads )
+            t.join();
+        double elapsed = std::chrono::duration< double >( std::min( bench::Clock::now(), settings.mEnd ) - started ).count();
+
+        // Report, latency in microseconds
+        std::array< stats::Histogram, bench::Workload::OPCODES > latency;
+        std::array< std::uint64_t, bench::Workload::OPCODES > success{}, failure{};
+        size_t broken = 0;
+        for( auto const& r : results )
+        {
+            for( size_t i = 0; i < bench::Workload::OPCODES; i++ )
+            {
+                latency[ i ].Add( r->mLatency[ i ] );
+                success[ i ] += r->mSuccess[ i ];
+                failure[ i ] += r->mFailure[ i ];
+            }
+            broken += r->mBroken;
+        }
+        std::uint64_t total = 0;
+        for( size_t i = 0; i < bench::Workload::OPCODES; i++ )
+            total += success[ i ] + failure[ i ];
+        std::cout << std::fixed << std::setprecision( 1 )
+                  << "Completed " << total << " requests in " << elapsed << " s, " << double( total ) / elapsed << " requests/s";
+        if( broken != 0 )
+            std::cout << ", " << broken << " connections failed";
+        std::cout << std::endl;
+
+        std::cout << std::left << std::setw( 8 ) << "op" << std::right << std::setw( 12 ) << "requests" << std::setw( 12 ) << "req/s" << std::setw( 10 ) << "not ok";
+        for( char const* name : PERCENTILE_NAMES )
+            std::cout << std::setw( 10 ) << name;
+        std::cout << "  (us)" << std::endl;
+        for( size_t i = 0; i < bench::Workload::OPCODES; i++ )
+        {
+            if( latency[ i ].GetCount() == 0 )
+                continue;
+            std::cout << std::left << std::setw( 8 ) << bench::Workload::mNames[ i ] << std::right << std::setw( 12 ) << latency[ i ].GetCount()
+                      << std::setw( 12 ) << double( latency[ i ].GetCount() ) / elapsed << std::setw( 10 ) << failure[ i ];
+            for( double p : PERCENTILES )
+                std::cout << std::setw( 10 ) << double( latency[ i ].Percentile( p ) ) / 1000;
+            std::cout << std::endl;
+        }
+    }
+    catch( std::exception const& e )
+    {
+        std::cerr << "Exception: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include "kvdb_bench_workload.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+namespace bench
+{
+
+constexpr size_t Workload::OPCODES;
+constexpr std::array< std::string_view, Workload::OPCODES > Workload::mNames;
+
+namespace
+{
+
+// SplitMix64 finalizer, a well mixed hash of a number
+std::uint64_t Mix( std::uint64_t x )
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = ( x ^ ( x >> 30 ) ) * 0xbf58476d1ce4e5b9ull;
+    x = ( x ^ ( x >> 27 ) ) * 0x94d049bb133111ebull;
+    return x ^ ( x >> 31 );
+}
+
+double Uniform( Random& random )
+{
+    return std::uniform_real_distribution< double >( 0, 1 )( random );
+}
+
+} // namespace
+
+bool SizeDistribution::Parse( std::string const& spec )
+{
+    std::string range = spec;
+    mLog = false;
+    size_t colon = range.find( ':' );
+    if( colon != std::string::npos )
+    {
+        if( range.substr( colon + 1 ) != "log" )
+            return false;
+        mLog = true;
+        range.resize( colon );
+    }
+    char* end = nullptr;
+    mMin = static_cast< size_t >( std::strtoull( range.c_str(), &end, 10 ) );
+    mMax = mMin;
+    if( *end == '-' )
+        mMax = static_cast< size_t >( std::strtoull( end + 1, &end, 10 ) );
+    return *end == '\0' && end != range.c_str() && mMin <= mMax && ( mMin > 0 || !mLog );
+}
+
+size_t SizeDistribution::At( double u ) const
+{
+    if( mMin == mMax )
+        return mMin;
+    if( mLog )
+        return std::min( mMax, static_cast< size_t >( std::exp( std::log( double( mMin ) ) + u * ( std::log( double( mMax ) + 1 ) - std::log( double( mMin ) ) ) ) ) );
+    return mMin + std::min( mMax - mMin, static_cast< size_t >( u * double( mMax - mMin + 1 ) ) );
+}
+
+size_t SizeDistribution::Next( Random& random ) const
+{
+    return At( Uniform( random ) );
+}
+
+KeyChooser::KeyChooser( size_t count, double zipf_theta )
+    : mCount( std::max< size_t >( count, 1 ) )
+    , mTheta( zipf_theta )
+{
+    if( mTheta <= 0 )
+        return;
+    for( size_t i = 1; i <= mCount; i++ )
+        mZetaN += 1 / std::pow( double( i ), mTheta );
+    double zeta2 = 1 + std::pow( 0.5, mTheta );
+    mAlpha = 1 / ( 1 - mTheta );
+    mEta = ( 1 - std::pow( 2.0 / double( mCount ), 1 - mTheta ) ) / ( 1 - zeta2 / mZetaN );
+    mHalfPowTheta = std::pow( 0.5, mTheta );
+}
+
+size_t KeyChooser::Next( Random& random ) const
+{
+    if( mTheta <= 0 )
+        return std::uniform_int_distribution< size_t >( 0, mCount - 1 )( random );
+    double u = Uniform( random );
+    double uz = u * mZetaN;
+    size_t rank = 0;
+    if( uz < 1 )
+        rank = 0;
+    else if( uz < 1 + mHalfPowTheta )
+        rank = 1;
+    else
+        rank = std::min( mCount - 1, static_cast< size_t >( double( mCount ) * std::pow( mEta * u - mEta + 1, mAlpha ) ) );
+    return Mix( rank ) % mCount;
+}
+
+bool Workload::ParseMix( std::string const& mix )
+{
+    mMix.clear();
+    mTotalWeight = 0;
+    std::istringstream in( mix );
+    std::string item;
+    while( std::getline( in, item, ',' ) )
+    {
+        size_t equals = item.find( '=' );
+        if( equals == std::string::npos )
+            return false;
+        auto found = std::find( mNames.begin(), mNames.end(), std::string_view( item ).substr( 0, equals ) );
+        if( found == mNames.end() )
+            return false;
+        size_t weight = static_cast< size_t >( std::strtoull( item.c_str() + equals + 1, nullptr, 10 ) );
+        if( weight == 0 )
+            continue;
+        mTotalWeight += weight;
+        mMix.emplace_back( static_cast< Opcode >( found - mNames.begin() ), mTotalWeight );
+    }
+    return mTotalWeight > 0;
+}
+
+Opcode Workload::NextOpcode( Random& random ) const
+{
+    size_t r = std::uniform_int_distribution< size_t >( 0, mTotalWeight - 1 )( random );
+    for( auto const& m : mMix )
+    {
+        if( r < m.second )
+            return m.first;
+    }
+    return mMix.back().first;
+}
+
+void Workload::Prepare()
+{
+    // Random letters and digits, values are neither all alike nor binary
+    static constexpr char ALPHABET[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    Random random( 1 );
+    mValues.resize( mValueSize.Max() * 2 + 1 );
+    for( char& c : mValues )
+        c = ALPHABET[ random() % ( sizeof( ALPHABET ) - 1 ) ];
+}
+
+std::string_view Workload::Value( Random& random ) const
+{
+    size_t size = mValueSize.Next( random );
+    size_t offset = std::uniform_int_distribution< size_t >( 0, mValues.size() - size )( random );
+    return std::string_view( mValues ).substr( offset, size );
+}
+
+std::string Workload::Key( size_t number ) const
+{
+    // The size is drawn by the hash of the number, so a key is the same on every use
+    std::string key = "key" + std::to_string( number );
+    size_t size = mKeySize.At( double( Mix( number ) >> 11 ) / double( 1ull << 53 ) );
+    if( key.size() < size )
+        key.append( size - key.size(), '.' );
+    return key;
+}
+
+void Workload::AppendRequest( std::string& out, Opcode op, std::uint64_t request_id, KeyChooser const& keys, Random& random ) const
+{
+    thread_local std::string body;
+    body.clear();
+    size_t key_length = 0;
+    switch( op )
+    {
+        case Opcode::opInsert:
+        case Opcode::opUpdate:
+        {
+            body = Key( keys.Next( random ) );
+            key_length = body.size();
+            body += Value( random );
+            break;
+        }
+        case Opcode::opDelete:
+        case Opcode::opGet:
+        {
+            body = Key( keys.Next( random ) );
+            key_length = body.size();
+            break;
+        }
+        case Opcode::opMultiGet:
+        case Opcode::opMultiSet:
+        case Opcode::opMultiDelete:
+        {
+            for( size_t i = 0; i < mBatch; i++ )
+                network::AppendBatchEntry( body, Key( keys.Next( random ) ), op == Opcode::opMultiSet ? Value( random ) : std::string_view() );
+            key_length = mBatch;
+            break;
+        }
+        case Opcode::opScan:
+        {
+            body = Key( keys.Next( random ) );
+            key_length = body.size();
+            network::ScanParameters sp;
+            sp.mLimit = mScanLimit;
+            network::AppendScanParameters( body, sp );
+            break;
+        }
+        default:
+            break;
+    }
+    Frame( out, op, key_length, body, request_id );
+}
+
+size_t Workload::LoadBatchCount() const
+{
+    // A key is never shorter than "key" and its number, a batch entry has 2 + 4 bytes of lengths
+    size_t key = std::max< size_t >( mKeySize.Max(), 3 + std::numeric_limits< size_t >::digits10 + 1 );
+    size_t entry = 2 + 4 + key + mValueSize.Max();
+    size_t count = std::min< size_t >( network::DecodedHeader::MAX_BATCH_COUNT, network::DecodedHeader::MAX_BATCH_SIZE / entry );
+    return std::max< size_t >( count, 1 );
+}
+
+void Workload::AppendLoadRequest( std::string& out, size_t first, size_t count, std::uint64_t request_id, Random& random ) const
+{
+    thread_local std::string body;
+    body.clear();
+    for( size_t i = 0; i < count; i++ )
+        network::AppendBatchEntry( body, Key( first + i ), Value( random ) );
+    Frame( out, Opcode::opMultiSet, count, body, request_id );
+}
+
+void Workload::Frame( std::string& out, Opcode op, size_t key_length, std::string const& body, std::uint64_t request_id ) const
+{
+    // Batches carry the number of entries in the key length and the whole body in the value length
+    bool batch = op == Opcode::opMultiGet || op == Opcode::opMultiSet || op == Opcode::opMultiDelete;
+    network::DecodedHeader dc{ op, static_cast< unsigned short >( key_length ), static_cast< unsigned int >( batch ? body.size() : body.size() - key_length ) };
+    dc.mVersion = 2;
+    dc.mRequestId = request_id;
+    if( op == Opcode::opInsert || op == Opcode::opUpdate || op == Opcode::opMultiSet )
+        dc.mTtl = mTtl;
+    network::RequestHeaderV2 header{ dc };
+    out.append( reinterpret_cast< char const* >( &header ), sizeof( header ) );
+    out += body;
+}
+
+} // namespace bench
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <random>
+#include "../kvdb_data_models/kvdb_data_models.hpp"
+
+namespace bench
+{
+
+typedef std::mt19937_64 Random;
+
+// Sizes of keys or values: "N" is fixed, "MIN-MAX" is uniform, "MIN-MAX:log" is log-uniform (small sizes are as common as large ones by order)
+class SizeDistribution
+{
+public:
+    // Returns false for a malformed specification
+    bool Parse( std::string const& spec );
+    size_t At( double u ) const; // size of the quantile u of 0..1
+    size_t Next( Random& random ) const;
+    size_t Max() const
+    {
+        return mMax;
+    }
+
+private:
+    size_t mMin = 1;
+    size_t mMax = 1;
+    bool mLog = false;
+};
+
+// Picks key numbers 0..count-1, uniformly or by the Zipfian law.
+// Zipfian draws use the method of Gray et al. (as YCSB does), ranks are scrambled over the key space so hot keys are not neighbours.
+class KeyChooser
+{
+public:
+    KeyChooser( size_t count, double zipf_theta ); // theta 0 - uniform, otherwise 0 < theta < 1
+    size_t Next( Random& random ) const;
+
+private:
+    size_t mCount;
+    double mTheta;
+    double mZetaN = 0;
+    double mAlpha = 0;
+    double mEta = 0;
+    double mHalfPowTheta = 0;
+};
+
+// Operation mix and request encoding
+class Workload
+{
+public:
+    static constexpr size_t OPCODES = static_cast< size_t >( Opcode::op__MaxCount );
+    static constexpr std::array< std::string_view, OPCODES > mNames{ "insert", "update", "delete", "get", "mget", "mset", "mdel", "scan", "stats" };
+
+    // Mix is "op=weight,...", such as "get=90,update=10"
+    bool ParseMix( std::string const& mix );
+    Opcode NextOpcode( Random& random ) const;
+    // Fills the random bytes values are cut from, after the sizes are set
+    void Prepare();
+
+    // Keys of every number have a size of the key distribution, they are never shorter than the number itself
+    std::string Key( size_t number ) const;
+    // Appends a complete version 2 request, its id is request_id
+    void AppendRequest( std::string& out, Opcode op, std::uint64_t request_id, KeyChooser const& keys, Random& random ) const;
+    // Keys of a load MSET, as many as fit in a batch when every key and value has the largest size
+    size_t LoadBatchCount() const;
+    // Appends an MSET of count keys from the number first
+    void AppendLoadRequest( std::string& out, size_t first, size_t count, std::uint64_t request_id, Random& random ) const;
+    // Value of the value size distribution, valid while the workload lives
+    std::string_view Value( Random& random ) const;
+
+    SizeDistribution mKeySize;
+    SizeDistribution mValueSize;
+    size_t mBatch = 16; // entries of MGET, MSET and MDEL
+    std::uint32_t mScanLimit = 100;
+    std::uint32_t mTtl = 0;
+
+private:
+    void Frame( std::string& out, Opcode op, size_t key_length, std::string const& body, std::uint64_t request_id ) const;
+
+    std::vector< std::pair< Opcode, size_t > > mMix; // with the running total of the weights
+    size_t mTotalWeight = 0;
+    std::string mValues;
+};
+
+} // namespace bench
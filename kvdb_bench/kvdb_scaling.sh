@@ -0,0 +1,84 @@
+#!/bin/bash
+# Throughput of kvdb_server by storage engine and number of processing threads, with one shared io_service and with --per-thread-io.
+# Every run starts a fresh server with as many shards as threads (persistent storage in a new storage.bin), loads the keys
+# and runs kvdb_bench with the same mix, connections and duration, so runs on the same host can be compared.
+#
+#   kvdb_scaling.sh [<build directory>]
+#
+# Settings come from the environment, the defaults are in brackets:
+#   ENGINES      temporal and/or persistent [temporal persistent]
+#   THREADS      thread counts of the server [1 2 4 8 auto]
+#   MODES        shared and/or per-thread [shared per-thread]
+#   PORT         port of the server [10300]
+#   DURATION     seconds of a run [10]
+#   CONNECTIONS  connections of kvdb_bench [64]
+#   PIPELINE     requests in flight per connection [8]
+#   BENCH_THREADS  threads of kvdb_bench [4]
+#   MIX, KEYS, VALUE_SIZE  workload [get=90,update=10] [100000] [100]
+#   SIZE         megabytes of persistent storage, it grows beyond them as needed [256]
+#   SERVER_CPUS, BENCH_CPUS  CPU lists for taskset, so the load generator does not take the CPUs of the server [unset]
+# Prints a line per run: engine, mode, threads, requests/s, p99 of GET in microseconds.
+
+BUILD=$( cd "${1:-.}" && pwd )
+SERVER=$( ls "$BUILD"/kvdb_server/kvdb_server "$BUILD"/kvdb_server "$BUILD"/kvdb_server.exe 2>/dev/null | head -1 )
+BENCH=$( ls "$BUILD"/kvdb_bench/kvdb_bench "$BUILD"/kvdb_bench "$BUILD"/kvdb_bench.exe 2>/dev/null | head -1 )
+if [ ! -x "$SERVER" ] || [ ! -x "$BENCH" ]; then
+    echo "Error: kvdb_server and kvdb_bench are not found in ${1:-.}" >&2
+    exit 1
+fi
+# The server keeps persistent storage in its working directory
+WORK=$( mktemp -d )
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+
+THREADS=${THREADS:-"1 2 4 8 auto"}
+MODES=${MODES:-"shared per-thread"}
+PORT=${PORT:-10300}
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-64}
+PIPELINE=${PIPELINE:-8}
+BENCH_THREADS=${BENCH_THREADS:-4}
+MIX=${MIX:-get=90,update=10}
+KEYS=${KEYS:-100000}
+VALUE_SIZE=${VALUE_SIZE:-100}
+ENGINES=${ENGINES:-"temporal persistent"}
+SIZE=${SIZE:-256}
+
+SERVER_RUN=()
+BENCH_RUN=()
+[ -n "$SERVER_CPUS" ] && SERVER_RUN=( taskset -c "$SERVER_CPUS" )
+[ -n "$BENCH_CPUS" ] && BENCH_RUN=( taskset -c "$BENCH_CPUS" )
+
+echo "# $( date -u +%FT%TZ ), $( nproc 2>/dev/null || echo '?' ) CPUs, mix $MIX, $CONNECTIONS connections x $PIPELINE in flight, $DURATION s"
+printf "%-12s %-12s %8s %14s %12s\n" engine mode threads "requests/s" "get p99 us"
+for engine in $ENGINES; do
+    for threads in $THREADS; do
+        for mode in $MODES; do
+            flags=()
+            [ "$mode" = "per-thread" ] && flags=( --per-thread-io )
+            [ "$engine" = "persistent" ] && flags+=( --size "$SIZE" )
+            shards=$threads
+            [ "$threads" = "auto" ] && shards=$( nproc 2>/dev/null || echo 1 )
+            rm -f storage.bin
+            "${SERVER_RUN[@]}" "$SERVER" -p "$PORT" -m "$engine" --shards "$shards" -t "$threads" --stats-interval 0 "${flags[@]}" > server.log 2>&1 &
+            server=$!
+            for i in $( seq 50 ); do
+                ( exec 3<>/dev/tcp/127.0.0.1/"$PORT" ) 2>/dev/null && break
+                sleep 0.1
+            done
+            out=$( "${BENCH_RUN[@]}" "$BENCH" -a 127.0.0.1:"$PORT" --load -k "$KEYS" --value-size "$VALUE_SIZE" --mix "$MIX" \
+                       -c "$CONNECTIONS" -t "$BENCH_THREADS" --pipeline "$PIPELINE" -d "$DURATION" 2>&1 )
+            kill "$server"
+            wait "$server" 2>/dev/null
+            rps=$( echo "$out" | sed -n 's/^Completed .* s, \([0-9.]*\) requests\/s.*/\1/p' )
+            p99=$( echo "$out" | awk '$1 == "get" { print $7 }' )
+            if [ -z "$rps" ]; then
+                echo "Error: $engine $mode with $threads threads failed:" >&2
+                echo "$out" >&2
+                cat server.log >&2
+                continue
+            fi
+            printf "%-12s %-12s %8s %14s %12s\n" "$engine" "$mode" "$threads" "$rps" "${p99:--}"
+        done
+    done
+done
@@ -0,0 +1,310 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <boost/program_options.hpp>
+#include <boost/filesystem.hpp>
+#include "../kvdb_server/kvdb_server_storage.hpp"
+#include "../kvdb_server/kvdb_server_histogram.hpp"
+#include "kvdb_bench_workload.hpp"
+
+namespace
+{
+
+typedef std::chrono::steady_clock Clock;
+
+constexpr std::array< double, 3 > PERCENTILES{ 50, 99, 99.9 };
+constexpr std::array< char const*, 3 > PERCENTILE_NAMES{ "p50", "p99", "p99.9" };
+
+struct Config
+{
+    std::string mStorage;
+    storage::IStorage::Type mType;
+    size_t mThreads;
+    std::string mKeySize;
+    std::string mValueSize;
+    size_t mKeys;
+};
+
+std::vector< std::string > SplitList( std::string const& list )
+{
+    std::vector< std::string > items;
+    std::istringstream in( list );
+    std::string item;
+    while( std::getline( in, item, ',' ) )
+    {
+        if( !item.empty() )
+            items.push_back( item );
+    }
+    return items;
+}
+
+struct Result
+{
+    std::string mName;
+    double mOpsPerSecond = 0;
+    stats::Histogram mLatency; // nanoseconds
+};
+
+// Runs body( thread, operation ) for operations 0..count-1 split over threads, all threads start together.
+// Each operation is timed on its own.
+Result RunPhase( std::string const& name, size_t threads, size_t count, std::function< void( size_t, size_t ) > const& body )
+{
+    std::vector< std::unique_ptr< stats::Histogram::Counters > > latency;
+    for( size_t t = 0; t < threads; t++ )
+        latency.push_back( std::make_unique< stats::Histogram::Counters >() );
+    std::atomic< bool > go{ false };
+    std::vector< std::thread > pool;
+    for( size_t t = 0; t < threads; t++ )
+    {
+        pool.emplace_back( [ &, t ]()
+        {
+            while( !go.load( std::memory_order_acquire ) )
+                std::this_thread::yield();
+            stats::Histogram::Counters& counters = *latency[ t ];
+            for( size_t i = t; i < count; i += threads )
+            {
+                Clock::time_point started = Clock::now();
+                body( t, i );
+                auto ns = std::chrono::duration_cast< std::chrono::nanoseconds >( Clock::now() - started ).count();
+                stats::Histogram::Record( counters, static_cast< std::uint64_t >( ns ) );
+            }
+        } );
+    }
+    Clock::time_point started = Clock::now();
+    go.store( true, std::memory_order_release );
+    for( std::thread& t : pool )
+        t.join();
+    double elapsed = std::chrono::duration< double >( Clock::now() - started ).count();
+
+    Result r;
+    r.mName = name;
+    for( auto const& c : latency )
+        r.mLatency.Add( *c );
+    r.mOpsPerSecond = elapsed > 0 ? double( count ) / elapsed : 0;
+    std::cout << std::left << std::setw( 44 ) << name << std::right << std::fixed << std::setprecision( 0 ) << std::setw( 12 ) << r.mOpsPerSecond;
+    for( double p : PERCENTILES )
+        std::cout << std::setw( 10 ) << r.mLatency.Percentile( p );
+    std::cout << std::endl;
+    return r;
+}
+
+// Baseline file has a line of "<name> <operations per second>" per phase
+std::map< std::string, double > ReadBaseline( std::string const& path )
+{
+    std::map< std::string, double > baseline;
+    std::ifstream in( path );
+    std::string name;
+    double ops = 0;
+    while( in >> name >> ops )
+        baseline[ name ] = ops;
+    return baseline;
+}
+
+} // namespace
+
+int main( int argc, char *argv[] )
+{
+    std::string v_storages, v_threads, v_keys, v_key_sizes, v_value_sizes, v_read_ratios, v_distribution, v_dir, v_save, v_baseline;
+    size_t v_ops = 0, v_shards = 0, v_size = 0, v_seed = 0;
+    double v_theta = 0, v_tolerance = 0;
+    boost::program_options::options_description od( "Allowed options" );
+    od.add_options()
+            ( "help,h", "Show this help message" )
+            ( "storage,m", boost::program_options::value< std::string >( &v_storages )->default_value( "temporal,hashed,persistent" ), "Storage types to run: persistent, temporal, hashed" )
+            ( "threads,t", boost::program_options::value< std::string >( &v_threads )->default_value( "1,4" ), "Numbers of threads" )
+            ( "keys,k", boost::program_options::value< std::string >( &v_keys )->default_value( "100000" ), "Dataset sizes in keys" )
+            ( "key-size", boost::program_options::value< std::string >( &v_key_sizes )->default_value( "16" ), "Key sizes, each N, MIN-MAX or MIN-MAX:log" )
+            ( "value-size", boost::program_options::value< std::string >( &v_value_sizes )->default_value( "100,4096" ), "Value sizes, each N, MIN-MAX or MIN-MAX:log" )
+            ( "read-ratio", boost::program_options::value< std::string >( &v_read_ratios )->default_value( "100,90,50" ), "Shares of Get in percent for the mixed phases, the rest are Update" )
+            ( "ops", boost::program_options::value< size_t >( &v_ops )->default_value( 1000000 ), "Operations of a mixed phase" )
+            ( "distribution", boost::program_options::value< std::string >( &v_distribution )->default_value( "uniform" ), "Key popularity of the mixed phases: uniform or zipf" )
+            ( "zipf-theta", boost::program_options::value< double >( &v_theta )->default_value( 0.99 ), "Skew of the Zipfian popularity, 0 < theta < 1" )
+            ( "shards", boost::program_options::value< size_t >( &v_shards )->default_value( 16 ), "Number of storage shards" )
+            ( "size,s", boost::program_options::value< size_t >( &v_size )->default_value( 64 ), "Initial persistent storage size in megabytes, it grows as needed" )
+            ( "dir", boost::program_options::value< std::string >( &v_dir )->default_value( "." ), "Directory of the persistent storage file, it is removed after every run" )
+            ( "save", boost::program_options::value< std::string >( &v_save )->default_value( "" ), "File to write the throughput of every phase to, for a later --baseline" )
+            ( "baseline", boost::program_options::value< std::string >( &v_baseline )->default_value( "" ), "File written by --save; a phase slower than it by more than the tolerance fails the run" )
+            ( "tolerance", boost::program_options::value< double >( &v_tolerance )->default_value( 10 ), "Allowed throughput loss against the baseline in percent" )
+            ( "seed", boost::program_options::value< size_t >( &v_seed )->default_value( 1 ), "Random seed" )
+            ;
+    boost::program_options::variables_map vm;
+    try
+    {
+        boost::program_options::store( boost::program_options::parse_command_line( argc, argv, od ), vm );
+        boost::program_options::notify( vm );
+    }
+    catch( std::exception const& ex )
+    {
+        std::cerr << "Error: " << ex.what() << std::endl;
+        return 1;
+    }
+    if( vm.count( "help" ) > 0 )
+    {
+        std::cout << od << std::endl;
+        return 0;
+    }
+    if( v_distribution != "uniform" && ( v_distribution != "zipf" || v_theta <= 0 || v_theta >= 1 ) )
+    {
+        std::cerr << "Error: key popularity must be uniform or zipf with 0 < theta < 1" << std::endl;
+        return 1;
+    }
+
+    std::vector< std::pair< std::string, storage::IStorage::Type > > storages;
+    for( std::string const& s : SplitList( v_storages ) )
+    {
+        if( s == "persistent" )
+            storages.emplace_back( s, storage::IStorage::tPersistent );
+        else if( s == "temporal" )
+            storages.emplace_back( s, storage::IStorage::tTemporal );
+        else if( s == "hashed" )
+            storages.emplace_back( s, storage::IStorage::tHashed );
+        else
+        {
+            std::cerr << "Error: unknown storage type \"" << s << "\"" << std::endl;
+            return 1;
+        }
+    }
+    std::vector< size_t > thread_counts, key_counts, read_ratios;
+    try
+    {
+        for( std::string const& s : SplitList( v_threads ) )
+            thread_counts.push_back( std::max< size_t >( std::stoul( s ), 1 ) );
+        for( std::string const& s : SplitList( v_keys ) )
+            key_counts.push_back( std::max< size_t >( std::stoul( s ), 1 ) );
+        for( std::string const& s : SplitList( v_read_ratios ) )
+            read_ratios.push_back( std::min< size_t >( std::stoul( s ), 100 ) );
+    }
+    catch( std::exception const& )
+    {
+        std::cerr << "Error: numbers of threads, keys and read ratios must be lists of numbers" << std::endl;
+        return 1;
+    }
+
+    // Every combination of the lists is a run on a new storage
+    std::vector< Config > configs;
+    for( auto const& engine : storages )
+    {
+        for( size_t threads : thread_counts )
+        {
+            for( std::string const& key_size : SplitList( v_key_sizes ) )
+            {
+                for( std::string const& value_size : SplitList( v_value_sizes ) )
+                {
+                    for( size_t key_count : key_counts )
+                        configs.push_back( Config{ engine.first, engine.second, threads, key_size, value_size, key_count } );
+                }
+            }
+        }
+    }
+
+    boost::filesystem::current_path( v_dir );
+    boost::filesystem::path file = boost::filesystem::current_path() / "storage.bin";
+
+    std::cout << std::left << std::setw( 44 ) << "phase" << std::right << std::setw( 12 ) << "ops/s";
+    for( char const* name : PERCENTILE_NAMES )
+        std::cout << std::setw( 10 ) << name;
+    std::cout << "  (ns)" << std::endl;
+
+    std::vector< Result > results;
+    for( Config const& config : configs )
+    {
+        size_t threads = config.mThreads;
+        size_t key_count = config.mKeys;
+        bench::Workload workload;
+        if( !workload.mKeySize.Parse( config.mKeySize ) || !workload.mValueSize.Parse( config.mValueSize ) )
+        {
+            std::cerr << "Error: wrong key size \"" << config.mKeySize << "\" or value size \"" << config.mValueSize << "\"" << std::endl;
+            return 1;
+        }
+        workload.Prepare();
+        std::vector< std::string > keys( key_count );
+        for( size_t i = 0; i < key_count; i++ )
+            keys[ i ] = workload.Key( i );
+        bench::KeyChooser chooser( key_count, v_distribution == "zipf" ? v_theta : 0 );
+        std::vector< bench::Random > randoms;
+        for( size_t t = 0; t < threads; t++ )
+            randoms.emplace_back( v_seed * 1000003 + t );
+
+        if( config.mType == storage::IStorage::tPersistent )
+            boost::filesystem::remove( file );
+        std::unique_ptr< storage::IStorage > strg;
+        try
+        {
+            strg = storage::InitializeStorage( v_size * 1024 * 1024, config.mType, v_shards, 64 * 1024 * 1024, 0, 0, std::nullopt );
+        }
+        catch( std::exception const& ex )
+        {
+            std::cerr << "Error: could not create storage: " << ex.what() << std::endl;
+            return 1;
+        }
+
+        std::string prefix = config.mStorage + "/t" + std::to_string( threads ) + "/k" + config.mKeySize + "/v" + config.mValueSize + "/n" + std::to_string( key_count ) + "/";
+        results.push_back( RunPhase( prefix + "insert", threads, key_count, [ & ]( size_t t, size_t i )
+        {
+            strg->Insert( keys[ i ], workload.Value( randoms[ t ] ), storage::NO_EXPIRY );
+        } ) );
+        for( size_t ratio : read_ratios )
+        {
+            results.push_back( RunPhase( prefix + "mix" + std::to_string( ratio ), threads, v_ops, [ & ]( size_t t, size_t )
+            {
+                bench::Random& random = randoms[ t ];
+                std::string const& key = keys[ chooser.Next( random ) ];
+                if( random() % 100 < ratio )
+                    strg->Get( key );
+                else
+                    strg->Update( key, workload.Value( random ), storage::NO_EXPIRY );
+            } ) );
+        }
+        results.push_back( RunPhase( prefix + "delete", threads, key_count, [ & ]( size_t, size_t i )
+        {
+            strg->Delete( keys[ i ] );
+        } ) );
+
+        strg.reset();
+        if( config.mType == storage::IStorage::tPersistent )
+        {
+            boost::filesystem::remove( file );
+            boost::filesystem::remove( file.string() + ".lock" );
+        }
+    }
+
+    if( !v_save.empty() )
+    {
+        std::ofstream out( v_save );
+        for( Result const& r : results )
+            out << r.mName << " " << std::fixed << std::setprecision( 0 ) << r.mOpsPerSecond << "\n";
+    }
+
+    if( !v_baseline.empty() )
+    {
+        std::map< std::string, double > baseline = ReadBaseline( v_baseline );
+        size_t regressions = 0, compared = 0;
+        for( Result const& r : results )
+        {
+            auto found = baseline.find( r.mName );
+            if( found == baseline.end() || found->second <= 0 )
+                continue;
+            compared++;
+            double change = ( r.mOpsPerSecond / found->second - 1 ) * 100;
+            if( change < -v_tolerance )
+            {
+                regressions++;
+                std::cout << "Regression: " << r.mName << " " << std::setprecision( 0 ) << r.mOpsPerSecond << " ops/s, baseline "
+                          << found->second << " ops/s (" << std::setprecision( 1 ) << change << "%)" << std::endl;
+            }
+        }
+        std::cout << compared << " phases compared with the baseline, " << regressions << " slower by more than " << v_tolerance << "%" << std::endl;
+        if( regressions != 0 )
+            return 1;
+    }
+    return 0;
+}
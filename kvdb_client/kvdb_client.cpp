@@ -0,0 +1,497 @@
+#include "kvdb_client.hpp"
+
+#include <cstring> // memcpy
+#include <deque>
+#include <future>
+#include <boost/asio.hpp>
+
+namespace client
+{
+
+namespace
+{
+
+bool IsBatch( Opcode op )
+{
+    return op == Opcode::opMultiGet || op == Opcode::opMultiSet || op == Opcode::opMultiDelete;
+}
+
+// Value of a batch reply is a complete reply per entry
+bool ParseEntries( std::string_view value, std::vector< Reply >& entries )
+{
+    while( !value.empty() )
+    {
+        network::ResponseHeaderV2 rh{ network::DecodedResponseHeader( Status::stInvalid, 0 ) };
+        if( value.size() < sizeof( rh ) )
+            return false;
+        ::memcpy( &rh, value.data(), sizeof( rh ) );
+        network::DecodedResponseHeader h{ rh };
+        value.remove_prefix( sizeof( rh ) );
+        if( h.mStatus == Status::stInvalid || h.mValueLength > value.size() )
+            return false;
+        entries.emplace_back();
+        entries.back().mStatus = h.mStatus;
+        entries.back().mValue = value.substr( 0, h.mValueLength );
+        value.remove_prefix( h.mValueLength );
+    }
+    return true;
+}
+
+} // namespace
+
+// One socket with requests pipelined on it. All state is changed on the strand.
+class Connection : public std::enable_shared_from_this< Connection >
+{
+public:
+    Connection( boost::asio::io_service& io_service, std::string const& host, std::string const& port, size_t max_in_flight )
+        : mStrand( io_service )
+        , mResolver( io_service )
+        , mSocket( io_service )
+        , mHost( host )
+        , mPort( port )
+        , mMaxInFlight( std::max< size_t >( max_in_flight, 1 ) )
+        , mHeader( network::DecodedResponseHeader( Status::stInvalid, 0 ) )
+    {
+    }
+
+    // Requests queued or in flight
+    size_t GetLoad() const
+    {
+        return mLoad.load( std::memory_order_relaxed );
+    }
+
+    void Send( std::uint64_t id, Opcode op, std::string&& data, Callback&& callback )
+    {
+        mLoad.fetch_add( 1, std::memory_order_relaxed );
+        auto self = shared_from_this();
+        boost::asio::post( mStrand, [ self, id, op, data = std::move( data ), callback = std::move( callback ) ]() mutable
+        {
+            self->Submit( Request{ id, op, std::move( data ), std::move( callback ), Reply() } );
+        } );
+    }
+
+    void Close()
+    {
+        auto self = shared_from_this();
+        boost::asio::post( mStrand, [ self ]()
+        {
+            self->mState = sClosed;
+            self->Fail( boost::asio::error::operation_aborted );
+        } );
+    }
+
+private:
+    enum State
+    {
+        sDisconnected,
+        sConnecting,
+        sConnected,
+        sClosed
+    };
+
+    struct Request
+    {
+        std::uint64_t mId;
+        Opcode mOpcode;
+        std::string mData; // header and body, empty once sent
+        Callback mCallback;
+        Reply mReply;
+    };
+
+    void Submit( Request&& request )
+    {
+        if( mState == sClosed )
+        {
+            mLoad.fetch_sub( 1, std::memory_order_relaxed );
+            request.mCallback( boost::asio::error::operation_aborted, Reply() );
+            return;
+        }
+        mWaiting.push_back( std::move( request ) );
+        if( mState == sDisconnected )
+            Connect();
+        else if( mState == sConnected )
+            Pump();
+    }
+
+    void Connect()
+    {
+        mState = sConnecting;
+        auto self = shared_from_this();
+        std::uint64_t generation = mGeneration;
+        mResolver.async_resolve( boost::asio::ip::tcp::v4(), mHost, mPort, boost::asio::bind_executor( mStrand,
+                [ self, generation ]( boost::system::error_code const& ec, boost::asio::ip::tcp::resolver::results_type results )
+        {
+            if( generation != self->mGeneration )
+                return;
+            if( ec )
+            {
+                self->Fail( ec );
+                return;
+            }
+            boost::asio::async_connect( self->mSocket, results, boost::asio::bind_executor( self->mStrand,
+                    [ self, generation ]( boost::system::error_code const& ec, boost::asio::ip::tcp::endpoint const& )
+            {
+                if( generation != self->mGeneration )
+                    return;
+                if( ec )
+                {
+                    self->Fail( ec );
+                    return;
+                }
+                boost::system::error_code ignored;
+                self->mSocket.set_option( boost::asio::ip::tcp::no_delay( true ), ignored );
+                self->mState = sConnected;
+                self->Pump();
+            } ) );
+        } ) );
+    }
+
+    // Moves waiting requests in flight as far as the limit allows
+    void Pump()
+    {
+        while( mInFlight.size() < mMaxInFlight && !mWaiting.empty() )
+        {
+            mInFlight.push_back( std::move( mWaiting.front() ) );
+            mWaiting.pop_front();
+            mOut += mInFlight.back().mData;
+            std::string().swap( mInFlight.back().mData );
+        }
+        Flush();
+        if( !mReading && !mInFlight.empty() )
+            ReadHeader();
+    }
+
+    void Flush()
+    {
+        if( mState != sConnected || !mWriting.empty() || mOut.empty() )
+            return;
+        mWriting.swap( mOut );
+        auto self = shared_from_this();
+        std::uint64_t generation = mGeneration;
+        boost::asio::async_write( mSocket, boost::asio::buffer( mWriting ), boost::asio::bind_executor( mStrand,
+                [ self, generation ]( boost::system::error_code const& ec, size_t )
+        {
+            self->mWriting.clear();
+            if( generation != self->mGeneration )
+            {
+                self->Flush(); // requests of the next connection may be waiting for the buffer
+                return;
+            }
+            if( ec )
+                self->Fail( ec );
+            else
+                self->Flush();
+        } ) );
+    }
+
+    void ReadHeader()
+    {
+        mReading = true;
+        auto self = shared_from_this();
+        std::uint64_t generation = mGeneration;
+        boost::asio::async_read( mSocket, boost::asio::buffer( &mHeader, sizeof( mHeader ) ), boost::asio::bind_executor( mStrand,
+                [ self, generation ]( boost::system::error_code const& ec, size_t )
+        {
+            if( generation != self->mGeneration )
+                return;
+            if( ec )
+            {
+                self->Fail( ec );
+                return;
+            }
+            network::DecodedResponseHeader h{ self->mHeader };
+            if( h.mStatus == Status::stInvalid || h.mRequestId != self->mInFlight.front().mId )
+            {
+                self->Fail( boost::system::errc::make_error_code( boost::system::errc::protocol_error ) );
+                return;
+            }
+            self->mBody.resize( h.mValueLength );
+            if( self->mBody.empty() )
+            {
+                self->Complete();
+                return;
+            }
+            boost::asio::async_read( self->mSocket, boost::asio::buffer( &self->mBody[ 0 ], self->mBody.size() ), boost::asio::bind_executor( self->mStrand,
+                    [ self, generation ]( boost::system::error_code const& ec, size_t )
+            {
+                if( generation != self->mGeneration )
+                    return;
+                if( ec )
+                    self->Fail( ec );
+                else
+                    self->Complete();
+            } ) );
+        } ) );
+    }
+
+    void Complete()
+    {
+        network::DecodedResponseHeader h{ mHeader };
+        Request& request = mInFlight.front();
+        Reply& reply = request.mReply;
+        bool parsed = true;
+        if( h.mStatus == Status::stPartial )
+        {
+            // Items of one part of a SCAN, more parts follow
+            std::vector< network::BatchEntry > items;
+            if( !network::ParseScanItems( mBody, items ) )
+            {
+                Fail( boost::system::errc::make_error_code( boost::system::errc::protocol_error ) );
+                return;
+            }
+            for( auto const& item : items )
+                reply.mItems.emplace_back( item.first, item.second );
+            ReadHeader();
+            return;
+        }
+        reply.mStatus = h.mStatus;
+        if( h.mStatus == Status::stSuccess && IsBatch( request.mOpcode ) )
+            parsed = ParseEntries( mBody, reply.mEntries );
+        else
+            reply.mValue = mBody;
+        if( !parsed )
+        {
+            Fail( boost::system::errc::make_error_code( boost::system::errc::protocol_error ) );
+            return;
+        }
+
+        Request done = std::move( request );
+        mInFlight.pop_front();
+        mLoad.fetch_sub( 1, std::memory_order_relaxed );
+        done.mCallback( boost::system::error_code(), std::move( done.mReply ) );
+
+        Pump();
+        if( mInFlight.empty() )
+            mReading = false;
+        else
+            ReadHeader();
+    }
+
+    // Every request of the connection fails, the next one opens it again unless it is closed
+    void Fail( boost::system::error_code const& ec )
+    {
+        mGeneration++;
+        if( mState != sClosed )
+            mState = sDisconnected;
+        mReading = false;
+        boost::system::error_code ignored;
+        mResolver.cancel();
+        mSocket.close( ignored );
+        mOut.clear();
+
+        std::deque< Request > failed;
+        failed.swap( mInFlight );
+        for( Request& r : mWaiting )
+            failed.push_back( std::move( r ) );
+        mWaiting.clear();
+        mLoad.fetch_sub( failed.size(), std::memory_order_relaxed );
+        for( Request& r : failed )
+            r.mCallback( ec, Reply() );
+    }
+
+    boost::asio::io_service::strand mStrand;
+    boost::asio::ip::tcp::resolver mResolver;
+    boost::asio::ip::tcp::socket mSocket;
+    std::string mHost;
+    std::string mPort;
+    size_t mMaxInFlight;
+    std::atomic< size_t > mLoad{ 0 };
+
+    State mState = sDisconnected;
+    std::uint64_t mGeneration = 0; // of the socket, handlers of a closed socket are ignored
+    std::deque< Request > mWaiting;
+    std::deque< Request > mInFlight; // in the order of the replies
+    std::string mOut; // requests to send
+    std::string mWriting; // requests being sent
+    bool mReading = false;
+    network::ResponseHeaderV2 mHeader;
+    std::string mBody;
+};
+
+Client::Client( boost::asio::io_service& io_service, std::string const& host, std::string const& port, Options const& options )
+    : mOptions( options )
+{
+    for( size_t i = 0; i < std::max< size_t >( mOptions.mConnections, 1 ); i++ )
+        mConnections.push_back( std::make_shared< Connection >( io_service, host, port, mOptions.mMaxInFlight ) );
+}
+
+Client::~Client()
+{
+    for( auto const& c : mConnections )
+        c->Close();
+}
+
+void Client::Insert( std::string_view key, std::string_view value, std::uint32_t ttl, Callback callback )
+{
+    std::string body;
+    body.reserve( key.size() + value.size() );
+    body.append( key ).append( value );
+    Send( Opcode::opInsert, key.size(), body, ttl, std::move( callback ) );
+}
+
+void Client::Update( std::string_view key, std::string_view value, std::uint32_t ttl, Callback callback )
+{
+    std::string body;
+    body.reserve( key.size() + value.size() );
+    body.append( key ).append( value );
+    Send( Opcode::opUpdate, key.size(), body, ttl, std::move( callback ) );
+}
+
+void Client::Delete( std::string_view key, Callback callback )
+{
+    Send( Opcode::opDelete, key.size(), std::string( key ), 0, std::move( callback ) );
+}
+
+void Client::Get( std::string_view key, Callback callback )
+{
+    Send( Opcode::opGet, key.size(), std::string( key ), 0, std::move( callback ) );
+}
+
+void Client::MultiGet( std::vector< std::string_view > const& keys, Callback callback )
+{
+    std::string body;
+    for( std::string_view k : keys )
+        network::AppendBatchEntry( body, k, std::string_view() );
+    Send( Opcode::opMultiGet, keys.size(), body, 0, std::move( callback ) );
+}
+
+void Client::MultiSet( std::vector< network::BatchEntry > const& items, std::uint32_t ttl, Callback callback )
+{
+    std::string body;
+    for( auto const& item : items )
+        network::AppendBatchEntry( body, item.first, item.second );
+    Send( Opcode::opMultiSet, items.size(), body, ttl, std::move( callback ) );
+}
+
+void Client::MultiDelete( std::vector< std::string_view > const& keys, Callback callback )
+{
+    std::string body;
+    for( std::string_view k : keys )
+        network::AppendBatchEntry( body, k, std::string_view() );
+    Send( Opcode::opMultiDelete, keys.size(), body, 0, std::move( callback ) );
+}
+
+void Client::Scan( std::string_view start, network::ScanParameters const& parameters, Callback callback )
+{
+    std::string body( start );
+    network::AppendScanParameters( body, parameters );
+    Send( Opcode::opScan, start.size(), body, 0, std::move( callback ) );
+}
+
+void Client::Stats( Callback callback )
+{
+    Send( Opcode::opStats, 0, std::string(), 0, std::move( callback ) );
+}
+
+void Client::Send( Opcode op, size_t key_length, std::string const& body, std::uint32_t ttl, Callback&& callback )
+{
+    // Batches carry the number of entries in the key length and the whole body in the value length.
+    // Lengths are bounded before they are narrowed to the header fields, where a long key would wrap to a valid length
+    // and the body would run past the request the header describes.
+    size_t value_length = IsBatch( op ) ? body.size() : body.size() - key_length;
+    size_t key_limit = IsBatch( op ) ? network::DecodedHeader::MAX_BATCH_COUNT : network::DecodedHeader::MAX_KEY_SIZE;
+    bool fits = key_length <= key_limit && value_length <= static_cast< size_t >( network::DecodedHeader::MAX_BATCH_SIZE );
+    network::DecodedHeader dc{ op, static_cast< unsigned short >( key_length ), static_cast< unsigned int >( value_length ) };
+    dc.mVersion = 2;
+    dc.mRequestId = ++mRequestId;
+    dc.mTtl = ttl;
+    if( !fits || !dc.IsValid() )
+    {
+        Reply reply;
+        reply.mStatus = Status::stBadRequest;
+        callback( boost::system::error_code(), std::move( reply ) ); // the server would reject it and close the connection
+        return;
+    }
+    if( mOptions.mChecksum )
+    {
+        dc.mHasChecksum = true;
+        dc.mChecksum = network::Crc32c( 0, body.data(), body.size() );
+    }
+    network::RequestHeaderV2 header{ dc };
+    std::string data;
+    data.reserve( sizeof( header ) + body.size() );
+    data.append( reinterpret_cast< char const* >( &header ), sizeof( header ) ).append( body );
+
+    Connection* least = mConnections.front().get();
+    for( auto const& c : mConnections )
+    {
+        if( c->GetLoad() < least->GetLoad() )
+            least = c.get();
+    }
+    least->Send( dc.mRequestId, op, std::move( data ), std::move( callback ) );
+}
+
+SyncClient::SyncClient( std::string const& host, std::string const& port, Options const& options )
+    : mWork( boost::asio::make_work_guard( mIoService ) )
+    , mClient( std::make_unique< Client >( mIoService, host, port, options ) )
+    , mThread( [ this ](){ mIoService.run(); } )
+{
+}
+
+SyncClient::~SyncClient()
+{
+    mClient.reset();
+    mWork.reset();
+    mThread.join();
+}
+
+Reply SyncClient::Wait( std::function< void( Callback ) > const& call )
+{
+    std::promise< Reply > promise;
+    std::future< Reply > result = promise.get_future();
+    call( [ &promise ]( boost::system::error_code const& ec, Reply&& reply )
+    {
+        if( ec )
+            promise.set_exception( std::make_exception_ptr( boost::system::system_error( ec ) ) );
+        else
+            promise.set_value( std::move( reply ) );
+    } );
+    return result.get();
+}
+
+Reply SyncClient::Insert( std::string_view key, std::string_view value, std::uint32_t ttl )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->Insert( key, value, ttl, std::move( callback ) ); } );
+}
+
+Reply SyncClient::Update( std::string_view key, std::string_view value, std::uint32_t ttl )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->Update( key, value, ttl, std::move( callback ) ); } );
+}
+
+Reply SyncClient::Delete( std::string_view key )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->Delete( key, std::move( callback ) ); } );
+}
+
+Reply SyncClient::Get( std::string_view key )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->Get( key, std::move( callback ) ); } );
+}
+
+Reply SyncClient::MultiGet( std::vector< std::string_view > const& keys )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->MultiGet( keys, std::move( callback ) ); } );
+}
+
+Reply SyncClient::MultiSet( std::vector< network::BatchEntry > const& items, std::uint32_t ttl )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->MultiSet( items, ttl, std::move( callback ) ); } );
+}
+
+Reply SyncClient::MultiDelete( std::vector< std::string_view > const& keys )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->MultiDelete( keys, std::move( callback ) ); } );
+}
+
+Reply SyncClient::Scan( std::string_view start, network::ScanParameters const& parameters )
+{
+    return Wait( [ & ]( Callback callback ){ mClient->Scan( start, parameters, std::move( callback ) ); } );
+}
+
+Reply SyncClient::Stats()
+{
+    return Wait( [ & ]( Callback callback ){ mClient->Stats( std::move( callback ) ); } );
+}
+
+} // namespace client
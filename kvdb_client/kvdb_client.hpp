@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <functional>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <boost/system/error_code.hpp>
+#include "../kvdb_data_models/kvdb_data_models.hpp"
+
+namespace client
+{
+
+struct Reply
+{
+    Status mStatus = Status::stInvalid;
+    std::string mValue; // value of GET, cursor of SCAN, text of STATS
+    std::vector< Reply > mEntries; // one per key of MGET, MSET and MDEL
+    std::vector< std::pair< std::string, std::string > > mItems; // keys and values of SCAN
+};
+
+// Transport errors come as ec with an empty reply; statuses of the server come in the reply
+typedef std::function< void( boost::system::error_code const& ec, Reply&& reply ) > Callback;
+
+struct Options
+{
+    size_t mConnections = 4;
+    size_t mMaxInFlight = 256; // requests sent and not answered on a connection, later ones wait for replies
+    bool mChecksum = true; // CRC-32C of request bodies
+};
+
+class Connection;
+
+// Pool of connections to one server. A request goes to the connection with the fewest requests in flight
+// and is pipelined behind them; connections are opened on the first request and again after a failure.
+// Methods may be called from any thread; callbacks run on a thread of the io_service, one at a time per connection.
+class Client
+{
+public:
+    Client( boost::asio::io_service& io_service, std::string const& host, std::string const& port, Options const& options = Options() );
+    ~Client(); // requests in flight fail with operation_aborted
+    Client( Client const& ) = delete;
+    Client& operator=( Client const& ) = delete;
+
+    void Insert( std::string_view key, std::string_view value, std::uint32_t ttl, Callback callback );
+    void Update( std::string_view key, std::string_view value, std::uint32_t ttl, Callback callback );
+    void Delete( std::string_view key, Callback callback );
+    void Get( std::string_view key, Callback callback );
+    void MultiGet( std::vector< std::string_view > const& keys, Callback callback );
+    void MultiSet( std::vector< network::BatchEntry > const& items, std::uint32_t ttl, Callback callback );
+    void MultiDelete( std::vector< std::string_view > const& keys, Callback callback );
+    // Items of all partial replies are gathered into one reply
+    void Scan( std::string_view start, network::ScanParameters const& parameters, Callback callback );
+    void Stats( Callback callback );
+
+private:
+    void Send( Opcode op, size_t key_length, std::string const& body, std::uint32_t ttl, Callback&& callback );
+
+    Options mOptions;
+    std::vector< std::shared_ptr< Connection > > mConnections;
+    std::atomic< std::uint64_t > mRequestId{ 0 };
+};
+
+// Blocking calls over a Client with an io_service and a thread of its own.
+// Transport errors throw boost::system::system_error.
+class SyncClient
+{
+public:
+    SyncClient( std::string const& host, std::string const& port, Options const& options = Options() );
+    ~SyncClient();
+
+    Reply Insert( std::string_view key, std::string_view value, std::uint32_t ttl = 0 );
+    Reply Update( std::string_view key, std::string_view value, std::uint32_t ttl = 0 );
+    Reply Delete( std::string_view key );
+    Reply Get( std::string_view key );
+    Reply MultiGet( std::vector< std::string_view > const& keys );
+    Reply MultiSet( std::vector< network::BatchEntry > const& items, std::uint32_t ttl = 0 );
+    Reply MultiDelete( std::vector< std::string_view > const& keys );
+    Reply Scan( std::string_view start, network::ScanParameters const& parameters );
+    Reply Stats();
+
+    // For asynchronous calls on the thread of the SyncClient
+    Client& GetClient()
+    {
+        return *mClient;
+    }
+
+private:
+    Reply Wait( std::function< void( Callback ) > const& call );
+
+    boost::asio::io_service mIoService;
+    boost::asio::executor_work_guard< boost::asio::io_service::executor_type > mWork;
+    std::unique_ptr< Client > mClient;
+    std::thread mThread;
+};
+
+} // namespace client
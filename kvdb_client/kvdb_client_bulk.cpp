@@ -0,0 +1,390 @@
+#include "kvdb_client_bulk.hpp"
+
+#include <istream>
+#include <ostream>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+#include <utility>
+#include <boost/system/system_error.hpp>
+
+namespace client
+{
+
+constexpr size_t BulkSettings::BATCH_SIZE;
+constexpr size_t BulkSettings::SCAN_LIMIT;
+
+namespace
+{
+
+constexpr size_t ENTRY_HEADER_SIZE = 2 + 4; // of a binary record
+
+// Requests in flight, the caller waits for a free slot. The first failure stops the transfer.
+class Window
+{
+public:
+    explicit Window( size_t limit )
+        : mLimit( std::max< size_t >( limit, 1 ) )
+    {
+    }
+
+    void Acquire()
+    {
+        std::unique_lock< std::mutex > lock( mMutex );
+        mChanged.wait( lock, [ this ]{ return mInFlight < mLimit || mError; } );
+        if( mError )
+        {
+            mChanged.wait( lock, [ this ]{ return mInFlight == 0; } );
+            std::rethrow_exception( mError );
+        }
+        mInFlight++;
+    }
+
+    void Release( size_t failed = 0 )
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+        mInFlight--;
+        mFailed += failed;
+        mChanged.notify_all();
+    }
+
+    void Fail( std::exception_ptr error )
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+        if( !mError )
+            mError = error;
+        mInFlight--;
+        mChanged.notify_all();
+    }
+
+    bool Failed()
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+        return static_cast< bool >( mError );
+    }
+
+    // Callbacks refer to the state of the caller, it must not go before they are done
+    void Wait()
+    {
+        std::unique_lock< std::mutex > lock( mMutex );
+        mChanged.wait( lock, [ this ]{ return mInFlight == 0; } );
+    }
+
+    // Number of records rejected by the server
+    size_t Finish()
+    {
+        std::unique_lock< std::mutex > lock( mMutex );
+        mChanged.wait( lock, [ this ]{ return mInFlight == 0; } );
+        if( mError )
+            std::rethrow_exception( mError );
+        return mFailed;
+    }
+
+private:
+    size_t mLimit;
+    std::mutex mMutex;
+    std::condition_variable mChanged;
+    size_t mInFlight = 0;
+    size_t mFailed = 0;
+    std::exception_ptr mError;
+};
+
+std::uint32_t LoadLittleEndian( unsigned char const* a, size_t n )
+{
+    std::uint32_t v = 0;
+    for( size_t i = n; i > 0; i-- )
+        v = ( v << 8 ) | a[ i - 1 ];
+    return v;
+}
+
+bool Unescape( std::string_view field, std::string& out )
+{
+    out.clear();
+    for( size_t i = 0; i < field.size(); i++ )
+    {
+        if( field[ i ] != '\\' )
+        {
+            out.push_back( field[ i ] );
+            continue;
+        }
+        if( ++i == field.size() )
+            return false;
+        switch( field[ i ] )
+        {
+            case 't':
+                out.push_back( '\t' );
+                break;
+            case 'n':
+                out.push_back( '\n' );
+                break;
+            case 'r':
+                out.push_back( '\r' );
+                break;
+            case '\\':
+                out.push_back( '\\' );
+                break;
+            default:
+                return false;
+        }
+    }
+    return true;
+}
+
+void Escape( std::string_view field, std::string& out )
+{
+    for( char c : field )
+    {
+        switch( c )
+        {
+            case '\t':
+                out += "\\t";
+                break;
+            case '\n':
+                out += "\\n";
+                break;
+            case '\r':
+                out += "\\r";
+                break;
+            case '\\':
+                out += "\\\\";
+                break;
+            default:
+                out.push_back( c );
+        }
+    }
+}
+
+class RecordReader
+{
+public:
+    RecordReader( std::istream& in, BulkFormat format )
+        : mIn( in )
+        , mFormat( format )
+    {
+    }
+
+    // False at the end of the input
+    bool Next( std::string& key, std::string& value )
+    {
+        if( mFormat == BulkFormat::fBinary ? !NextBinary( key, value ) : !NextTsv( key, value ) )
+            return false;
+        if( key.empty() || key.size() > static_cast< size_t >( network::DecodedHeader::MAX_KEY_SIZE )
+                || value.size() > static_cast< size_t >( network::DecodedHeader::MAX_VALUE_SIZE ) )
+            Error( "the key is empty or the key or the value is too long" );
+        return true;
+    }
+
+private:
+    bool NextTsv( std::string& key, std::string& value )
+    {
+        while( std::getline( mIn, mLine ) )
+        {
+            mRecord++;
+            if( !mLine.empty() && mLine.back() == '\r' )
+                mLine.pop_back(); // CRLF files
+            if( mLine.empty() )
+                continue;
+            size_t tab = mLine.find( '\t' );
+            if( tab == std::string::npos )
+                Error( "no tab between the key and the value" );
+            std::string_view line{ mLine };
+            if( !Unescape( line.substr( 0, tab ), key ) || !Unescape( line.substr( tab + 1 ), value ) )
+                Error( "bad escape sequence" );
+            return true;
+        }
+        if( mIn.bad() )
+            Error( "read failed" );
+        return false;
+    }
+
+    bool NextBinary( std::string& key, std::string& value )
+    {
+        unsigned char h[ ENTRY_HEADER_SIZE ];
+        mIn.read( reinterpret_cast< char* >( h ), sizeof( h ) );
+        if( mIn.gcount() == 0 && mIn.eof() )
+            return false;
+        mRecord++;
+        if( mIn.gcount() != static_cast< std::streamsize >( sizeof( h ) ) )
+            Error( "truncated record" );
+        std::uint32_t key_length = LoadLittleEndian( h, 2 );
+        std::uint32_t value_length = LoadLittleEndian( h + 2, 4 );
+        if( key_length > network::DecodedHeader::MAX_KEY_SIZE || value_length > network::DecodedHeader::MAX_VALUE_SIZE )
+            Error( "the key or the value is too long" );
+        key.resize( key_length );
+        value.resize( value_length );
+        mIn.read( &key[ 0 ], key_length );
+        mIn.read( &value[ 0 ], value_length );
+        if( !mIn )
+            Error( "truncated record" );
+        return true;
+    }
+
+    [[noreturn]] void Error( std::string const& what )
+    {
+        throw std::runtime_error( "record " + std::to_string( mRecord ) + ": " + what );
+    }
+
+    std::istream& mIn;
+    BulkFormat mFormat;
+    std::string mLine;
+    size_t mRecord = 0;
+};
+
+void AppendRecord( std::string& out, BulkFormat format, std::string_view key, std::string_view value )
+{
+    if( format == BulkFormat::fBinary )
+    {
+        network::AppendBatchEntry( out, key, value );
+        return;
+    }
+    Escape( key, out );
+    out.push_back( '\t' );
+    Escape( value, out );
+    out.push_back( '\n' );
+}
+
+// A range of keys by the first byte, paged through with SCAN
+struct Range
+{
+    std::string mStart;
+    std::string mBound; // empty for the last range
+    bool mAfterStart = false;
+};
+
+} // namespace
+
+BulkResult Import( Client& client, std::istream& in, BulkSettings const& settings )
+{
+    BulkResult result;
+    Window window( settings.mWindow );
+    RecordReader reader( in, settings.mFormat );
+    std::vector< std::pair< std::string, std::string > > batch;
+    size_t batch_size = 0;
+
+    auto send = [ & ]()
+    {
+        window.Acquire();
+        std::vector< network::BatchEntry > entries;
+        entries.reserve( batch.size() );
+        for( auto const& record : batch )
+            entries.emplace_back( record.first, record.second );
+        size_t count = batch.size();
+        client.MultiSet( entries, settings.mTtl, [ &window, count ]( boost::system::error_code const& ec, Reply&& reply )
+        {
+            if( ec )
+            {
+                window.Fail( std::make_exception_ptr( boost::system::system_error( ec ) ) );
+                return;
+            }
+            // A key that already holds the value is imported all the same
+            size_t failed = 0;
+            if( reply.mStatus != Status::stSuccess )
+                failed = count;
+            for( auto const& entry : reply.mEntries )
+            {
+                if( entry.mStatus != Status::stSuccess && entry.mStatus != Status::stValueNotChanged )
+                    failed++;
+            }
+            window.Release( failed );
+        } );
+        result.mRecords += count;
+        batch.clear();
+        batch_size = 0;
+    };
+
+    try
+    {
+        std::string key;
+        std::string value;
+        while( reader.Next( key, value ) )
+        {
+            size_t size = ENTRY_HEADER_SIZE + key.size() + value.size();
+            if( !batch.empty() && batch_size + size > BulkSettings::BATCH_SIZE )
+                send();
+            batch.emplace_back( std::move( key ), std::move( value ) );
+            batch_size += size;
+            if( batch.size() == static_cast< size_t >( network::DecodedHeader::MAX_BATCH_COUNT ) )
+                send();
+        }
+        if( !batch.empty() )
+            send();
+    }
+    catch( ... )
+    {
+        window.Wait();
+        throw;
+    }
+    result.mFailed = window.Finish();
+    result.mRecords -= result.mFailed;
+    return result;
+}
+
+BulkResult Export( Client& client, std::ostream& out, BulkSettings const& settings )
+{
+    BulkResult result;
+    Window window( settings.mWindow );
+    std::mutex out_mutex;
+
+    std::vector< Range > ranges( 256 );
+    for( size_t i = 0; i < ranges.size(); i++ )
+    {
+        ranges[ i ].mStart.assign( 1, static_cast< char >( i ) );
+        if( i + 1 < ranges.size() )
+            ranges[ i ].mBound.assign( 1, static_cast< char >( i + 1 ) );
+    }
+
+    // A page of a range, the callback asks for the next one in the same slot of the window
+    std::function< void( Range& ) > scan = [ & ]( Range& range )
+    {
+        network::ScanParameters p;
+        p.mFlags = range.mAfterStart ? network::ScanParameters::FLAG_AFTER : 0;
+        p.mLimit = static_cast< std::uint32_t >( BulkSettings::SCAN_LIMIT );
+        p.mBound = range.mBound;
+        client.Scan( range.mStart, p, [ &, r = &range ]( boost::system::error_code const& ec, Reply&& reply )
+        {
+            if( ec )
+            {
+                window.Fail( std::make_exception_ptr( boost::system::system_error( ec ) ) );
+                return;
+            }
+            if( reply.mStatus != Status::stSuccess )
+            {
+                window.Fail( std::make_exception_ptr( std::runtime_error( "SCAN rejected by the server, export needs ordered (temporal or persistent) storage" ) ) );
+                return;
+            }
+            std::string records;
+            for( auto const& item : reply.mItems )
+                AppendRecord( records, settings.mFormat, item.first, item.second );
+            {
+                std::lock_guard< std::mutex > lock( out_mutex );
+                out.write( records.data(), static_cast< std::streamsize >( records.size() ) );
+                result.mRecords += reply.mItems.size();
+            }
+            if( reply.mValue.empty() || window.Failed() )
+            {
+                window.Release();
+                return;
+            }
+            r->mStart = std::move( reply.mValue );
+            r->mAfterStart = true;
+            scan( *r );
+        } );
+    };
+
+    for( Range& range : ranges )
+    {
+        window.Acquire();
+        scan( range );
+    }
+    window.Finish();
+    out.flush();
+    if( !out )
+        throw std::runtime_error( "write failed" );
+    return result;
+}
+
+} // namespace client
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <iosfwd>
+#include "kvdb_client.hpp"
+
+namespace client
+{
+
+// Records of a bulk file:
+// fTsv - a line per record, the key and the value separated by a tab; \t, \n, \r and \\ escape those characters
+// fBinary - a 2-byte key length and a 4-byte value length (little-endian), then key and value, as entries of a batch
+enum class BulkFormat
+{
+    fTsv,
+    fBinary
+};
+
+struct BulkSettings
+{
+    static constexpr size_t BATCH_SIZE = 1024 * 1024; // payload of an MSET, a longer value goes in a batch of its own
+    static constexpr size_t SCAN_LIMIT = 4096; // keys of a SCAN page
+
+    BulkFormat mFormat = BulkFormat::fTsv;
+    std::uint32_t mTtl = 0; // of imported keys
+    size_t mWindow = 32; // batches or SCAN pages in flight over all connections
+};
+
+struct BulkResult
+{
+    size_t mRecords = 0; // imported or exported
+    size_t mFailed = 0; // rejected by the server
+};
+
+// Both calls block, the io_service of the client must run on other threads.
+
+// Reads records from the stream and sends them in MSET batches, up to mWindow of them in flight.
+// Existing keys are overwritten. Malformed input throws std::runtime_error, transport errors throw boost::system::system_error;
+// batches sent before that stay imported.
+BulkResult Import( Client& client, std::istream& in, BulkSettings const& settings );
+
+// Writes every key and value of the server to the stream. The keyspace is split into ranges by the first byte of the key
+// and up to mWindow ranges are paged through with SCAN at once, so records come in key order within a range only.
+// It is not a snapshot: keys changed during the export may be missed or come with either value.
+// The storage of the server must be ordered (SCAN is rejected by hashed storage).
+BulkResult Export( Client& client, std::ostream& out, BulkSettings const& settings );
+
+} // namespace client
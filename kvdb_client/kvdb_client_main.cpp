@@ -1,27 +1,137 @@
 #include <iostream>
 #include <string>
+#include <string_view>
 #include <cctype> // toupper
-#include <memory.h> // memcpy
-#include <boost/asio.hpp>
-#include "../kvdb_data_models/kvdb_data_models.hpp"
+#include <algorithm>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#if defined _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <stdio.h>
+#endif
+#include "kvdb_client.hpp"
+#include "kvdb_client_bulk.hpp"
 
 void PrintUsage()
 {
     std::cerr << "Usage: kvdb_client <host>:<port> <command> <key> [<value>]" << std::endl
+              << "       kvdb_client <host>:<port> INSERT|UPDATE <key> <value> <ttl>" << std::endl
+              << "       kvdb_client <host>:<port> MGET|MDEL <key> [<key> ...]" << std::endl
+              << "       kvdb_client <host>:<port> MSET <key> <value> [<key> <value> ...]" << std::endl
+              << "       kvdb_client <host>:<port> SCAN <start key> [<end key> [<limit>]]" << std::endl
+              << "       kvdb_client <host>:<port> PREFIX <prefix> [<limit>]" << std::endl
+              << "       kvdb_client <host>:<port> STATS" << std::endl
+              << "       kvdb_client <host>:<port> IMPORT <file> [tsv|bin [<ttl>]]" << std::endl
+              << "       kvdb_client <host>:<port> EXPORT <file> [tsv|bin]" << std::endl
               << "where" << std::endl
               << "<host>:<port> is an address of a running kvdb_server, for example 127.0.0.1:10223" << std::endl
-              << "<command> is one of these: INSERT, UPDATE, DELETE, GET" << std::endl
+              << "<command> is one of these: INSERT, UPDATE, DELETE, GET, MGET, MSET, MDEL" << std::endl
               << "<key> is a string with length up to 1024 (1k)" << std::endl
               << "<value> is a string with length up to 1048576 (1M)" << std::endl
+              << "<ttl> is the number of seconds the key lives, it does not expire without one" << std::endl
+              << "MGET, MSET and MDEL take up to 1024 keys" << std::endl
+              << "SCAN lists keys from the start key (\"\" for the first one) up to the end key (excluded), PREFIX lists keys with the prefix;" << std::endl
+              << "both print a cursor when the limit stopped them, SCAN with -<cursor> as the start key continues after it" << std::endl
+              << "STATS prints the server counters and latency in the Prometheus text format" << std::endl
+              << "IMPORT sets the keys of a file, EXPORT writes all keys of the server (it needs temporal or persistent storage) to a file;" << std::endl
+              << "<file> is - for stdin or stdout; tsv is a line per key with a tab before the value and \\t, \\n, \\r, \\\\ escapes," << std::endl
+              << "bin is a 2-byte key length and a 4-byte value length (little-endian) before each key and value" << std::endl
               << "Use \"...\" to set key or value with spaces or an empty value" << std::endl
                  ;
 }
 
+std::string_view StatusText( Status s )
+{
+    switch( s )
+    {
+        case Status::stSuccess:
+            return "OK";
+        case Status::stKeyNotFound:
+            return "ERROR: key not found";
+        case Status::stKeyAlreadyExists:
+            return "ERROR: key already exists";
+        case Status::stValueNotChanged:
+            return "WARNING: value for key not changed";
+        case Status::stBadRequest:
+            return "ERROR: request rejected by server";
+        default:
+            return "ERROR: unexpected operation result";
+    }
+}
+
+int RunBulk( std::string const& host, std::string const& port, std::string const& command, int argc, char **argv )
+{
+    bool import = command == "IMPORT";
+    if( argc < 4 || argc > ( import ? 6 : 5 ) )
+    {
+        PrintUsage();
+        return 1;
+    }
+    client::BulkSettings settings;
+    std::string format = argc > 4 ? argv[4] : "tsv";
+    if( format == "bin" )
+        settings.mFormat = client::BulkFormat::fBinary;
+    else if( format != "tsv" )
+    {
+        std::cerr << "Error: format must be tsv or bin" << std::endl;
+        PrintUsage();
+        return 1;
+    }
+    if( argc > 5 )
+        settings.mTtl = static_cast< std::uint32_t >( std::stoul( argv[5] ) );
+
+    std::string path{ argv[3] };
+    std::ifstream in;
+    std::ofstream out;
+    if( path == "-" )
+    {
+#if defined _WIN32
+        _setmode( _fileno( import ? stdin : stdout ), _O_BINARY );
+#endif
+    }
+    else if( import )
+        in.open( path, std::ios::binary );
+    else
+        out.open( path, std::ios::binary | std::ios::trunc );
+    if( path != "-" && !( import ? in.is_open() : out.is_open() ) )
+    {
+        std::cerr << "Error: can not open " << path << std::endl;
+        return 1;
+    }
+
+    // Batches are pipelined over the default pool of connections
+    auto started = std::chrono::steady_clock::now();
+    client::BulkResult result;
+    try
+    {
+        client::SyncClient c( host, port );
+        if( import )
+            result = client::Import( c.GetClient(), path == "-" ? std::cin : in, settings );
+        else
+            result = client::Export( c.GetClient(), path == "-" ? std::cout : out, settings );
+    }
+    catch( std::exception const& e )
+    {
+        std::cerr << "Error: " << command << " failed: " << e.what() << std::endl;
+        return 1;
+    }
+    double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - started ).count();
+
+    // The summary goes to stderr, stdout may hold the export
+    std::cerr << "Reply: OK, " << result.mRecords << " keys " << ( import ? "imported" : "exported" );
+    if( result.mFailed != 0 )
+        std::cerr << ", " << result.mFailed << " rejected by server";
+    std::cerr << " in " << seconds << " s (" << static_cast< std::uint64_t >( result.mRecords / std::max( seconds, 1e-6 ) ) << " keys/s)" << std::endl;
+    return result.mFailed == 0 ? 0 : 1;
+}
+
 int main( int argc, char **argv )
 {
     try
     {
-        if( argc < 4 )
+        if( argc < 3 )
         {
             PrintUsage();
             return 1;
@@ -42,12 +152,23 @@ int main( int argc, char **argv )
         // Command
         std::string command{ argv[2] };
         std::transform( command.begin(), command.end(), command.begin(), []( unsigned char c ){ return std::toupper( c ); } );
-        if( command != "INSERT" && command != "UPDATE" && command != "DELETE" && command != "GET" )
+        if( command == "IMPORT" || command == "EXPORT" )
+            return RunBulk( host, port, command, argc, argv );
+        if( command != "INSERT" && command != "UPDATE" && command != "DELETE" && command != "GET"
+                && command != "MGET" && command != "MSET" && command != "MDEL" && command != "SCAN" && command != "PREFIX" && command != "STATS" )
         {
-            std::cerr << "Error: <command> must be one of these: INSERT, UPDATE, DELETE, GET" << std::endl;
+            std::cerr << "Error: <command> must be one of these: INSERT, UPDATE, DELETE, GET, MGET, MSET, MDEL, SCAN, PREFIX, STATS, IMPORT, EXPORT" << std::endl;
             PrintUsage();
             return 1;
         }
+        if( ( command == "STATS" ) != ( argc == 3 ) )
+        {
+            PrintUsage();
+            return 1;
+        }
+        bool prefix = command == "PREFIX";
+        if( prefix )
+            command = "SCAN";
         while( command.size() < 8 )
             command.push_back( ' ' );
 
@@ -59,65 +180,132 @@ int main( int argc, char **argv )
             return 1;
         }
 
-        // Key
-        std::string key = argv[3];
-        if( key.size() > 1024 )
+        std::string key;
+        std::string value;
+        std::vector< network::BatchEntry > batch;
+        network::ScanParameters sp;
+        std::uint32_t ttl = 0;
+        if( command == "MGET    " || command == "MDEL    " || command == "MSET    " )
         {
-            std::cerr << "Error: <key> is too long, max size is 1024" << std::endl;
-            PrintUsage();
-            return 1;
+            size_t step = command == "MSET    " ? 2 : 1;
+            if( ( argc - 3 ) % step != 0 || static_cast< long >( ( argc - 3 ) / step ) > network::DecodedHeader::MAX_BATCH_COUNT )
+            {
+                std::cerr << "Error: wrong number of batch arguments" << std::endl;
+                PrintUsage();
+                return 1;
+            }
+            for( int i = 3; i < argc; i += step )
+            {
+                std::string_view k{ argv[ i ] };
+                std::string_view v{ step == 2 ? argv[ i + 1 ] : "" };
+                if( k.empty() || k.size() > 1024 || v.size() > 1048576 )
+                {
+                    std::cerr << "Error: <key> or <value> of a batch entry is too long or empty" << std::endl;
+                    PrintUsage();
+                    return 1;
+                }
+                batch.emplace_back( k, v );
+            }
         }
+        else if( command == "SCAN    " )
+        {
+            int next = 3;
+            if( !prefix )
+            {
+                key = argv[ next++ ];
+                if( key.size() > 1 && key[ 0 ] == '-' )
+                {
+                    key.erase( 0, 1 );
+                    sp.mFlags |= network::ScanParameters::FLAG_AFTER;
+                }
+            }
+            else
+                sp.mFlags |= network::ScanParameters::FLAG_PREFIX;
+            if( next < argc )
+                sp.mBound = argv[ next++ ];
+            if( next < argc )
+                sp.mLimit = static_cast< std::uint32_t >( std::stoul( argv[ next++ ] ) );
+            if( key.size() > 1024 || sp.mBound.size() > 1024 || next < argc )
+            {
+                std::cerr << "Error: wrong SCAN arguments" << std::endl;
+                PrintUsage();
+                return 1;
+            }
+        }
+        else if( command != "STATS   " )
+        {
+            // Key
+            key = argv[3];
+            if( key.size() > 1024 )
+            {
+                std::cerr << "Error: <key> is too long, max size is 1024" << std::endl;
+                PrintUsage();
+                return 1;
+            }
 
+            // Value
+            value = argc < 5 ? "" : argv[4];
+            if( argc > 5 && ( command == "INSERT  " || command == "UPDATE  " ) )
+                ttl = static_cast< std::uint32_t >( std::stoul( argv[5] ) );
+            if( value.size() > 1048576 )
+            {
+                std::cerr << "Error: <value> is too long, max size is 1048576" << std::endl;
+                PrintUsage();
+                return 1;
+            }
+        }
 
-        // Value
-        std::string value = argc < 5 ? "" : argv[4];
-        if( key.size() > 1048576 ) // it's impossible, right?
+        // One connection is enough for a single request
+        client::Options options;
+        options.mConnections = 1;
+        client::SyncClient c( host, port, options );
+        std::vector< std::string_view > batch_keys;
+        for( auto const& entry : batch )
+            batch_keys.push_back( entry.first );
+        client::Reply reply;
+        if( command == "INSERT  " )
+            reply = c.Insert( key, value, ttl );
+        else if( command == "UPDATE  " )
+            reply = c.Update( key, value, ttl );
+        else if( command == "DELETE  " )
+            reply = c.Delete( key );
+        else if( command == "GET     " )
+            reply = c.Get( key );
+        else if( command == "MGET    " )
+            reply = c.MultiGet( batch_keys );
+        else if( command == "MSET    " )
+            reply = c.MultiSet( batch );
+        else if( command == "MDEL    " )
+            reply = c.MultiDelete( batch_keys );
+        else if( command == "SCAN    " )
+            reply = c.Scan( key, sp );
+        else
+            reply = c.Stats();
+
+        for( auto const& item : reply.mItems )
+            std::cout << item.first << ": \"" << item.second << "\"" << std::endl;
+        std::cout << "Reply: " << StatusText( reply.mStatus );
+        if( reply.mStatus == Status::stSuccess && command == "GET     " )
+            std::cout << ", key is \"" << reply.mValue << "\"";
+        if( reply.mStatus == Status::stSuccess && command == "STATS   " )
+            std::cout << std::endl << reply.mValue;
+        if( reply.mStatus == Status::stSuccess && command == "SCAN    " )
         {
-            std::cerr << "Error: <value> is too long, max size is 1048576" << std::endl;
-            PrintUsage();
-            return 1;
+            std::cout << ", " << reply.mItems.size() << " keys";
+            if( !reply.mValue.empty() )
+                std::cout << ", continue from -" << reply.mValue;
         }
-
-        // Prepare data
-        network::DecodedHeader dc{ command, static_cast< unsigned short >( key.size() ), static_cast< unsigned int >( value.size() ) };
-        network::RequestHeader header{ dc };
-        network::RequestFooter footer{};
-        std::vector< char > data;
-        data.resize( sizeof( network::RequestHeader ) + key.size() + value.size() + sizeof( network::RequestFooter ) );
-        ::memcpy( &data[ 0 ],
-                &header,
-                sizeof( header ) );
-        ::memcpy( &data[ sizeof( network::RequestHeader ) ],
-                key.data(),
-                key.size() );
-        ::memcpy( &data[ sizeof( network::RequestHeader ) + key.size() ],
-                value.data(),
-                value.size() );
-        ::memcpy( &data[ sizeof( network::RequestHeader ) + key.size() + value.size() ],
-                &footer,
-                sizeof( footer ) );
-
-        std::cout << "data prepared: " << data.size() << " bytes" << std::endl;
-
-        boost::asio::io_service io_service;
-
-        boost::asio::ip::tcp::resolver resolver( io_service );
-        boost::asio::ip::tcp::resolver::query query( boost::asio::ip::tcp::v4(), host, port );
-        boost::asio::ip::tcp::resolver::iterator iterator = resolver.resolve( query );
-
-        boost::asio::ip::tcp::socket s( io_service );
-        boost::asio::connect( s, iterator );
-
-        boost::asio::write( s, boost::asio::buffer( data ) );
-        std::cout << "data written: " << data.size() << " bytes" << std::endl;
-
-        char reply[ 1024 ];
-        std::cout << "reading reply..." << std::endl;
-        size_t reply_length = boost::asio::read( s, boost::asio::buffer( reply, 1024 ), boost::asio::transfer_at_least( 1 ) );
-        std::cout << "received reply of size " << reply_length << " bytes" << std::endl;
-        std::cout << "Reply: ";
-        std::cout.write( reply, reply_length );
         std::cout << std::endl;
+
+        // Batch reply holds one reply per requested key
+        for( size_t i = 0; i < reply.mEntries.size() && i < batch_keys.size(); i++ )
+        {
+            client::Reply const& entry = reply.mEntries[ i ];
+            std::cout << batch_keys[ i ] << ": " << StatusText( entry.mStatus );
+            if( entry.mStatus == Status::stSuccess && command == "MGET    " )
+                std::cout << ", value is \"" << entry.mValue << "\"";
+            std::cout << std::endl;
+        }
     }
     catch( std::exception const& e )
     {
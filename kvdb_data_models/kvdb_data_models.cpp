@@ -1,31 +1,120 @@
 #include "kvdb_data_models.hpp"
 #include <algorithm>
+#include <charconv>
+#include <cstring> // memcpy
+#if defined __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 namespace network
 {
 
+namespace
+{
+
+template< size_t N >
+void StoreLittleEndian( char* a, std::uint64_t v )
+{
+    for( size_t i = 0; i < N; i++ )
+        a[ i ] = static_cast< char >( ( v >> ( 8 * i ) ) & 0xff );
+}
+
+template< size_t N >
+std::uint64_t LoadLittleEndian( char const* a )
+{
+    std::uint64_t v = 0;
+    for( size_t i = 0; i < N; i++ )
+        v |= static_cast< std::uint64_t >( static_cast< unsigned char >( a[ i ] ) ) << ( 8 * i );
+    return v;
+}
+
+template< size_t N >
+void StoreLittleEndian( std::array< char, N >& a, std::uint64_t v )
+{
+    StoreLittleEndian< N >( a.data(), v );
+}
+
+template< size_t N >
+std::uint64_t LoadLittleEndian( std::array< char, N > const& a )
+{
+    return LoadLittleEndian< N >( a.data() );
+}
+
+// Text length field of a version 1 header: decimal digits padded with zero bytes
+bool ParseLength( std::array< char, 8 > const& a, long& v )
+{
+    char const* end = a.data();
+    while( end != a.data() + a.size() && *end != '\0' )
+        end++;
+    auto r = std::from_chars( a.data(), end, v );
+    return r.ec == std::errc() && r.ptr == end;
+}
+
+constexpr std::array< std::uint32_t, 256 > MakeCrc32cTable()
+{
+    std::array< std::uint32_t, 256 > t{};
+    for( std::uint32_t i = 0; i < 256; i++ )
+    {
+        std::uint32_t c = i;
+        for( int k = 0; k < 8; k++ )
+            c = ( c & 1 ) ? ( c >> 1 ) ^ 0x82f63b78 : c >> 1;
+        t[ i ] = c;
+    }
+    return t;
+}
+
+constexpr std::array< std::uint32_t, 256 > CRC32C_TABLE = MakeCrc32cTable();
+
+constexpr size_t BATCH_ENTRY_HEADER_SIZE = 2 + 4;
+
+} // namespace
+
 constexpr long DecodedHeader::MAX_KEY_SIZE;
 constexpr long DecodedHeader::MAX_VALUE_SIZE;
+constexpr long DecodedHeader::MAX_BATCH_COUNT;
+constexpr long DecodedHeader::MAX_BATCH_SIZE;
 
 constexpr std::array< char, 8 > RequestHeader::MAGIC;
 constexpr std::array< char, 8 > RequestHeader::INS;
 constexpr std::array< char, 8 > RequestHeader::UPD;
 constexpr std::array< char, 8 > RequestHeader::DEL;
 constexpr std::array< char, 8 > RequestHeader::GET;
+constexpr std::array< char, 8 > RequestHeader::MGET;
+constexpr std::array< char, 8 > RequestHeader::MSET;
+constexpr std::array< char, 8 > RequestHeader::MDEL;
+constexpr std::array< char, 8 > RequestHeader::SCAN;
+constexpr std::array< char, 8 > RequestHeader::STATS;
+
+constexpr std::array< char, 4 > RequestHeaderV2::MAGIC;
+constexpr unsigned char RequestHeaderV2::FLAG_CHECKSUM;
 
 constexpr std::array< char, 8 > RequestFooter::MAGIC;
 
+constexpr size_t ScanParameters::SIZE;
+constexpr unsigned char ScanParameters::FLAG_PREFIX;
+constexpr unsigned char ScanParameters::FLAG_AFTER;
+
+constexpr long ResponseHeader::MAX_BATCH_REPLY_SIZE;
+constexpr std::array< char, 8 > ResponseHeader::MAGIC;
+constexpr std::array< char, 4 > ResponseHeaderV2::MAGIC;
+
+static_assert( sizeof( RequestHeader ) == REQUEST_HEADER_SIZE && sizeof( RequestHeaderV2 ) == REQUEST_HEADER_SIZE, "request headers must have the same size" );
+static_assert( sizeof( ResponseHeader ) == 16 && sizeof( ResponseHeaderV2 ) == 24, "unexpected response header padding" );
+
 DecodedHeader::DecodedHeader( Opcode o, unsigned short kl, unsigned int vl )
     : mValueLength{ vl }
     , mKeyLength{ kl }
-    , mOpcode{ Opcode::opInvalid }
+    , mOpcode{ o }
+    , mVersion{ 1 }
+    , mHasChecksum{ false }
+    , mChecksum{ 0 }
+    , mRequestId{ 0 }
+    , mTtl{ 0 }
 {
 }
 
 DecodedHeader::DecodedHeader( std::string const& o, unsigned short kl, unsigned int vl )
-    : mValueLength{ vl }
-    , mKeyLength{ kl }
-    , mOpcode{ Opcode::opInvalid }
+    : DecodedHeader( Opcode::opInvalid, kl, vl )
 {
     std::array< char, 8 > oo;
     for( size_t i = 0; i < 8 && i < o.length(); i++ )
@@ -38,37 +127,108 @@ DecodedHeader::DecodedHeader( std::string const& o, unsigned short kl, unsigned
         mOpcode = Opcode::opDelete;
     else if( oo == RequestHeader::GET )
         mOpcode = Opcode::opGet;
+    else if( oo == RequestHeader::MGET )
+        mOpcode = Opcode::opMultiGet;
+    else if( oo == RequestHeader::MSET )
+        mOpcode = Opcode::opMultiSet;
+    else if( oo == RequestHeader::MDEL )
+        mOpcode = Opcode::opMultiDelete;
+    else if( oo == RequestHeader::SCAN )
+        mOpcode = Opcode::opScan;
+    else if( oo == RequestHeader::STATS )
+        mOpcode = Opcode::opStats;
 }
 
 DecodedHeader::DecodedHeader( RequestHeader const& h )
-    : mValueLength{ 0 }
-    , mKeyLength{ 0 }
-    , mOpcode{ Opcode::opInvalid }
+    : DecodedHeader( Opcode::opInvalid, 0, 0 )
 {
     if( h.mHeader != RequestHeader::MAGIC )
         return;
 
-    long kl = std::stol( std::string( h.mKeyLength.begin(), h.mKeyLength.end() ) );
-    if( kl < 1 || kl > MAX_KEY_SIZE )
-        return;
-
-    long vl = std::stol( std::string( h.mValueLength.begin(), h.mValueLength.end() ) );
-    if( vl < 0 || vl > MAX_VALUE_SIZE )
-        return;
-
+    Opcode o;
     if( h.mOpcode == RequestHeader::INS )
-        mOpcode = Opcode::opInsert;
+        o = Opcode::opInsert;
     else if( h.mOpcode == RequestHeader::UPD )
-        mOpcode = Opcode::opUpdate;
+        o = Opcode::opUpdate;
     else if( h.mOpcode == RequestHeader::DEL )
-        mOpcode = Opcode::opDelete;
+        o = Opcode::opDelete;
     else if( h.mOpcode == RequestHeader::GET )
-        mOpcode = Opcode::opGet;
+        o = Opcode::opGet;
+    else if( h.mOpcode == RequestHeader::MGET )
+        o = Opcode::opMultiGet;
+    else if( h.mOpcode == RequestHeader::MSET )
+        o = Opcode::opMultiSet;
+    else if( h.mOpcode == RequestHeader::MDEL )
+        o = Opcode::opMultiDelete;
+    else if( h.mOpcode == RequestHeader::SCAN )
+        o = Opcode::opScan;
+    else if( h.mOpcode == RequestHeader::STATS )
+        o = Opcode::opStats;
     else
         return;
 
-    mValueLength = vl;
-    mKeyLength = kl;
+    long kl = 0, vl = 0;
+    if( !ParseLength( h.mKeyLength, kl ) || !ParseLength( h.mValueLength, vl ) )
+        return;
+    if( kl < 0 || kl > MAX_KEY_SIZE || vl < 0 || vl > MAX_BATCH_SIZE )
+        return;
+
+    DecodedHeader d{ o, static_cast< unsigned short >( kl ), static_cast< unsigned int >( vl ) };
+    if( !d.IsValid() )
+        return;
+
+    *this = d;
+}
+
+DecodedHeader::DecodedHeader( RequestHeaderV2 const& h )
+    : DecodedHeader( Opcode::opInvalid, 0, 0 )
+{
+    mVersion = 2;
+    if( h.mHeader != RequestHeaderV2::MAGIC || h.mOpcode >= static_cast< unsigned char >( Opcode::op__MaxCount ) )
+        return;
+    if( ( h.mFlags & ~RequestHeaderV2::FLAG_CHECKSUM ) != 0 || LoadLittleEndian( h.mReserved ) != 0 )
+        return;
+
+    DecodedHeader d{ static_cast< Opcode >( h.mOpcode ),
+                     static_cast< unsigned short >( LoadLittleEndian( h.mKeyLength ) ),
+                     static_cast< unsigned int >( LoadLittleEndian( h.mValueLength ) ) };
+    d.mTtl = static_cast< std::uint32_t >( LoadLittleEndian( h.mTtl ) );
+    if( !d.IsValid() )
+        return;
+
+    d.mVersion = 2;
+    d.mHasChecksum = ( h.mFlags & RequestHeaderV2::FLAG_CHECKSUM ) != 0;
+    d.mChecksum = static_cast< std::uint32_t >( LoadLittleEndian( h.mChecksum ) );
+    d.mRequestId = LoadLittleEndian( h.mRequestId );
+    *this = d;
+}
+
+bool DecodedHeader::IsBatch() const
+{
+    return mOpcode == Opcode::opMultiGet || mOpcode == Opcode::opMultiSet || mOpcode == Opcode::opMultiDelete;
+}
+
+bool DecodedHeader::IsValid() const
+{
+    if( mOpcode == Opcode::opInvalid )
+        return false;
+    if( mTtl != 0 && mOpcode != Opcode::opInsert && mOpcode != Opcode::opUpdate && mOpcode != Opcode::opMultiSet )
+        return false;
+    if( mOpcode == Opcode::opScan )
+        return mKeyLength <= MAX_KEY_SIZE && mValueLength >= ScanParameters::SIZE && mValueLength <= ScanParameters::SIZE + MAX_KEY_SIZE;
+    if( mOpcode == Opcode::opStats )
+        return mKeyLength == 0 && mValueLength == 0;
+    if( IsBatch() )
+        return mKeyLength >= 1 && mKeyLength <= MAX_BATCH_COUNT && mValueLength <= MAX_BATCH_SIZE;
+    return mKeyLength >= 1 && mKeyLength <= MAX_KEY_SIZE && mValueLength <= MAX_VALUE_SIZE;
+}
+
+size_t DecodedHeader::BodySize() const
+{
+    size_t size = IsBatch() ? mValueLength : mKeyLength + mValueLength;
+    if( mVersion == 1 )
+        size += sizeof( RequestFooter );
+    return size;
 }
 
 RequestHeader::RequestHeader( DecodedHeader const& h )
@@ -77,9 +237,7 @@ RequestHeader::RequestHeader( DecodedHeader const& h )
     , mKeyLength( { '\0','\0','\0','\0','\0','\0','\0','\0' } )
     , mValueLength( { '\0','\0','\0','\0','\0','\0','\0','\0' } )
 {
-    if( h.mKeyLength < 1 || h.mKeyLength > 1024 )
-        return;
-    if( h.mValueLength < 0 || h.mValueLength > 1048576 )
+    if( !h.IsValid() )
         return;
     if( h.mOpcode == Opcode::opInsert )
         mOpcode = INS;
@@ -89,6 +247,16 @@ RequestHeader::RequestHeader( DecodedHeader const& h )
         mOpcode = DEL;
     else if( h.mOpcode == Opcode::opGet )
         mOpcode = GET;
+    else if( h.mOpcode == Opcode::opMultiGet )
+        mOpcode = MGET;
+    else if( h.mOpcode == Opcode::opMultiSet )
+        mOpcode = MSET;
+    else if( h.mOpcode == Opcode::opMultiDelete )
+        mOpcode = MDEL;
+    else if( h.mOpcode == Opcode::opScan )
+        mOpcode = SCAN;
+    else if( h.mOpcode == Opcode::opStats )
+        mOpcode = STATS;
     else
         return;
     std::string kl = std::to_string( h.mKeyLength );
@@ -97,9 +265,162 @@ RequestHeader::RequestHeader( DecodedHeader const& h )
     std::transform( vl.begin(), vl.end(), mValueLength.begin(), []( unsigned char c ) -> unsigned char { return c; } );
 }
 
+RequestHeaderV2::RequestHeaderV2( DecodedHeader const& h )
+    : mHeader( MAGIC )
+    , mOpcode( static_cast< unsigned char >( h.mOpcode ) )
+    , mFlags( h.mHasChecksum ? FLAG_CHECKSUM : 0 )
+    , mReserved{}
+{
+    StoreLittleEndian( mKeyLength, h.mKeyLength );
+    StoreLittleEndian( mValueLength, h.mValueLength );
+    StoreLittleEndian( mChecksum, h.mHasChecksum ? h.mChecksum : 0 );
+    StoreLittleEndian( mRequestId, h.mRequestId );
+    StoreLittleEndian( mTtl, h.mTtl );
+}
+
+DecodedHeader DecodeRequestHeader( std::array< char, REQUEST_HEADER_SIZE > const& raw )
+{
+    if( std::equal( RequestHeaderV2::MAGIC.begin(), RequestHeaderV2::MAGIC.end(), raw.begin() ) )
+    {
+        RequestHeaderV2 h{ DecodedHeader( Opcode::opInvalid, 0, 0 ) };
+        ::memcpy( &h, raw.data(), sizeof( h ) );
+        return DecodedHeader( h );
+    }
+    RequestHeader h{ DecodedHeader( Opcode::opInvalid, 0, 0 ) };
+    ::memcpy( &h, raw.data(), sizeof( h ) );
+    return DecodedHeader( h );
+}
+
+std::uint32_t Crc32c( std::uint32_t crc, char const* data, size_t size )
+{
+    crc = ~crc;
+#if defined __SSE4_2__
+    for( ; size >= 8; size -= 8, data += 8 )
+    {
+        std::uint64_t v;
+        ::memcpy( &v, data, sizeof( v ) );
+        crc = static_cast< std::uint32_t >( _mm_crc32_u64( crc, v ) );
+    }
+#endif
+    for( ; size > 0; size--, data++ )
+        crc = CRC32C_TABLE[ ( crc ^ static_cast< unsigned char >( *data ) ) & 0xff ] ^ ( crc >> 8 );
+    return ~crc;
+}
+
 RequestFooter::RequestFooter()
     : mFooter( MAGIC )
 {
 }
 
+void AppendBatchEntry( std::string& payload, std::string_view key, std::string_view value )
+{
+    char h[ BATCH_ENTRY_HEADER_SIZE ];
+    StoreLittleEndian< 2 >( h, static_cast< std::uint32_t >( key.size() ) );
+    StoreLittleEndian< 4 >( h + 2, static_cast< std::uint32_t >( value.size() ) );
+    payload.append( h, sizeof( h ) );
+    payload.append( key );
+    payload.append( value );
+}
+
+bool ParseBatch( std::string_view payload, size_t count, std::vector< BatchEntry >& entries )
+{
+    entries.clear();
+    entries.reserve( count );
+    return ParseScanItems( payload, entries ) && entries.size() == count;
+}
+
+void AppendScanParameters( std::string& payload, ScanParameters const& p )
+{
+    char h[ ScanParameters::SIZE ];
+    h[ 0 ] = static_cast< char >( p.mFlags );
+    StoreLittleEndian< 4 >( h + 1, p.mLimit );
+    payload.append( h, sizeof( h ) );
+    payload.append( p.mBound );
+}
+
+bool ParseScanParameters( std::string_view payload, ScanParameters& p )
+{
+    if( payload.size() < ScanParameters::SIZE || payload.size() > ScanParameters::SIZE + DecodedHeader::MAX_KEY_SIZE )
+        return false;
+    p.mFlags = static_cast< unsigned char >( payload[ 0 ] );
+    p.mLimit = static_cast< std::uint32_t >( LoadLittleEndian< 4 >( payload.data() + 1 ) );
+    p.mBound = payload.substr( ScanParameters::SIZE );
+    return ( p.mFlags & ~( ScanParameters::FLAG_PREFIX | ScanParameters::FLAG_AFTER ) ) == 0;
+}
+
+bool ParseScanItems( std::string_view payload, std::vector< BatchEntry >& entries )
+{
+    entries.clear();
+    while( !payload.empty() )
+    {
+        if( payload.size() < BATCH_ENTRY_HEADER_SIZE )
+            return false;
+        size_t kl = LoadLittleEndian< 2 >( payload.data() );
+        size_t vl = LoadLittleEndian< 4 >( payload.data() + 2 );
+        payload.remove_prefix( BATCH_ENTRY_HEADER_SIZE );
+        if( kl < 1 || kl > DecodedHeader::MAX_KEY_SIZE || vl > DecodedHeader::MAX_VALUE_SIZE || kl + vl > payload.size() )
+            return false;
+        entries.emplace_back( payload.substr( 0, kl ), payload.substr( kl, vl ) );
+        payload.remove_prefix( kl + vl );
+    }
+    return true;
+}
+
+DecodedResponseHeader::DecodedResponseHeader( Status s, unsigned int vl, std::uint64_t id )
+    : mValueLength{ vl }
+    , mStatus{ s }
+    , mRequestId{ id }
+{
+}
+
+DecodedResponseHeader::DecodedResponseHeader( ResponseHeader const& h )
+    : DecodedResponseHeader( Status::stInvalid, 0 )
+{
+    if( h.mHeader != ResponseHeader::MAGIC )
+        return;
+
+    std::uint64_t s = LoadLittleEndian( h.mStatus );
+    if( s >= static_cast< std::uint64_t >( Status::st__MaxCount ) )
+        return;
+
+    std::uint64_t vl = LoadLittleEndian( h.mValueLength );
+    if( vl > ResponseHeader::MAX_BATCH_REPLY_SIZE )
+        return;
+
+    mStatus = static_cast< Status >( s );
+    mValueLength = static_cast< unsigned int >( vl );
+}
+
+DecodedResponseHeader::DecodedResponseHeader( ResponseHeaderV2 const& h )
+    : DecodedResponseHeader( Status::stInvalid, 0 )
+{
+    if( h.mHeader != ResponseHeaderV2::MAGIC )
+        return;
+
+    std::uint64_t s = LoadLittleEndian( h.mStatus );
+    std::uint64_t vl = LoadLittleEndian( h.mValueLength );
+    if( s >= static_cast< std::uint64_t >( Status::st__MaxCount ) || vl > ResponseHeader::MAX_BATCH_REPLY_SIZE )
+        return;
+
+    mStatus = static_cast< Status >( s );
+    mValueLength = static_cast< unsigned int >( vl );
+    mRequestId = LoadLittleEndian( h.mRequestId );
+}
+
+ResponseHeader::ResponseHeader( DecodedResponseHeader const& h )
+    : mHeader( MAGIC )
+{
+    StoreLittleEndian( mStatus, static_cast< std::uint32_t >( h.mStatus ) );
+    StoreLittleEndian( mValueLength, h.mValueLength );
+}
+
+ResponseHeaderV2::ResponseHeaderV2( DecodedResponseHeader const& h )
+    : mHeader( MAGIC )
+    , mReserved{}
+{
+    StoreLittleEndian( mStatus, static_cast< std::uint32_t >( h.mStatus ) );
+    StoreLittleEndian( mValueLength, h.mValueLength );
+    StoreLittleEndian( mRequestId, h.mRequestId );
+}
+
 } // namespace network
@@ -2,6 +2,10 @@
 
 #include <array>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <cstdint>
 
 template < std::size_t N, std::size_t ... Is >
 constexpr std::array< char, N - 1 > ToArray( const char ( &a )[ N ], std::index_sequence< Is... > )
@@ -21,27 +25,60 @@ enum class Opcode
     opUpdate,
     opDelete,
     opGet,
+    opMultiGet,
+    opMultiSet,
+    opMultiDelete,
+    opScan,
+    opStats,
     op__MaxCount,
     opInvalid = op__MaxCount
 };
 
+enum class Status
+{
+    stSuccess,
+    stKeyNotFound,
+    stKeyAlreadyExists,
+    stValueNotChanged,
+    stBadRequest,
+    stInternalError,
+    stPartial, // one of the streamed SCAN replies, more follow
+    st__MaxCount,
+    stInvalid = st__MaxCount
+};
+
 namespace network
 {
 
 struct RequestHeader;
+struct RequestHeaderV2;
 
+// MGET, MSET and MDEL requests carry the number of entries in the key length field
+// and the size of the packed entries (see AppendBatchEntry) in the value length field
 struct DecodedHeader
 {
     static constexpr long MAX_KEY_SIZE = 1024;
     static constexpr long MAX_VALUE_SIZE = 1024 * 1024;
+    static constexpr long MAX_BATCH_COUNT = 1024;
+    static constexpr long MAX_BATCH_SIZE = 16 * 1024 * 1024;
 
     DecodedHeader( Opcode o, unsigned short kl, unsigned int vl );
     DecodedHeader( std::string const& o, unsigned short kl, unsigned int vl );
     DecodedHeader( RequestHeader const& rh );
+    DecodedHeader( RequestHeaderV2 const& rh );
+
+    bool IsBatch() const;
+    bool IsValid() const;
+    size_t BodySize() const; // bytes following the header, including the version 1 footer
 
     unsigned int mValueLength;
     unsigned short mKeyLength;
     Opcode mOpcode;
+    unsigned char mVersion; // 1 or 2
+    bool mHasChecksum;
+    std::uint32_t mChecksum;
+    std::uint64_t mRequestId;
+    std::uint32_t mTtl; // seconds, 0 - the item does not expire; INSERT, UPDATE and MSET of version 2 only
 };
 
 struct RequestHeader
@@ -51,15 +88,47 @@ struct RequestHeader
     static constexpr std::array< char, 8 > UPD{ ToArray( "UPDATE  " ) };
     static constexpr std::array< char, 8 > DEL{ ToArray( "DELETE  " ) };
     static constexpr std::array< char, 8 > GET{ ToArray( "GET     " ) };
+    static constexpr std::array< char, 8 > MGET{ ToArray( "MGET    " ) };
+    static constexpr std::array< char, 8 > MSET{ ToArray( "MSET    " ) };
+    static constexpr std::array< char, 8 > MDEL{ ToArray( "MDEL    " ) };
+    static constexpr std::array< char, 8 > SCAN{ ToArray( "SCAN    " ) };
+    static constexpr std::array< char, 8 > STATS{ ToArray( "STATS   " ) };
 
     RequestHeader( DecodedHeader const& h );
 
     std::array< char, 8 > mHeader; // 0x5535ecaf9c9a7be2 - magic start request sequence
-    std::array< char, 8 > mOpcode; // "INSERT  ", "UPDATE  ", "DELETE  ", "GET     "
-    std::array< char, 8 > mKeyLength; // 1..1024
-    std::array< char, 8 > mValueLength; // 1..1048576
+    std::array< char, 8 > mOpcode; // "INSERT  ", "UPDATE  ", "DELETE  ", "GET     ", "MGET    ", "MSET    ", "MDEL    ", "SCAN    ", "STATS   "
+    std::array< char, 8 > mKeyLength; // 1..1024 (0..1024 for SCAN, 0 for STATS), number of entries 1..1024 for batches
+    std::array< char, 8 > mValueLength; // 1..1048576, payload size up to 16777216 for batches
 };
 
+// Version 2 header is as long as version 1 and is told apart by its magic, so both can be used on one connection.
+// All integers are little-endian. There is no footer; body is key and value, or the batch payload.
+struct RequestHeaderV2
+{
+    static constexpr std::array< char, 4 > MAGIC{ '\xd7', '\x4b', '\x56', '\x32' };
+    static constexpr unsigned char FLAG_CHECKSUM = 0x01;
+
+    RequestHeaderV2( DecodedHeader const& h );
+
+    std::array< char, 4 > mHeader; // 0xd74b5632 - magic start request sequence
+    unsigned char mOpcode; // Opcode
+    unsigned char mFlags; // FLAG_CHECKSUM
+    std::array< char, 2 > mKeyLength; // 1..1024 (0..1024 for SCAN, 0 for STATS), number of entries 1..1024 for batches
+    std::array< char, 4 > mValueLength; // 0..1048576, payload size up to 16777216 for batches
+    std::array< char, 4 > mChecksum; // CRC-32C of the body, when FLAG_CHECKSUM is set
+    std::array< char, 8 > mRequestId; // echoed in the reply
+    std::array< char, 4 > mTtl; // time to live of the written items in seconds, zero - no expiry
+    std::array< char, 4 > mReserved; // zero
+};
+
+constexpr size_t REQUEST_HEADER_SIZE = 32;
+
+// Decodes a request header of either version, mOpcode is opInvalid for malformed headers
+DecodedHeader DecodeRequestHeader( std::array< char, REQUEST_HEADER_SIZE > const& raw );
+
+std::uint32_t Crc32c( std::uint32_t crc, char const* data, size_t size );
+
 struct RequestFooter
 {
     static constexpr std::array< char, 8 > MAGIC{ '\x1e', '\x1e', '\xf7', '\x91', '\xe9', '\x5e', '\xff', '\x53' };
@@ -69,4 +138,75 @@ struct RequestFooter
     std::array< char, 8 > mFooter; // 1e1ef791e95eff53 - magic end request sequence
 };
 
+typedef std::pair< std::string_view, std::string_view > BatchEntry;
+
+// Batch payload entry is a 2-byte key length and a 4-byte value length (little-endian), then key and value.
+// MGET and MDEL entries have empty values.
+void AppendBatchEntry( std::string& payload, std::string_view key, std::string_view value );
+bool ParseBatch( std::string_view payload, size_t count, std::vector< BatchEntry >& entries );
+
+// SCAN request key is the start key, empty to start from the first key; the value holds the parameters:
+// flags byte, 4-byte limit (little-endian, 0 - no limit), then the bound, an end key (excluded) or a key prefix.
+// Items come back in key order in stPartial replies, each a batch payload of keys and values. The closing stSuccess reply
+// carries the cursor: the last key sent if the limit stopped the scan, empty if the range is exhausted.
+// A SCAN from the cursor with FLAG_AFTER and the same bound continues the scan.
+struct ScanParameters
+{
+    static constexpr size_t SIZE = 1 + 4; // without the bound
+    static constexpr unsigned char FLAG_PREFIX = 0x01; // the bound is a prefix of all keys, otherwise the end key
+    static constexpr unsigned char FLAG_AFTER = 0x02; // the start key is excluded
+
+    unsigned char mFlags = 0;
+    std::uint32_t mLimit = 0;
+    std::string_view mBound; // empty - up to the last key
+};
+
+void AppendScanParameters( std::string& payload, ScanParameters const& p );
+bool ParseScanParameters( std::string_view payload, ScanParameters& p );
+// Entries of a stPartial SCAN reply
+bool ParseScanItems( std::string_view payload, std::vector< BatchEntry >& entries );
+
+struct ResponseHeader;
+struct ResponseHeaderV2;
+
+struct DecodedResponseHeader
+{
+    DecodedResponseHeader( Status s, unsigned int vl, std::uint64_t id = 0 );
+    DecodedResponseHeader( ResponseHeader const& rh );
+    DecodedResponseHeader( ResponseHeaderV2 const& rh );
+
+    unsigned int mValueLength;
+    Status mStatus;
+    std::uint64_t mRequestId;
+};
+
+// Every reply starts with this header (ResponseHeaderV2 for version 2 requests) and is followed by exactly
+// mValueLength bytes of the value. Value of a successful batch reply is a sequence of complete replies
+// of the same version, one per request entry.
+struct ResponseHeader
+{
+    static constexpr long MAX_BATCH_REPLY_SIZE = DecodedHeader::MAX_BATCH_COUNT * ( DecodedHeader::MAX_VALUE_SIZE + 24 ); // with nested headers
+
+    static constexpr std::array< char, 8 > MAGIC{ '\x3c', '\x6b', '\x0a', '\xd2', '\x47', '\x8e', '\x15', '\xb9' };
+
+    ResponseHeader( DecodedResponseHeader const& h );
+
+    std::array< char, 8 > mHeader; // 0x3c6b0ad2478e15b9 - magic start response sequence
+    std::array< char, 4 > mStatus; // Status, little-endian
+    std::array< char, 4 > mValueLength; // 0..1048576, up to MAX_BATCH_REPLY_SIZE for batches, little-endian
+};
+
+struct ResponseHeaderV2
+{
+    static constexpr std::array< char, 4 > MAGIC{ '\xd7', '\x4b', '\x52', '\x32' };
+
+    ResponseHeaderV2( DecodedResponseHeader const& h );
+
+    std::array< char, 4 > mHeader; // 0xd74b5232 - magic start response sequence
+    std::array< char, 4 > mStatus; // Status
+    std::array< char, 4 > mValueLength; // 0..1048576, up to ResponseHeader::MAX_BATCH_REPLY_SIZE for batches
+    std::array< char, 4 > mReserved; // zero
+    std::array< char, 8 > mRequestId; // copied from the request
+};
+
 } // namespace network
@@ -0,0 +1,165 @@
+#include "kvdb_server_cache.hpp"
+
+#include <algorithm>
+
+namespace storage
+{
+
+constexpr size_t S3Fifo::ITEM_OVERHEAD;
+constexpr size_t S3Fifo::ENTRY_OVERHEAD;
+constexpr size_t S3Fifo::GHOST_OVERHEAD;
+constexpr size_t S3Fifo::SMALL_SHARE;
+
+S3Fifo::S3Fifo( size_t budget )
+    : mBudget( budget )
+{
+}
+
+size_t S3Fifo::Cost( std::string_view key, Value const& v )
+{
+    return key.size() + v.Size() + ITEM_OVERHEAD + EntryCost( key );
+}
+
+size_t S3Fifo::EntryCost( std::string_view key )
+{
+    return key.size() + ENTRY_OVERHEAD;
+}
+
+size_t S3Fifo::Used() const
+{
+    return mBytes + mStaleBytes + mGhost.size() * GHOST_OVERHEAD;
+}
+
+void S3Fifo::Added( std::string_view key, Value const& v )
+{
+    size_t cost = Cost( key, v );
+    v.mStamp = ++mStamp;
+    v.mFrequency.store( 0, std::memory_order_relaxed );
+    v.mMain = Forget( key );
+    ( v.mMain ? mMain : mSmall ).push_back( Entry{ std::string( key ), v.mStamp } );
+    if( !v.mMain )
+        mSmallBytes += cost;
+    mBytes += cost;
+    mItems++;
+}
+
+void S3Fifo::Replaced( std::string_view key, Value const& old, Value const& v )
+{
+    // A write counts as a read and keeps the place of the item in its queue
+    size_t old_cost = Cost( key, old );
+    size_t cost = Cost( key, v );
+    v.mStamp = old.mStamp;
+    v.mFrequency.store( std::min< std::uint8_t >( old.mFrequency.load( std::memory_order_relaxed ) + 1, Value::MAX_FREQUENCY ),
+                        std::memory_order_relaxed );
+    v.mMain = old.mMain;
+    if( !v.mMain )
+        mSmallBytes = mSmallBytes - old_cost + cost;
+    mBytes = mBytes - old_cost + cost;
+}
+
+void S3Fifo::Removed( std::string_view key, Value const& v )
+{
+    size_t cost = Cost( key, v );
+    if( !v.mMain )
+        mSmallBytes -= cost;
+    mBytes -= cost;
+    mItems--;
+    mStale++;
+    mStaleBytes += EntryCost( key );
+}
+
+void S3Fifo::Evicted( std::string_view key, Value const& v )
+{
+    bool small = !v.mMain;
+    Removed( key, v );
+    mStale--; // its entry is already off the queue
+    mStaleBytes -= EntryCost( key );
+    if( small )
+        Remember( key );
+}
+
+bool S3Fifo::NextVictim( Lookup const& current, std::string& key )
+{
+    // Entries of removed items are dropped once they outnumber the items, which is amortized O(1) per removal,
+    // or once they take an eighth of the budget, so long keys of removed items do not push live items out
+    if( mStale > mItems + 1024 || mStaleBytes > mBudget / 8 )
+    {
+        Purge( mSmall, current );
+        Purge( mMain, current );
+        mStale = 0;
+        mStaleBytes = 0;
+    }
+
+    while( Used() > mBudget )
+    {
+        bool small = !mSmall.empty() && ( mSmallBytes * 100 >= mBudget * SMALL_SHARE || mMain.empty() );
+        std::deque< Entry >& queue = small ? mSmall : mMain;
+        if( queue.empty() )
+            return false;
+        Entry entry = std::move( queue.front() );
+        queue.pop_front();
+        Value const* v = current( entry.mKey );
+        if( v == nullptr || v->mStamp != entry.mStamp )
+        {
+            mStale -= std::min< size_t >( mStale, 1 );
+            mStaleBytes -= std::min( mStaleBytes, EntryCost( entry.mKey ) );
+            continue;
+        }
+        std::uint8_t frequency = v->mFrequency.load( std::memory_order_relaxed );
+        if( frequency == 0 )
+        {
+            key = std::move( entry.mKey );
+            return true;
+        }
+        if( small )
+        {
+            mSmallBytes -= Cost( entry.mKey, *v );
+            v->mMain = true;
+            v->mFrequency.store( 0, std::memory_order_relaxed );
+        }
+        else
+            v->mFrequency.store( frequency - 1, std::memory_order_relaxed );
+        mMain.push_back( std::move( entry ) );
+    }
+    return false;
+}
+
+void S3Fifo::Purge( std::deque< Entry >& queue, Lookup const& current )
+{
+    queue.erase( std::remove_if( queue.begin(), queue.end(), [ & ]( Entry const& e )
+    {
+        Value const* v = current( e.mKey );
+        return v == nullptr || v->mStamp != e.mStamp;
+    } ), queue.end() );
+}
+
+void S3Fifo::Remember( std::string_view key )
+{
+    // The ghost queue remembers about as many keys as there are items
+    size_t hash = std::hash< std::string_view >{}( key );
+    mGhost.push_back( hash );
+    Ghost& ghost = mGhostHashes[ hash ];
+    ghost.mQueued++;
+    ghost.mRemembered = true;
+    while( mGhost.size() > mItems + 1 )
+    {
+        auto found = mGhostHashes.find( mGhost.front() );
+        if( --found->second.mQueued == 0 )
+            mGhostHashes.erase( found );
+        mGhost.pop_front();
+    }
+}
+
+bool S3Fifo::Forget( std::string_view key )
+{
+    if( mGhostHashes.empty() )
+        return false;
+    auto found = mGhostHashes.find( std::hash< std::string_view >{}( key ) );
+    if( found == mGhostHashes.end() || !found->second.mRemembered )
+        return false;
+    // The hash stays in the ghost queue and its entry goes when the last of them comes to the front
+    found->second.mRemembered = false;
+    return true;
+}
+
+} // namespace storage
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <deque>
+#include <unordered_map>
+#include <functional>
+
+#include "kvdb_server_value.hpp"
+
+namespace storage
+{
+
+// S3-FIFO eviction for one shard of an in-memory storage with a byte budget.
+// New items enter a small FIFO queue that holds a tenth of the budget. Items read while there move on to the main queue,
+// the others are evicted when they reach its head, so a scan over keys that are read once flushes only the small queue.
+// Keys evicted from the small queue are remembered in a ghost queue and go straight to the main queue when written again.
+// The main queue works as a CLOCK: an item read since it last came round gets another round, up to MAX_FREQUENCY of them.
+// A read only bumps a relaxed atomic counter in the value, so readers keep to the shared lock;
+// all other calls need the exclusive shard lock.
+// Queue entries are not removed with their items, they are told apart by a stamp and dropped when they come up.
+// The budget covers the items with their queue entries and key copies, the entries of removed items until they are dropped,
+// and the ghost queue.
+class S3Fifo
+{
+public:
+    static constexpr size_t ITEM_OVERHEAD = 64; // map node and value header, roughly
+    static constexpr size_t ENTRY_OVERHEAD = 48; // queue entry and heap block of its key copy, roughly
+    static constexpr size_t GHOST_OVERHEAD = 48; // ghost queue slot and map node, roughly
+    static constexpr size_t SMALL_SHARE = 10; // percent of the budget
+
+    // Current value stored for a key, nullptr if there is none
+    typedef std::function< Value const*( std::string_view ) > Lookup;
+
+    explicit S3Fifo( size_t budget );
+
+    // Of an item and its queue entry
+    static size_t Cost( std::string_view key, Value const& v );
+    void Added( std::string_view key, Value const& v );
+    void Replaced( std::string_view key, Value const& old, Value const& v );
+    void Removed( std::string_view key, Value const& v );
+    // Gives the key of the next item to evict while the shard is over the budget, the caller removes it with Evicted
+    bool NextVictim( Lookup const& current, std::string& key );
+    void Evicted( std::string_view key, Value const& v );
+
+private:
+    struct Entry
+    {
+        std::string mKey;
+        std::uint32_t mStamp;
+    };
+
+    // A key hash may be in the ghost queue more than once, it is remembered until a write takes it or the last entry leaves
+    struct Ghost
+    {
+        size_t mQueued = 0;
+        bool mRemembered = false;
+    };
+
+    static size_t EntryCost( std::string_view key );
+    size_t Used() const;
+    void Purge( std::deque< Entry >& queue, Lookup const& current );
+    void Remember( std::string_view key );
+    bool Forget( std::string_view key );
+
+    size_t mBudget;
+    size_t mBytes = 0;
+    size_t mSmallBytes = 0;
+    size_t mItems = 0;
+    size_t mStale = 0; // queue entries of removed items
+    size_t mStaleBytes = 0;
+    std::uint32_t mStamp = 0;
+    std::deque< Entry > mSmall;
+    std::deque< Entry > mMain;
+    std::deque< size_t > mGhost; // key hashes in eviction order
+    std::unordered_map< size_t, Ghost > mGhostHashes;
+};
+
+} // namespace storage
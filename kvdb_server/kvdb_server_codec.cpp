@@ -0,0 +1,226 @@
+#include "kvdb_server_codec.hpp"
+
+#include <cstring> // memcpy
+#include <algorithm>
+
+namespace storage
+{
+
+namespace codec
+{
+
+namespace
+{
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t LAST_LITERALS = 5; // a block ends with literals
+constexpr size_t MATCH_FIND_LIMIT = 12; // no match starts this close to the end
+constexpr size_t MAX_OFFSET = 65535;
+constexpr size_t LENGTH_MASK = 15; // of a token nibble, longer lengths go on in extra bytes
+constexpr int HASH_LOG = 12;
+
+std::uint32_t Load32( unsigned char const* p )
+{
+    std::uint32_t v;
+    ::memcpy( &v, p, sizeof( v ) );
+    return v;
+}
+
+size_t Hash( std::uint32_t sequence )
+{
+    return ( sequence * 2654435761u ) >> ( 32 - HASH_LOG );
+}
+
+unsigned char* WriteLength( unsigned char* op, size_t length )
+{
+    for( length -= LENGTH_MASK; length >= 255; length -= 255 )
+        *op++ = 255;
+    *op++ = static_cast< unsigned char >( length );
+    return op;
+}
+
+// Literals and a match, or the literals alone for the last sequence of a block
+unsigned char* WriteSequence( unsigned char* op, unsigned char const* literals, size_t literal_length, size_t offset, size_t match_length )
+{
+    unsigned char* token = op++;
+    *token = static_cast< unsigned char >( std::min( literal_length, LENGTH_MASK ) << 4 );
+    if( literal_length >= LENGTH_MASK )
+        op = WriteLength( op, literal_length );
+    ::memcpy( op, literals, literal_length );
+    op += literal_length;
+    if( match_length == 0 )
+        return op;
+    *op++ = static_cast< unsigned char >( offset );
+    *op++ = static_cast< unsigned char >( offset >> 8 );
+    match_length -= MIN_MATCH;
+    *token |= static_cast< unsigned char >( std::min( match_length, LENGTH_MASK ) );
+    if( match_length >= LENGTH_MASK )
+        op = WriteLength( op, match_length );
+    return op;
+}
+
+bool ReadLength( unsigned char const*& ip, unsigned char const* end, size_t& length )
+{
+    if( length != LENGTH_MASK )
+        return true;
+    unsigned char b;
+    do
+    {
+        if( ip == end )
+            return false;
+        b = *ip++;
+        length += b;
+    }
+    while( b == 255 );
+    return true;
+}
+
+} // namespace
+
+size_t CompressBound( size_t size )
+{
+    return size + size / 255 + 16;
+}
+
+size_t Compress( std::string_view data, char* out )
+{
+    unsigned char const* src = reinterpret_cast< unsigned char const* >( data.data() );
+    unsigned char const* end = src + data.size();
+    unsigned char const* anchor = src; // first byte not written yet
+    unsigned char* op = reinterpret_cast< unsigned char* >( out );
+    if( data.size() > MATCH_FIND_LIMIT )
+    {
+        // Last position of every hashed 4-byte sequence, a stale or colliding entry fails the comparison
+        std::uint32_t table[ size_t( 1 ) << HASH_LOG ] = {};
+        unsigned char const* limit = end - MATCH_FIND_LIMIT;
+        unsigned char const* match_end = end - LAST_LITERALS;
+        unsigned char const* ip = src + 1;
+        while( ip < limit )
+        {
+            std::uint32_t sequence = Load32( ip );
+            size_t h = Hash( sequence );
+            unsigned char const* ref = src + table[ h ];
+            table[ h ] = static_cast< std::uint32_t >( ip - src );
+            if( ref >= ip || static_cast< size_t >( ip - ref ) > MAX_OFFSET || Load32( ref ) != sequence )
+            {
+                ip += 1 + ( ( ip - anchor ) >> 6 ); // steps grow through data that does not match
+                continue;
+            }
+            while( ip > anchor && ref > src && ip[ -1 ] == ref[ -1 ] )
+            {
+                ip--;
+                ref--;
+            }
+            size_t length = MIN_MATCH;
+            while( ip + length < match_end && ip[ length ] == ref[ length ] )
+                length++;
+            op = WriteSequence( op, anchor, ip - anchor, ip - ref, length );
+            ip += length;
+            anchor = ip;
+        }
+    }
+    op = WriteSequence( op, anchor, end - anchor, 0, 0 );
+    return op - reinterpret_cast< unsigned char* >( out );
+}
+
+bool Decompress( std::string_view block, char* out, size_t size )
+{
+    unsigned char const* ip = reinterpret_cast< unsigned char const* >( block.data() );
+    unsigned char const* end = ip + block.size();
+    char* op = out;
+    char* out_end = out + size;
+    for( ; ; )
+    {
+        if( ip == end )
+            return false;
+        unsigned char token = *ip++;
+        size_t literal_length = token >> 4;
+        if( !ReadLength( ip, end, literal_length ) || literal_length > static_cast< size_t >( end - ip )
+                || literal_length > static_cast< size_t >( out_end - op ) )
+            return false;
+        ::memcpy( op, ip, literal_length );
+        op += literal_length;
+        ip += literal_length;
+        if( ip == end )
+            return op == out_end; // the last sequence has no match
+
+        if( end - ip < 2 )
+            return false;
+        size_t offset = ip[ 0 ] | static_cast< size_t >( ip[ 1 ] ) << 8;
+        ip += 2;
+        size_t match_length = token & LENGTH_MASK;
+        if( !ReadLength( ip, end, match_length ) )
+            return false;
+        match_length += MIN_MATCH;
+        if( offset == 0 || offset > static_cast< size_t >( op - out ) || match_length > static_cast< size_t >( out_end - op ) )
+            return false;
+        char const* ref = op - offset;
+        if( offset >= match_length )
+            ::memcpy( op, ref, match_length );
+        else
+        {
+            // The match overlaps the bytes it writes, as a run does
+            for( size_t i = 0; i < match_length; i++ )
+                op[ i ] = ref[ i ];
+        }
+        op += match_length;
+    }
+}
+
+} // namespace codec
+
+constexpr size_t Compression::RAW_SIZE_BYTES;
+
+Compression::Compression( size_t threshold )
+    : mThreshold( threshold )
+{
+}
+
+bool Compression::Pack( std::string_view data, std::string& packed )
+{
+    if( mThreshold == 0 || data.size() <= mThreshold )
+        return false;
+    packed.resize( RAW_SIZE_BYTES + codec::CompressBound( data.size() ) );
+    size_t size = RAW_SIZE_BYTES + codec::Compress( data, &packed[ RAW_SIZE_BYTES ] );
+    if( size > data.size() - data.size() / 8 )
+    {
+        mSkipped.fetch_add( 1, std::memory_order_relaxed );
+        return false;
+    }
+    for( size_t i = 0; i < RAW_SIZE_BYTES; i++ )
+        packed[ i ] = static_cast< char >( data.size() >> ( 8 * i ) );
+    packed.resize( size );
+    mPacked.fetch_add( 1, std::memory_order_relaxed );
+    mRawBytes.fetch_add( data.size(), std::memory_order_relaxed );
+    mPackedBytes.fetch_add( size, std::memory_order_relaxed );
+    return true;
+}
+
+size_t Compression::GetRawSize( std::string_view packed )
+{
+    if( packed.size() < RAW_SIZE_BYTES )
+        return 0;
+    size_t size = 0;
+    for( size_t i = RAW_SIZE_BYTES; i > 0; i-- )
+        size = ( size << 8 ) | static_cast< unsigned char >( packed[ i - 1 ] );
+    return size;
+}
+
+bool Compression::Unpack( std::string_view packed, char* out )
+{
+    size_t size = GetRawSize( packed );
+    return size != 0 && codec::Decompress( packed.substr( RAW_SIZE_BYTES ), out, size );
+}
+
+Compression::Info Compression::GetInfo() const
+{
+    Info info;
+    info.mEnabled = mThreshold != 0;
+    info.mPacked = mPacked.load( std::memory_order_relaxed );
+    info.mSkipped = mSkipped.load( std::memory_order_relaxed );
+    info.mRawBytes = mRawBytes.load( std::memory_order_relaxed );
+    info.mPackedBytes = mPackedBytes.load( std::memory_order_relaxed );
+    return info;
+}
+
+} // namespace storage
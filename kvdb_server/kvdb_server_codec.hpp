@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <atomic>
+
+namespace storage
+{
+
+// LZ77 block codec in the LZ4 block format: sequences of literals, each followed by a match of 4 or more bytes
+// copied from up to 64 KB back. Greedy matching over a small hash table, so it is fast rather than tight,
+// and the output of the same input is always the same.
+namespace codec
+{
+
+// Room the compressed block of size bytes may need
+size_t CompressBound( size_t size );
+// Writes the block of data to out, which has CompressBound( data.size() ) bytes, and returns its size
+size_t Compress( std::string_view data, char* out );
+// Restores exactly size bytes; false if the block is damaged or holds another size, nothing is read or written out of bounds
+bool Decompress( std::string_view block, char* out, size_t size );
+
+} // namespace codec
+
+// Policy of value compression of a storage: values longer than the threshold are kept compressed
+// when that saves at least an eighth of them. Packed bytes are the raw size (4 bytes, little-endian) and the block.
+class Compression
+{
+public:
+    static constexpr size_t RAW_SIZE_BYTES = 4;
+
+    // Values written since the start
+    struct Info
+    {
+        bool mEnabled = false;
+        std::uint64_t mPacked = 0; // values kept compressed
+        std::uint64_t mSkipped = 0; // values over the threshold that did not shrink enough
+        std::uint64_t mRawBytes = 0; // of the packed values
+        std::uint64_t mPackedBytes = 0;
+    };
+
+    // A threshold of 0 turns compression off
+    explicit Compression( size_t threshold = 0 );
+    // False if the value is to be kept as it is
+    bool Pack( std::string_view data, std::string& packed );
+    // Size of the value packed holds, 0 if it is damaged
+    static size_t GetRawSize( std::string_view packed );
+    // Restores GetRawSize( packed ) bytes to out
+    static bool Unpack( std::string_view packed, char* out );
+    Info GetInfo() const;
+
+private:
+    size_t mThreshold;
+    std::atomic< std::uint64_t > mPacked{ 0 };
+    std::atomic< std::uint64_t > mSkipped{ 0 };
+    std::atomic< std::uint64_t > mRawBytes{ 0 };
+    std::atomic< std::uint64_t > mPackedBytes{ 0 };
+};
+
+} // namespace storage
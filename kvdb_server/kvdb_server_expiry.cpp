@@ -0,0 +1,116 @@
+#include "kvdb_server_expiry.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+#include "kvdb_server_storage.hpp"
+
+namespace storage
+{
+
+constexpr std::chrono::milliseconds ExpiryWheel::TICK;
+constexpr size_t ExpiryWheel::SLOT_BITS;
+constexpr size_t ExpiryWheel::SLOTS;
+constexpr size_t ExpiryWheel::LEVELS;
+
+constexpr size_t Reaper::BATCH_SIZE;
+
+ExpiryWheel::ExpiryWheel()
+    : mTick( ExpiryNow() / TICK.count() )
+{
+}
+
+void ExpiryWheel::Schedule( std::string_view key, Expiry expiry )
+{
+    std::lock_guard< std::mutex > lock( mMutex );
+    Place( Entry{ std::string( key ), expiry } );
+    mCount++;
+}
+
+void ExpiryWheel::Place( Entry&& entry )
+{
+    // Rounded up, so a key is never due before its expiry
+    std::uint64_t tick = ( entry.mExpiry + TICK.count() - 1 ) / TICK.count();
+    if( tick <= mTick )
+    {
+        mDue.push_back( std::move( entry ) );
+        return;
+    }
+    std::uint64_t delta = tick - mTick;
+    size_t level = 0;
+    while( level + 1 < LEVELS && delta >> ( SLOT_BITS * ( level + 1 ) ) != 0 )
+        level++;
+    // Beyond the last level a key comes round early and is placed again
+    mSlots[ level ][ ( tick >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 ) ].push_back( std::move( entry ) );
+}
+
+void ExpiryWheel::Advance( std::uint64_t tick )
+{
+    if( mCount == 0 )
+    {
+        mTick = std::max( mTick, tick );
+        return;
+    }
+    std::vector< Entry > moved;
+    while( mTick < tick )
+    {
+        mTick++;
+        // Upper levels first, their keys may fall into the level 0 slot of this very tick
+        for( size_t level = LEVELS - 1; level > 0; level-- )
+        {
+            if( ( mTick & ( ( std::uint64_t( 1 ) << ( SLOT_BITS * level ) ) - 1 ) ) != 0 )
+                continue;
+            moved.swap( mSlots[ level ][ ( mTick >> ( SLOT_BITS * level ) ) & ( SLOTS - 1 ) ] );
+            for( Entry& e : moved )
+                Place( std::move( e ) );
+            moved.clear();
+        }
+        std::vector< Entry >& slot = mSlots[ 0 ][ mTick & ( SLOTS - 1 ) ];
+        std::move( slot.begin(), slot.end(), std::back_inserter( mDue ) );
+        slot.clear();
+    }
+}
+
+void ExpiryWheel::TakeDue( Expiry now, size_t limit, std::vector< Entry >& due )
+{
+    due.clear();
+    std::lock_guard< std::mutex > lock( mMutex );
+    Advance( now / TICK.count() );
+    size_t count = std::min( limit, mDue.size() );
+    std::move( mDue.end() - count, mDue.end(), std::back_inserter( due ) );
+    mDue.resize( mDue.size() - count );
+    mCount -= count;
+}
+
+size_t ExpiryWheel::GetCount() const
+{
+    std::lock_guard< std::mutex > lock( mMutex );
+    return mCount;
+}
+
+Reaper::Reaper( boost::asio::io_service& io_service, IStorage& storage )
+    : mIoService( io_service )
+    , mTimer( io_service )
+    , mStorage( storage )
+{
+}
+
+void Reaper::Launch()
+{
+    mTimer.expires_from_now( boost::posix_time::milliseconds( ExpiryWheel::TICK.count() ) );
+    mTimer.async_wait( [ this ]( boost::system::error_code const& ec ){ Reap( ec ); } );
+}
+
+void Reaper::Reap( boost::system::error_code const& ec )
+{
+    if( ec )
+        return;
+
+    // A full batch means more keys may be due, the next batch is queued behind the requests that are waiting
+    if( mStorage.ReapExpired( ExpiryNow(), BATCH_SIZE ) == BATCH_SIZE )
+        mIoService.post( [ this ](){ Reap( boost::system::error_code() ); } );
+    else
+        Launch();
+}
+
+} // namespace storage
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <array>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+
+#include "kvdb_server_value.hpp"
+
+namespace storage
+{
+
+class IStorage;
+
+// Hierarchical timer wheel of expiring keys.
+// A slot of level L spans SLOTS^L ticks, so LEVELS wheels cover SLOTS^LEVELS ticks, over 200 years.
+// A key goes to the lowest level that reaches its expiry and moves one level down whenever the wheel above turns to its slot,
+// so scheduling is O(1) and a key is moved at most LEVELS times before it is due.
+// Keys stay scheduled when they are written again or deleted; the storage checks the current expiry of every due key.
+class ExpiryWheel
+{
+public:
+    static constexpr std::chrono::milliseconds TICK{ 100 };
+    static constexpr size_t SLOT_BITS = 6;
+    static constexpr size_t SLOTS = size_t( 1 ) << SLOT_BITS;
+    static constexpr size_t LEVELS = 6;
+
+    struct Entry
+    {
+        std::string mKey;
+        Expiry mExpiry;
+    };
+
+    ExpiryWheel();
+    void Schedule( std::string_view key, Expiry expiry );
+    // Moves at most limit keys due at now to due
+    void TakeDue( Expiry now, size_t limit, std::vector< Entry >& due );
+    size_t GetCount() const;
+
+private:
+    void Place( Entry&& entry );
+    void Advance( std::uint64_t tick );
+
+    mutable std::mutex mMutex;
+    std::uint64_t mTick; // last tick processed
+    std::array< std::array< std::vector< Entry >, SLOTS >, LEVELS > mSlots;
+    std::vector< Entry > mDue;
+    size_t mCount = 0;
+};
+
+// Removes expired items in the background. Every tick it takes due keys from the storage in batches,
+// each batch is a handler of its own, so request handlers of the same threads run in between.
+class Reaper
+{
+public:
+    static constexpr size_t BATCH_SIZE = 1024;
+
+    Reaper( boost::asio::io_service& io_service, IStorage& storage );
+    void Launch();
+
+private:
+    void Reap( boost::system::error_code const& ec );
+
+    boost::asio::io_service& mIoService;
+    boost::asio::deadline_timer mTimer;
+    IStorage& mStorage;
+};
+
+} // namespace storage
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <cstring> // memcpy
+#include <string_view>
+#include <functional> // hash
+#include <memory> // allocator
+#include <utility> // pair
+#include <new>
+#if defined __SSE2__ || defined _M_X64 || ( defined _M_IX86_FP && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define KVDB_FLAT_MAP_SSE2
+#endif
+
+#include "kvdb_server_slab.hpp"
+
+namespace storage
+{
+
+// Key with a small buffer: keys up to INLINE_SIZE bytes live inside the slot and need no allocation, longer ones go to the slab allocator
+class FlatKey
+{
+public:
+    static constexpr size_t INLINE_SIZE = 28;
+
+    explicit FlatKey( std::string_view key )
+        : mSize( static_cast< std::uint32_t >( key.size() ) )
+    {
+        char* data = mData;
+        if( !IsInline() )
+        {
+            data = static_cast< char* >( SlabAllocator::Instance().Allocate( mSize ) );
+            ::memcpy( mData, &data, sizeof( data ) );
+        }
+        ::memcpy( data, key.data(), key.size() );
+    }
+    FlatKey( FlatKey&& other ) noexcept
+        : mSize( other.mSize )
+    {
+        ::memcpy( mData, other.mData, sizeof( mData ) );
+        other.mSize = 0;
+    }
+    FlatKey( FlatKey const& ) = delete;
+    FlatKey& operator=( FlatKey const& ) = delete;
+    ~FlatKey()
+    {
+        if( !IsInline() )
+            SlabAllocator::Instance().Deallocate( HeapData(), mSize );
+    }
+
+    std::string_view View() const
+    {
+        return std::string_view( IsInline() ? mData : HeapData(), mSize );
+    }
+    operator std::string_view() const
+    {
+        return View();
+    }
+
+private:
+    bool IsInline() const
+    {
+        return mSize <= INLINE_SIZE;
+    }
+    char* HeapData() const
+    {
+        char* data;
+        ::memcpy( &data, mData, sizeof( data ) );
+        return data;
+    }
+
+    std::uint32_t mSize;
+    char mData[ INLINE_SIZE ]; // key bytes, or a pointer to them for long keys
+};
+
+// Open addressing hash table in the Swiss table style. One control byte per slot keeps either
+// a 7-bit fingerprint of the key hash or an empty/deleted mark; control bytes are grouped by 16,
+// so a single SSE2 compare finds all fingerprint matches and free slots of a group at once.
+// Lookups probe whole groups and touch slot memory only for fingerprint matches.
+// Iterators and references are invalidated by insertion.
+template< typename T >
+class FlatHashMap
+{
+public:
+    struct Slot
+    {
+        Slot( std::string_view k, T&& v )
+            : first( k )
+            , second( std::move( v ) )
+        {
+        }
+        FlatKey first;
+        T second;
+    };
+
+    class iterator
+    {
+    public:
+        iterator( FlatHashMap const* map, size_t index )
+            : mMap( map )
+            , mIndex( index )
+        {
+            SkipFree();
+        }
+        Slot& operator*() const
+        {
+            return mMap->mSlots[ mIndex ];
+        }
+        Slot* operator->() const
+        {
+            return mMap->mSlots + mIndex;
+        }
+        iterator& operator++()
+        {
+            mIndex++;
+            SkipFree();
+            return *this;
+        }
+        bool operator==( iterator const& other ) const
+        {
+            return mIndex == other.mIndex;
+        }
+        bool operator!=( iterator const& other ) const
+        {
+            return mIndex != other.mIndex;
+        }
+        size_t Index() const
+        {
+            return mIndex;
+        }
+
+    private:
+        void SkipFree()
+        {
+            while( mIndex < mMap->mCapacity && !IsFull( mMap->mControl[ mIndex ] ) )
+                mIndex++;
+        }
+
+        FlatHashMap const* mMap;
+        size_t mIndex;
+    };
+
+    FlatHashMap() = default;
+    FlatHashMap( FlatHashMap const& ) = delete;
+    FlatHashMap& operator=( FlatHashMap const& ) = delete;
+    ~FlatHashMap()
+    {
+        Release();
+    }
+
+    size_t size() const
+    {
+        return mSize;
+    }
+    iterator begin() const
+    {
+        return iterator( this, 0 );
+    }
+    iterator end() const
+    {
+        return iterator( this, mCapacity );
+    }
+
+    iterator find( std::string_view key ) const
+    {
+        if( mCapacity == 0 )
+            return end();
+        size_t hash = Hash( key );
+        for( Probe p{ H1( hash ), GroupMask() }; ; p.Next() )
+        {
+            size_t base = p.mGroup * GROUP_SIZE;
+            for( unsigned m = Match( mControl + base, H2( hash ) ); m != 0; m &= m - 1 )
+            {
+                size_t i = base + CountTrailingZeros( m );
+                if( mSlots[ i ].first.View() == key )
+                    return iterator( this, i );
+            }
+            if( Match( mControl + base, EMPTY ) != 0 )
+                return end();
+        }
+    }
+
+    template< typename V >
+    std::pair< iterator, bool > emplace( std::string_view key, V&& value )
+    {
+        auto found = find( key );
+        if( found != end() )
+            return { found, false };
+        if( ( mSize + mDeleted + 1 ) * 8 > mCapacity * 7 )
+            Rehash( ( mSize + 1 ) * 16 > mCapacity * 7 ? mCapacity * 2 : mCapacity ); // grow, or just drop tombstones
+        size_t hash = Hash( key );
+        size_t i = FindFree( hash );
+        if( mControl[ i ] == DELETED )
+            mDeleted--;
+        mControl[ i ] = H2( hash );
+        new( mSlots + i ) Slot( key, T( std::forward< V >( value ) ) );
+        mSize++;
+        return { iterator( this, i ), true };
+    }
+
+    void erase( iterator it )
+    {
+        size_t i = it.Index();
+        mSlots[ i ].~Slot();
+        mControl[ i ] = DELETED; // keeps probe sequences through this slot intact
+        mSize--;
+        mDeleted++;
+    }
+
+private:
+    static constexpr size_t GROUP_SIZE = 16;
+    static constexpr size_t MIN_CAPACITY = GROUP_SIZE;
+    static constexpr std::int8_t EMPTY = -128; // 0b10000000
+    static constexpr std::int8_t DELETED = -2; // 0b11111110, full slots are 0..127
+
+    struct Probe
+    {
+        // Triangular sequence over groups visits every group once when their number is a power of two
+        void Next()
+        {
+            mStride++;
+            mGroup = ( mGroup + mStride ) & mMask;
+        }
+        size_t mGroup;
+        size_t mMask;
+        size_t mStride = 0;
+
+        Probe( size_t h, size_t mask )
+            : mGroup( h & mask )
+            , mMask( mask )
+        {
+        }
+    };
+
+    static bool IsFull( std::int8_t c )
+    {
+        return c >= 0;
+    }
+    static size_t Hash( std::string_view key )
+    {
+        return std::hash< std::string_view >{}( key );
+    }
+    static size_t H1( size_t hash )
+    {
+        return hash >> 7;
+    }
+    static std::int8_t H2( size_t hash )
+    {
+        return static_cast< std::int8_t >( hash & 0x7f );
+    }
+    static unsigned CountTrailingZeros( unsigned m )
+    {
+#if defined __GNUC__
+        return static_cast< unsigned >( __builtin_ctz( m ) );
+#else
+        unsigned n = 0;
+        while( ( m & 1 ) == 0 )
+        {
+            m >>= 1;
+            n++;
+        }
+        return n;
+#endif
+    }
+    // Bit i is set when control byte i of the group equals c
+    static unsigned Match( std::int8_t const* group, std::int8_t c )
+    {
+#if defined KVDB_FLAT_MAP_SSE2
+        __m128i ctrl = _mm_loadu_si128( reinterpret_cast< __m128i const* >( group ) );
+        return static_cast< unsigned >( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_set1_epi8( c ), ctrl ) ) );
+#else
+        unsigned m = 0;
+        for( size_t i = 0; i < GROUP_SIZE; i++ )
+            if( group[ i ] == c )
+                m |= 1u << i;
+        return m;
+#endif
+    }
+    // Bit i is set when slot i of the group is empty or deleted
+    static unsigned MatchFree( std::int8_t const* group )
+    {
+#if defined KVDB_FLAT_MAP_SSE2
+        __m128i ctrl = _mm_loadu_si128( reinterpret_cast< __m128i const* >( group ) );
+        return static_cast< unsigned >( _mm_movemask_epi8( ctrl ) );
+#else
+        unsigned m = 0;
+        for( size_t i = 0; i < GROUP_SIZE; i++ )
+            if( !IsFull( group[ i ] ) )
+                m |= 1u << i;
+        return m;
+#endif
+    }
+
+    size_t GroupMask() const
+    {
+        return mCapacity / GROUP_SIZE - 1;
+    }
+
+    size_t FindFree( size_t hash ) const
+    {
+        for( Probe p{ H1( hash ), GroupMask() }; ; p.Next() )
+        {
+            size_t base = p.mGroup * GROUP_SIZE;
+            unsigned m = MatchFree( mControl + base );
+            if( m != 0 )
+                return base + CountTrailingZeros( m );
+        }
+    }
+
+    void Rehash( size_t capacity )
+    {
+        if( capacity < MIN_CAPACITY )
+            capacity = MIN_CAPACITY;
+        std::int8_t* control = mControl;
+        Slot* slots = mSlots;
+        size_t old_capacity = mCapacity;
+
+        mControl = static_cast< std::int8_t* >( ::operator new( capacity ) );
+        mSlots = std::allocator< Slot >().allocate( capacity );
+        mCapacity = capacity;
+        mDeleted = 0;
+        ::memset( mControl, EMPTY, capacity );
+
+        for( size_t i = 0; i < old_capacity; i++ )
+        {
+            if( !IsFull( control[ i ] ) )
+                continue;
+            size_t hash = Hash( slots[ i ].first.View() );
+            size_t j = FindFree( hash );
+            mControl[ j ] = H2( hash );
+            new( mSlots + j ) Slot( std::move( slots[ i ] ) );
+            slots[ i ].~Slot();
+        }
+        if( control != nullptr )
+        {
+            ::operator delete( control );
+            std::allocator< Slot >().deallocate( slots, old_capacity );
+        }
+    }
+
+    void Release()
+    {
+        if( mControl == nullptr )
+            return;
+        for( size_t i = 0; i < mCapacity; i++ )
+            if( IsFull( mControl[ i ] ) )
+                mSlots[ i ].~Slot();
+        ::operator delete( mControl );
+        std::allocator< Slot >().deallocate( mSlots, mCapacity );
+        mControl = nullptr;
+        mSlots = nullptr;
+        mCapacity = 0;
+        mSize = 0;
+        mDeleted = 0;
+    }
+
+    std::int8_t* mControl = nullptr;
+    Slot* mSlots = nullptr;
+    size_t mCapacity = 0; // number of slots, a power of two multiple of GROUP_SIZE
+    size_t mSize = 0;
+    size_t mDeleted = 0; // tombstones, they are dropped by the next rehash
+};
+
+} // namespace storage
@@ -0,0 +1,70 @@
+#include "kvdb_server_histogram.hpp"
+
+#include <cmath>
+
+namespace stats
+{
+
+constexpr size_t Histogram::SUB_BUCKET_BITS;
+constexpr size_t Histogram::SUB_BUCKETS;
+constexpr size_t Histogram::MAX_BITS;
+constexpr size_t Histogram::BUCKETS;
+
+size_t Histogram::BucketOf( std::uint64_t value )
+{
+    // Values below SUB_BUCKETS have buckets of their own, above them the top SUB_BUCKET_BITS + 1 bits select the bucket
+    if( value < SUB_BUCKETS )
+        return static_cast< size_t >( value );
+    if( value >> MAX_BITS != 0 )
+        return BUCKETS - 1;
+    size_t exponent = 0;
+    while( value >> ( exponent + 1 ) != 0 )
+        exponent++;
+    size_t shift = exponent - SUB_BUCKET_BITS;
+    return ( shift + 1 ) * SUB_BUCKETS + static_cast< size_t >( ( value >> shift ) - SUB_BUCKETS );
+}
+
+std::uint64_t Histogram::BucketLimit( size_t bucket )
+{
+    if( bucket < SUB_BUCKETS )
+        return bucket;
+    size_t shift = bucket / SUB_BUCKETS - 1;
+    std::uint64_t lowest = std::uint64_t( SUB_BUCKETS + bucket % SUB_BUCKETS ) << shift;
+    return lowest + ( std::uint64_t( 1 ) << shift ) - 1;
+}
+
+void Histogram::Add( Counters const& counters )
+{
+    for( size_t i = 0; i < BUCKETS; i++ )
+    {
+        std::uint64_t c = counters[ i ].load( std::memory_order_relaxed );
+        mCounts[ i ] += c;
+        mCount += c;
+    }
+}
+
+void Histogram::Subtract( Histogram const& other )
+{
+    for( size_t i = 0; i < BUCKETS; i++ )
+        mCounts[ i ] -= other.mCounts[ i ];
+    mCount -= other.mCount;
+}
+
+std::uint64_t Histogram::Percentile( double percent ) const
+{
+    if( mCount == 0 )
+        return 0;
+    std::uint64_t rank = static_cast< std::uint64_t >( std::ceil( percent / 100 * static_cast< double >( mCount ) ) );
+    if( rank == 0 )
+        rank = 1;
+    std::uint64_t seen = 0;
+    for( size_t i = 0; i < BUCKETS; i++ )
+    {
+        seen += mCounts[ i ];
+        if( seen >= rank )
+            return BucketLimit( i );
+    }
+    return BucketLimit( BUCKETS - 1 );
+}
+
+} // namespace stats
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstddef>
+#include <cstdint>
+#include <array>
+#include <atomic>
+
+namespace stats
+{
+
+// Log-bucketed latency histogram in the manner of HdrHistogram. Every power of two range of values is split
+// into SUB_BUCKETS linear buckets, so a value is known to within 1/SUB_BUCKETS of itself over the whole range.
+// Values are nanoseconds; values above 2^MAX_BITS (18 minutes) are counted in the last bucket.
+class Histogram
+{
+public:
+    static constexpr size_t SUB_BUCKET_BITS = 4;
+    static constexpr size_t SUB_BUCKETS = size_t( 1 ) << SUB_BUCKET_BITS;
+    static constexpr size_t MAX_BITS = 40;
+    static constexpr size_t BUCKETS = ( MAX_BITS - SUB_BUCKET_BITS + 1 ) * SUB_BUCKETS;
+
+    // Counts of one writer thread, read by the reporting thread
+    typedef std::array< std::atomic< std::uint64_t >, BUCKETS > Counters;
+
+    static size_t BucketOf( std::uint64_t value );
+    static std::uint64_t BucketLimit( size_t bucket ); // highest value of the bucket
+    static void Record( Counters& counters, std::uint64_t value )
+    {
+        std::atomic< std::uint64_t >& c = counters[ BucketOf( value ) ];
+        c.store( c.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed ); // single writer, no locked add
+    }
+
+    void Add( Counters const& counters );
+    void Subtract( Histogram const& other );
+    std::uint64_t GetCount() const
+    {
+        return mCount;
+    }
+    // Value not exceeded by percent of the values, zero for an empty histogram
+    std::uint64_t Percentile( double percent ) const;
+
+private:
+    std::array< std::uint64_t, BUCKETS > mCounts{};
+    std::uint64_t mCount = 0;
+};
+
+} // namespace stats
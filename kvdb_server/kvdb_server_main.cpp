@@ -1,25 +1,72 @@
 #include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
 #include <boost/program_options.hpp>
 #include "kvdb_server_storage.hpp"
 #include "kvdb_server_stats.hpp"
+#include "kvdb_server_expiry.hpp"
+#include "kvdb_server_metrics.hpp"
 #include <boost/interprocess/exceptions.hpp>
 
 namespace network
 {
 
-void RunAsioServer( boost::asio::io_service& io_service, size_t port, size_t threads, storage::IStorage& strg, stats::IStats& stats );
+void RunAsioServer( boost::asio::io_service& io_service, size_t port, size_t threads, bool per_thread, bool pin_threads, storage::IStorage& strg, stats::IStats& stats );
 
 } // namespace network
 
+namespace
+{
+
+// CPUs the process may use: the hardware threads, fewer under a cgroup CPU quota (v2 cpu.max or v1 cfs quota)
+size_t AvailableCpus()
+{
+    size_t cpus = std::max< size_t >( std::thread::hardware_concurrency(), 1 );
+    long long quota = -1, period = 0;
+    std::ifstream v2( "/sys/fs/cgroup/cpu.max" );
+    std::string max;
+    if( v2 >> max >> period && max != "max" )
+        quota = std::atoll( max.c_str() );
+    else
+    {
+        std::ifstream v1_quota( "/sys/fs/cgroup/cpu/cpu.cfs_quota_us" ), v1_period( "/sys/fs/cgroup/cpu/cpu.cfs_period_us" );
+        if( !( v1_quota >> quota && v1_period >> period ) )
+            quota = -1;
+    }
+    if( quota > 0 && period > 0 )
+        cpus = std::min< size_t >( cpus, std::max< long long >( ( quota + period - 1 ) / period, 1 ) );
+    return cpus;
+}
+
+} // namespace
+
 int main( int argc, char *argv[] )
 {
-    size_t v_port = 0, v_threads = 0, v_size = 0;
+    size_t v_port = 0, v_max_threads = 0, v_size = 0, v_grow = 0, v_compact = 0, v_cache = 0, v_shards = 0, v_wal_interval = 0, v_snapshot_interval = 0, v_stats_interval = 0, v_metrics_port = 0, v_compress = 0;
+    std::string v_threads, v_storage, v_wal, v_wal_sync;
     boost::program_options::options_description od( "Allowed options" );
     od.add_options()
             ( "help,h", "Show this help message" )
             ( "port,p", boost::program_options::value< size_t >( &v_port )->default_value( 0 ), "TCP listener port number" )
-            ( "threads,t", boost::program_options::value< size_t >( &v_threads )->default_value( 1 ), "Number of threads for request processing" )
+            ( "threads,t", boost::program_options::value< std::string >( &v_threads )->default_value( "1" ), "Number of threads for request processing, auto for one per available CPU" )
+            ( "max-threads", boost::program_options::value< size_t >( &v_max_threads )->default_value( 256 ), "Upper bound of the number of processing threads" )
+            ( "per-thread-io", "Run an io_service and a SO_REUSEPORT listener on every thread, connections stay on the thread that accepted them" )
+            ( "pin-threads", "Pin processing threads to CPUs" )
             ( "size,s", boost::program_options::value< size_t >( &v_size )->default_value( 1 ), "Storage size in megabytes" )
+            ( "grow", boost::program_options::value< size_t >( &v_grow )->default_value( 64 ), "Persistent storage growth step in megabytes when it is full, 0 disables growth" )
+            ( "compact-at", boost::program_options::value< size_t >( &v_compact )->default_value( 0 ), "Free space fragmentation in percent that starts compaction of persistent storage, 0 disables it" )
+            ( "cache-size", boost::program_options::value< size_t >( &v_cache )->default_value( 0 ), "Memory limit of temporal and hashed storage in megabytes, items are evicted beyond it, 0 for no limit" )
+            ( "compress-above", boost::program_options::value< size_t >( &v_compress )->default_value( 0 ), "Values longer than this many bytes are kept compressed when that saves space, 0 disables compression" )
+            ( "storage,m", boost::program_options::value< std::string >( &v_storage )->default_value( "persistent" ), "Storage type: persistent, temporal (ordered) or hashed (unordered)" )
+            ( "shards", boost::program_options::value< size_t >( &v_shards )->default_value( 1 ), "Number of independently locked shards of storage, for persistent storage it is fixed when the file is created" )
+            ( "wal", boost::program_options::value< std::string >( &v_wal )->default_value( "" ), "Directory of the write-ahead log and snapshots of temporal and hashed storage, no log if empty" )
+            ( "wal-sync", boost::program_options::value< std::string >( &v_wal_sync )->default_value( "always" ), "Log sync policy: always (before the reply), interval or none (left to the OS)" )
+            ( "wal-sync-interval", boost::program_options::value< size_t >( &v_wal_interval )->default_value( 100 ), "Log write and sync interval in milliseconds for interval and none policies" )
+            ( "snapshot-interval", boost::program_options::value< size_t >( &v_snapshot_interval )->default_value( 300 ), "Snapshot interval in seconds, 0 disables snapshots" )
+            ( "stats-interval", boost::program_options::value< size_t >( &v_stats_interval )->default_value( 60 ), "Interval of the statistics report in seconds, 0 disables it" )
+            ( "metrics-port", boost::program_options::value< size_t >( &v_metrics_port )->default_value( 0 ), "Port of the local HTTP listener of /metrics in the Prometheus format, 0 disables it" )
             ;
     boost::program_options::variables_map vm;
     try {
@@ -52,34 +99,86 @@ int main( int argc, char *argv[] )
     }
     size_t port = vm[ "port" ].as< size_t >();
     size_t size = vm[ "size" ].as< size_t >();
-    size_t threads = vm[ "threads" ].as< size_t >();
+    size_t grow = vm[ "grow" ].as< size_t >();
+    size_t compact_at = vm[ "compact-at" ].as< size_t >();
+    size_t cache_size = vm[ "cache-size" ].as< size_t >();
+    std::string threads_option = vm[ "threads" ].as< std::string >();
+    size_t max_threads = std::max< size_t >( vm[ "max-threads" ].as< size_t >(), 1 );
+    size_t threads = 0;
+    if( threads_option == "auto" )
+    {
+        threads = AvailableCpus();
+        std::cout << "Number of processing threads is set to " << threads << " by available CPUs" << std::endl;
+    }
+    else
+        threads = static_cast< size_t >( std::strtoull( threads_option.c_str(), nullptr, 10 ) );
+    size_t shards = vm[ "shards" ].as< size_t >();
+    std::string storage_type = vm[ "storage" ].as< std::string >();
     if( port < 1024 || port > 49151 )
     {
         std::srand( static_cast< unsigned int >( std::time( 0 ) ) );
         port = ( static_cast< size_t >( std::rand() ) * ( 49151 - 1024 ) ) / RAND_MAX + 1024;
         std::cout << "Warning: TCP port was assigned to a random value " << port << " from range [1024..49151]" << std::endl;
     }
-    if( threads < 1 || threads > 10 )
+    if( threads < 1 || threads > max_threads )
     {
         if( threads < 1 )
             threads = 1;
-        if( threads > 10 )
-            threads = 10;
-        std::cout << "Warning: number of processing threads is set to " << threads << ", allowed range is [1..10]" << std::endl;
+        if( threads > max_threads )
+            threads = max_threads;
+        std::cout << "Warning: number of processing threads is set to " << threads << ", allowed range is [1.." << max_threads << "]" << std::endl;
     }
     if( size < 1 )
     {
-        if( size < 1 )
-            size = 1;
-        if( size > 1024 )
-            size = 1024;
-        std::cout << "Warning: storage size is set to " << size << " MB, allowed range is [1..1024]" << std::endl;
+        size = 1;
+        std::cout << "Warning: storage size is set to " << size << " MB, the minimum" << std::endl;
+    }
+
+    if( shards < 1 || shards > 1024 )
+    {
+        if( shards < 1 )
+            shards = 1;
+        if( shards > 1024 )
+            shards = 1024;
+        std::cout << "Warning: number of storage shards is set to " << shards << ", allowed range is [1..1024]" << std::endl;
+    }
+    storage::IStorage::Type type = storage::IStorage::tPersistent;
+    if( storage_type == "temporal" )
+        type = storage::IStorage::tTemporal;
+    else if( storage_type == "hashed" )
+        type = storage::IStorage::tHashed;
+    else if( storage_type != "persistent" )
+        std::cout << "Warning: unknown storage type \"" << storage_type << "\", persistent storage is used" << std::endl;
+
+    if( cache_size != 0 && type == storage::IStorage::tPersistent )
+    {
+        cache_size = 0;
+        std::cout << "Warning: persistent storage is bounded by its file, the cache size is ignored" << std::endl;
+    }
+
+    std::optional< storage::LogOptions > log;
+    if( !vm[ "wal" ].as< std::string >().empty() )
+    {
+        log.emplace();
+        log->mDirectory = vm[ "wal" ].as< std::string >();
+        std::string sync = vm[ "wal-sync" ].as< std::string >();
+        if( sync == "interval" )
+            log->mSync = storage::LogOptions::spInterval;
+        else if( sync == "none" )
+            log->mSync = storage::LogOptions::spNone;
+        else if( sync != "always" )
+            std::cout << "Warning: unknown log sync policy \"" << sync << "\", always is used" << std::endl;
+        log->mSyncInterval = std::chrono::milliseconds( std::max< size_t >( vm[ "wal-sync-interval" ].as< size_t >(), 1 ) );
+        log->mSnapshotInterval = std::chrono::seconds( vm[ "snapshot-interval" ].as< size_t >() );
+        if( type == storage::IStorage::tPersistent )
+            std::cout << "Warning: persistent storage has no write-ahead log, the option is ignored" << std::endl;
     }
 
     std::unique_ptr< storage::IStorage > strg = nullptr;
     try
     {
-        strg = storage::InitializeStorage( size * 1024 * 1024, storage::IStorage::tPersistent );
+        strg = storage::InitializeStorage( size * 1024 * 1024, type, shards, grow * 1024 * 1024, compact_at, cache_size * 1024 * 1024, log,
+                                           vm[ "compress-above" ].as< size_t >() );
     }
     catch( boost::interprocess::interprocess_exception const& ex )
     {
@@ -89,18 +188,42 @@ int main( int argc, char *argv[] )
                   << std::endl;
         strg = nullptr;
     }
+    catch( std::exception const& ex )
+    {
+        std::cout << "std::exception: " << ex.what() << std::endl;
+        strg = nullptr;
+    }
     if( strg == nullptr )
     {
         std::cout << "Error: could not create storage" << std::endl;
         return 1;
     }
 
-    boost::asio::io_service io_service;
+    bool per_thread = vm.count( "per-thread-io" ) > 0;
+    boost::asio::io_service io_service( per_thread ? 1 : static_cast< int >( threads ) ); // concurrency hint
 
-    stats::Stats stats_reporter( io_service, *strg, 60 ); // 60 seconds
+    stats::Stats stats_reporter( io_service, *strg, vm[ "stats-interval" ].as< size_t >() );
     stats_reporter.Launch();
 
-    network::RunAsioServer( io_service, port, threads, *strg, stats_reporter );
+    std::unique_ptr< network::MetricsListener > metrics;
+    size_t metrics_port = vm[ "metrics-port" ].as< size_t >();
+    if( metrics_port != 0 )
+    {
+        try
+        {
+            metrics = std::make_unique< network::MetricsListener >( io_service, metrics_port, stats_reporter );
+        }
+        catch( boost::system::system_error const& ex )
+        {
+            std::cout << "Error: could not listen on metrics port " << metrics_port << ": " << ex.what() << std::endl;
+            return 1;
+        }
+    }
+
+    storage::Reaper reaper( io_service, *strg );
+    reaper.Launch();
+
+    network::RunAsioServer( io_service, port, threads, per_thread, vm.count( "pin-threads" ) > 0, *strg, stats_reporter );
 
     return 0;
 }
@@ -0,0 +1,107 @@
+#include "kvdb_server_metrics.hpp"
+#include "kvdb_server_stats.hpp"
+
+#include <iostream>
+#include <istream>
+#include <memory>
+#include <string>
+#include <boost/asio.hpp>
+
+namespace network
+{
+
+constexpr size_t MetricsListener::MAX_REQUEST_SIZE;
+
+namespace
+{
+
+class MetricsConnection : public std::enable_shared_from_this< MetricsConnection >
+{
+public:
+    MetricsConnection( boost::asio::io_service& io_service, stats::IStats& stats )
+        : mSocket( io_service )
+        , mRequest( MetricsListener::MAX_REQUEST_SIZE )
+        , mStats( stats )
+    {
+    }
+
+    boost::asio::ip::tcp::socket& Socket()
+    {
+        return mSocket;
+    }
+
+    void Start()
+    {
+        auto self = shared_from_this();
+        boost::asio::async_read_until( mSocket, mRequest, "\r\n\r\n", [ self ]( boost::system::error_code const& ec, size_t )
+        {
+            if( !ec )
+                self->Reply();
+        } );
+    }
+
+private:
+    void Reply()
+    {
+        std::istream request( &mRequest );
+        std::string method, target;
+        request >> method >> target;
+
+        std::string status = "200 OK", body;
+        if( method != "GET" )
+            status = "405 Method Not Allowed";
+        else if( target == "/metrics" || target.compare( 0, 9, "/metrics?" ) == 0 )
+            body = mStats.Export();
+        else
+            status = "404 Not Found";
+
+        mReply = "HTTP/1.1 " + status + "\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: " + std::to_string( body.size() ) + "\r\n"
+                 "Connection: close\r\n\r\n" + body;
+        auto self = shared_from_this();
+        boost::asio::async_write( mSocket, boost::asio::buffer( mReply ), [ self ]( boost::system::error_code const& ec, size_t )
+        {
+            boost::system::error_code ignored;
+            if( !ec )
+                self->mSocket.shutdown( boost::asio::ip::tcp::socket::shutdown_both, ignored );
+        } );
+    }
+
+    boost::asio::ip::tcp::socket mSocket;
+    boost::asio::streambuf mRequest;
+    std::string mReply;
+    stats::IStats& mStats;
+};
+
+} // namespace
+
+MetricsListener::MetricsListener( boost::asio::io_service& io_service, size_t port, stats::IStats& stats )
+    : mIoService( io_service )
+    , mAcceptor( mIoService )
+    , mStats( stats )
+{
+    boost::asio::ip::tcp::endpoint endpoint{ boost::asio::ip::address_v4::loopback(), static_cast< unsigned short >( port ) };
+    mAcceptor.open( endpoint.protocol() );
+    mAcceptor.set_option( boost::asio::ip::tcp::acceptor::reuse_address( true ) );
+    mAcceptor.bind( endpoint );
+    mAcceptor.listen();
+    std::cout << "Metrics are served on http://127.0.0.1:" << port << "/metrics" << std::endl;
+    StartAccept();
+}
+
+void MetricsListener::StartAccept()
+{
+    auto connection = std::make_shared< MetricsConnection >( mIoService, mStats );
+    mAcceptor.async_accept(
+                connection->Socket(),
+                [ this, connection ]( boost::system::error_code const& ec )
+                {
+                    if( !ec )
+                        connection->Start();
+                    StartAccept();
+                }
+                );
+}
+
+} // namespace network
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+
+namespace stats
+{
+
+class IStats;
+
+} // namespace stats
+
+namespace network
+{
+
+// HTTP listener on the loopback interface that serves GET /metrics in the Prometheus text format.
+// Every connection is answered once and closed; the export runs on the thread of the io_service.
+class MetricsListener
+{
+public:
+    static constexpr size_t MAX_REQUEST_SIZE = 8 * 1024;
+
+    MetricsListener( boost::asio::io_service& io_service, size_t port, stats::IStats& stats );
+    void StartAccept();
+
+private:
+    boost::asio::io_service& mIoService;
+    boost::asio::ip::tcp::acceptor mAcceptor;
+    stats::IStats& mStats;
+};
+
+} // namespace network
@@ -5,18 +5,117 @@
 #include <thread>
 #include <vector>
 #include <string>
+#include <cstring> // memcpy
+#include <limits>
 #include <boost/asio.hpp>
 
 namespace network
 {
 
-TcpConnection::TcpConnection( boost::asio::io_service &io_service, storage::IStorage& strg, stats::IStats& stats )
-    : mStrand( io_service )
-    , mSocket( io_service )
-    , mHeader( DecodedHeader( Opcode::opInvalid, 0, 0 ) )
+namespace
+{
+
+// Keeps the calling thread on one CPU, returns false where this is not supported
+bool PinThread( size_t cpu )
+{
+#if defined( __linux__ )
+    cpu_set_t set;
+    CPU_ZERO( &set );
+    CPU_SET( cpu % CPU_SETSIZE, &set );
+    return pthread_setaffinity_np( pthread_self(), sizeof( set ), &set ) == 0;
+#elif defined( _WIN32 )
+    return SetThreadAffinityMask( GetCurrentThread(), DWORD_PTR( 1 ) << ( cpu % ( sizeof( DWORD_PTR ) * 8 ) ) ) != 0;
+#else
+    ( void )cpu;
+    return false;
+#endif
+}
+
+void RunThread( boost::asio::io_service& io_service, size_t index, bool pin_threads )
+{
+    if( pin_threads && !PinThread( index % std::max( std::thread::hardware_concurrency(), 1u ) ) )
+        std::cout << "Warning: processing thread " << index << " could not be pinned to a CPU" << std::endl;
+    io_service.run();
+}
+
+Status ToStatus( storage::IStorage::ErrorCode ec )
+{
+    switch( ec )
+    {
+        case storage::IStorage::ecSuccess:
+            return Status::stSuccess;
+        case storage::IStorage::ecKeyNotFound:
+            return Status::stKeyNotFound;
+        case storage::IStorage::ecKeyAlreadyExists:
+            return Status::stKeyAlreadyExists;
+        case storage::IStorage::ecValueNotChanged:
+            return Status::stValueNotChanged;
+        case storage::IStorage::ecLogFailed:
+        case storage::IStorage::ecNoSpace:
+            return Status::stInternalError;
+    }
+    return Status::stInternalError;
+}
+
+} // namespace
+
+Reply::Reply( DecodedHeader const& request, Status s, storage::ValueRef value )
+    : mValue( std::move( value ) )
+{
+    Encode( request, s, mValue ? mValue->Size() : 0 );
+}
+
+Reply::Reply( DecodedHeader const& request, std::vector< Reply >&& entries )
+    : mEntries( std::move( entries ) )
+{
+    size_t size = 0;
+    for( Reply const& e : mEntries )
+        size += e.Size();
+    Encode( request, Status::stSuccess, size );
+}
+
+void Reply::Encode( DecodedHeader const& request, Status s, size_t value_size )
+{
+    DecodedResponseHeader d{ s, static_cast< unsigned int >( value_size ), request.mRequestId };
+    if( request.mVersion == 2 )
+    {
+        ResponseHeaderV2 h{ d };
+        mHeaderSize = sizeof( h );
+        ::memcpy( mHeader.data(), &h, sizeof( h ) );
+    }
+    else
+    {
+        ResponseHeader h{ d };
+        mHeaderSize = sizeof( h );
+        ::memcpy( mHeader.data(), &h, sizeof( h ) );
+    }
+}
+
+size_t Reply::Size() const
+{
+    size_t size = mHeaderSize + ( mValue ? mValue->Size() : 0 );
+    for( Reply const& e : mEntries )
+        size += e.Size();
+    return size;
+}
+
+constexpr size_t TcpConnection::MAX_BATCHED_REPLY_SIZE;
+constexpr size_t TcpConnection::MAX_PENDING_REPLY_SIZE;
+constexpr size_t TcpConnection::SCAN_CHUNK_SIZE;
+constexpr size_t TcpConnection::SCAN_REPLY_SIZE;
+
+TcpConnection::TcpConnection( boost::asio::io_service &io_service, bool shared, storage::IStorage& strg, stats::IStats& stats )
+    : mSocket( io_service )
+    , mRequest( Opcode::opInvalid, 0, 0 )
+    , mPendingSize( 0 )
+    , mReadPaused( false )
+    , mClosing( false )
+    , mScanPaused( false )
     , mStorage( strg )
     , mStats( stats )
 {
+    if( shared )
+        mStrand.emplace( io_service );
 }
 
 boost::asio::ip::tcp::socket& TcpConnection::Socket()
@@ -24,60 +123,85 @@ boost::asio::ip::tcp::socket& TcpConnection::Socket()
     return mSocket;
 }
 
+// Both branches start the same operation, they differ in the handler type only
+void TcpConnection::Read( boost::asio::mutable_buffer buffer, void ( TcpConnection::*handle )( boost::system::error_code const&, size_t ) )
+{
+    // Replies held back for pipelined requests go out before the connection waits for the client
+    boost::system::error_code e;
+    if( !mReplies.empty() && ( mSocket.available( e ) < buffer.size() || e ) )
+        FlushReplies();
+
+    auto handler = MakeAllocatingHandler( mReadMemory, [ keep = this->shared_from_this(), this, handle ]( boost::system::error_code const& ec, size_t bytes ){ ( this->*handle )( ec, bytes ); } );
+    if( mStrand )
+        boost::asio::async_read( mSocket, buffer, boost::asio::transfer_exactly( buffer.size() ), boost::asio::bind_executor( *mStrand, std::move( handler ) ) );
+    else
+        boost::asio::async_read( mSocket, buffer, boost::asio::transfer_exactly( buffer.size() ), std::move( handler ) );
+}
+
+void TcpConnection::Write( BufferView buffers )
+{
+    auto handler = MakeAllocatingHandler( mWriteMemory, [ keep = this->shared_from_this(), this ]( boost::system::error_code const& ec, size_t bytes ){ HandleWriteReply( ec, bytes ); } );
+    if( mStrand )
+        boost::asio::async_write( mSocket, buffers, boost::asio::bind_executor( *mStrand, std::move( handler ) ) );
+    else
+        boost::asio::async_write( mSocket, buffers, std::move( handler ) );
+}
+
+template< typename Handler >
+void TcpConnection::Post( Handler&& handler )
+{
+    if( mStrand )
+        boost::asio::post( *mStrand, std::forward< Handler >( handler ) );
+    else
+        boost::asio::post( mSocket.get_executor(), std::forward< Handler >( handler ) );
+}
+
 void TcpConnection::Start()
 {
     mOffset = 0;
-    boost::asio::async_read(
-                mSocket,
-                boost::asio::buffer( &mHeader, sizeof( mHeader ) ),
-                boost::asio::transfer_exactly( sizeof( mHeader ) ),
-                mStrand.wrap(
-                    [ keep = this->shared_from_this(), this ]( boost::system::error_code const& ec, size_t bytes ){ HandleReadHeader( ec, bytes ); }
-                    )
-                );
+    mBody.Trim(); // a large body of the previous request is not kept
+    Read( boost::asio::buffer( mHeader ), &TcpConnection::HandleReadHeader );
 }
 
 void TcpConnection::HandleReadHeader( boost::system::error_code const& ec, size_t bytes )
 {
     if( ec )
     {
-        std::cerr << "ERROR " << ec << " while receiving header" << std::endl;
+        // End of stream between requests is how a client leaves a persistent connection
+        if( ec != boost::asio::error::eof && ec != boost::asio::error::operation_aborted )
+            std::cerr << "ERROR " << ec << " while receiving header" << std::endl;
+        Close();
         return;
     }
 
-    if( bytes + mOffset < sizeof( mHeader ) )
+    if( bytes + mOffset < mHeader.size() )
     {
         mOffset += bytes;
-        boost::asio::async_read(
-                    mSocket,
-                    boost::asio::buffer( ( char* )( &mHeader ) + mOffset, sizeof( mHeader ) - mOffset ),
-                    boost::asio::transfer_exactly( sizeof( mHeader ) - mOffset ),
-                    mStrand.wrap(
-                        [ keep = this->shared_from_this(), this ]( boost::system::error_code const& ec, size_t bytes ){ HandleReadHeader( ec, bytes ); }
-                        )
-                    );
+        Read( boost::asio::buffer( mHeader.data() + mOffset, mHeader.size() - mOffset ), &TcpConnection::HandleReadHeader );
         return;
     }
 
-    if( bytes + mOffset > sizeof( mHeader ) ) // this should not happen, right?
+    if( bytes + mOffset > mHeader.size() ) // this should not happen, right?
     {
         std::cerr << "ERROR : message header received too long: " << bytes << " + " << mOffset << " offset" << std::endl;
+        Close();
         return;
     }
 
-    DecodedHeader h{ mHeader };
-    mBody.resize( h.mKeyLength + h.mValueLength + sizeof( RequestFooter ) );
+    mRequestStart = stats::Clock::now();
+    mRequest = DecodeRequestHeader( mHeader );
+    if( mRequest.mOpcode == Opcode::opInvalid )
+    {
+        // Body length is unknown, so the stream can not be resynchronized
+        QueueReply( Reply( mRequest, Status::stBadRequest ) );
+        Close();
+        return;
+    }
+    mBody.Resize( mRequest.BodySize() );
 
     mOffset = 0;
 
-    boost::asio::async_read(
-                mSocket,
-                boost::asio::buffer( mBody ),
-                boost::asio::transfer_exactly( mBody.size() ),
-                mStrand.wrap(
-                    [ keep = this->shared_from_this(), this ]( boost::system::error_code const& ec, size_t bytes ){ HandleReadBody( ec, bytes ); }
-                    )
-                );
+    Read( boost::asio::buffer( mBody.Data(), mBody.Size() ), &TcpConnection::HandleReadBody );
 }
 
 void TcpConnection::HandleReadBody( boost::system::error_code const& ec, size_t bytes )
@@ -85,168 +209,470 @@ void TcpConnection::HandleReadBody( boost::system::error_code const& ec, size_t
     if( ec )
     {
         std::cerr << "ERROR " << ec << " while receiving body" << std::endl;
+        Close();
         return;
     }
 
-    if( bytes + mOffset < mBody.size() )
+    if( bytes + mOffset < mBody.Size() )
     {
         mOffset += bytes;
-        boost::asio::async_read(
-                    mSocket,
-                    boost::asio::buffer( mBody.data() + mOffset , mBody.size() - mOffset ),
-                    boost::asio::transfer_exactly( mBody.size() - mOffset ),
-                    mStrand.wrap(
-                        [ keep = this->shared_from_this(), this ]( boost::system::error_code const& ec, size_t bytes ){ HandleReadBody( ec, bytes ); }
-                        )
-                    );
+        Read( boost::asio::buffer( mBody.Data() + mOffset , mBody.Size() - mOffset ), &TcpConnection::HandleReadBody );
         return;
     }
 
-    if( bytes + mOffset > mBody.size() ) // this should not happen, right?
+    if( bytes + mOffset > mBody.Size() ) // this should not happen, right?
     {
         std::cerr << "ERROR : message body received too long: " << bytes << " + " << mOffset << " offset" << std::endl;
+        Close();
         return;
     }
 
-    if( mBody.size() < 8 )
+    DecodedHeader const& h = mRequest;
+    mOffset = 0;
+
+    if( h.mVersion == 1 )
     {
-        std::cerr << "ERROR : message body received too short: " << mBody.size() << std::endl;
-        return;
-    }
+        if( mBody.Size() < 8 )
+        {
+            std::cerr << "ERROR : message body received too short: " << mBody.Size() << std::endl;
+            Close();
+            return;
+        }
 
-    std::array< char, 8 > footer;
-    char *tail = mBody.data() + mBody.size() - 8;
-    for( size_t i = 0; i < 8; i++ )
-        footer[ i ] =  tail[ i ];
+        std::array< char, 8 > footer;
+        char *tail = mBody.Data() + mBody.Size() - 8;
+        for( size_t i = 0; i < 8; i++ )
+            footer[ i ] =  tail[ i ];
 
-    if( footer != RequestFooter::MAGIC )
+        if( footer != RequestFooter::MAGIC )
+        {
+            std::cerr << "ERROR : message body tail corrupted" << std::endl;
+            QueueReply( Reply( h, Status::stBadRequest ) );
+            Close();
+            return;
+        }
+    }
+    else if( h.mHasChecksum && Crc32c( 0, mBody.Data(), mBody.Size() ) != h.mChecksum )
     {
-        std::cerr << "ERROR : message body tail corrupted" << std::endl;
+        // Framing is intact, so only this request is rejected
+        RegisterOperation( false, {} );
+        QueueReply( Reply( h, Status::stBadRequest ) );
+        ReadNext();
         return;
     }
 
-    DecodedHeader h{ mHeader };
-    mOffset = 0;
-
-    std::string reply;
+    Status status = Status::stBadRequest;
+    storage::ValueRef value;
+    std::vector< Reply > batch;
+    bool success = false;
+    stats::Clock::time_point started = stats::Clock::now();
     switch( h.mOpcode )
     {
         case Opcode::opInsert:
         {
-            auto r = mStorage.Insert( std::string_view( mBody.data(), h.mKeyLength ), std::string_view( mBody.data() + h.mKeyLength, h.mValueLength ) );
-            mStats.RegisterOperation( h.mOpcode, r == storage::IStorage::ecSuccess );
-            switch( r )
-            {
-                case storage::IStorage::ecSuccess:
-                    reply = "OK";
-                    break;
-                case storage::IStorage::ecKeyAlreadyExists:
-                    reply = "ERROR: key to insert already exists";
-                    break;
-                default:
-                    reply = "ERROR: unexpected operation result";
-                    break;
-            }
+            auto r = mStorage.Insert( std::string_view( mBody.Data(), h.mKeyLength ), std::string_view( mBody.Data() + h.mKeyLength, h.mValueLength ),
+                                      storage::ExpiryAfter( h.mTtl ) );
+            success = r == storage::IStorage::ecSuccess;
+            status = ToStatus( r );
             break;
         }
         case Opcode::opUpdate:
         {
-            auto r = mStorage.Update( std::string_view( mBody.data(), h.mKeyLength ), std::string_view( mBody.data() + h.mKeyLength, h.mValueLength ) );
-            mStats.RegisterOperation( h.mOpcode, r == storage::IStorage::ecSuccess );
-            switch( r )
-            {
-                case storage::IStorage::ecSuccess:
-                    reply = "OK";
-                    break;
-                case storage::IStorage::ecKeyNotFound:
-                    reply = "ERROR: key to update not found";
-                    break;
-                case storage::IStorage::ecValueNotChanged:
-                    reply = "WARNING: value for key not changed";
-                    break;
-                default:
-                    reply = "ERROR: unexpected operation result";
-                    break;
-            }
+            auto r = mStorage.Update( std::string_view( mBody.Data(), h.mKeyLength ), std::string_view( mBody.Data() + h.mKeyLength, h.mValueLength ),
+                                      storage::ExpiryAfter( h.mTtl ) );
+            success = r == storage::IStorage::ecSuccess;
+            status = ToStatus( r );
             break;
         }
         case Opcode::opDelete:
         {
-            auto r = mStorage.Delete( std::string_view( mBody.data(), h.mKeyLength ) );
-            mStats.RegisterOperation( h.mOpcode, r == storage::IStorage::ecSuccess );
-            switch( r )
-            {
-                case storage::IStorage::ecSuccess:
-                    reply = "OK";
-                    break;
-                case storage::IStorage::ecKeyNotFound:
-                    reply = "ERROR: key to delete not found";
-                    break;
-                default:
-                    reply = "ERROR: unexpected operation result";
-                    break;
-            }
+            auto r = mStorage.Delete( std::string_view( mBody.Data(), h.mKeyLength ) );
+            success = r == storage::IStorage::ecSuccess;
+            status = ToStatus( r );
             break;
         }
         case Opcode::opGet:
         {
-            auto r = mStorage.Get( std::string_view( mBody.data(), h.mKeyLength ) );
-            mStats.RegisterOperation( h.mOpcode, r.has_value() );
+            auto r = mStorage.Get( std::string_view( mBody.Data(), h.mKeyLength ) );
+            success = r != nullptr;
             if( r )
-                reply = "Key is \"" + *r + "\"";
+            {
+                status = Status::stSuccess;
+                value = std::move( r );
+            }
+            else
+                status = Status::stKeyNotFound;
+            break;
+        }
+        case Opcode::opMultiGet:
+        case Opcode::opMultiSet:
+        case Opcode::opMultiDelete:
+        {
+            std::vector< BatchEntry > entries;
+            bool parsed = ParseBatch( std::string_view( mBody.Data(), h.mValueLength ), h.mKeyLength, entries );
+            success = parsed;
+            if( parsed )
+            {
+                batch = ProcessBatch( h, entries );
+                status = Status::stSuccess;
+            }
             else
-                reply = "ERROR: key not found";
+                status = Status::stBadRequest;
+            break;
+        }
+        case Opcode::opScan:
+        {
+            if( StartScan( h ) )
+                return; // replies are streamed by ContinueScan
+            status = Status::stBadRequest;
+            break;
+        }
+        case Opcode::opStats:
+        {
+            value = storage::Value::Create( mStats.Export() );
+            success = true;
+            status = Status::stSuccess;
             break;
         }
         default:
-            reply = "ERROR: unknown operation";
+            status = Status::stBadRequest;
     }
+    stats::Clock::duration storage_time = stats::Clock::now() - started;
 
-    boost::asio::async_write(
-                mSocket,
-                boost::asio::buffer( reply ),
-                mStrand.wrap(
-                    [ keep = this->shared_from_this(), this ]( boost::system::error_code const& ec, size_t bytes ){ HandleWriteReply( ec, bytes ); }
-                    )
-                );
+    if( status == Status::stSuccess && h.IsBatch() )
+        QueueReply( Reply( h, std::move( batch ) ) );
+    else
+        QueueReply( Reply( h, status, std::move( value ) ) );
+    RegisterOperation( success, storage_time );
+
+    ReadNext();
+}
+
+void TcpConnection::RegisterOperation( bool success, stats::Clock::duration storage_time )
+{
+    mStats.RegisterOperation( mRequest.mOpcode, success, storage_time, stats::Clock::now() - mRequestStart );
+}
+
+void TcpConnection::ReadNext()
+{
+    // Keep the connection open and go on with the next pipelined request, unless too many replies are still unsent
+    if( mPendingSize > MAX_PENDING_REPLY_SIZE )
+        mReadPaused = true;
+    else
+        Start();
+}
+
+bool TcpConnection::StartScan( DecodedHeader const& h )
+{
+    ScanParameters p;
+    if( !ParseScanParameters( std::string_view( mBody.Data() + h.mKeyLength, h.mValueLength ), p ) )
+        return false;
+
+    mScan = std::make_unique< Scan >();
+    mScan->mStart.assign( mBody.Data(), h.mKeyLength );
+    mScan->mAfterStart = ( p.mFlags & ScanParameters::FLAG_AFTER ) != 0;
+    mScan->mBound = p.mBound;
+    mScan->mPrefix = ( p.mFlags & ScanParameters::FLAG_PREFIX ) != 0;
+    mScan->mRemaining = p.mLimit == 0 ? std::numeric_limits< size_t >::max() : p.mLimit;
+    if( mScan->mPrefix && mScan->mStart < mScan->mBound )
+    {
+        // Keys before the prefix can not match it
+        mScan->mStart = mScan->mBound;
+        mScan->mAfterStart = false;
+    }
+    ContinueScan();
+    return true;
+}
+
+void TcpConnection::ContinueScan()
+{
+    if( mClosing ) // the connection failed while the scan was waiting
+    {
+        mScan.reset();
+        return;
+    }
+
+    Scan& scan = *mScan;
+    storage::IStorage::ScanRange range;
+    range.mStart = scan.mStart;
+    range.mAfterStart = scan.mAfterStart;
+    ( scan.mPrefix ? range.mPrefix : range.mEnd ) = scan.mBound;
+    size_t limit = std::min( scan.mRemaining, SCAN_CHUNK_SIZE );
+    std::vector< storage::IStorage::ScanItem > items;
+    stats::Clock::time_point started = stats::Clock::now();
+    bool scanned = mStorage.Scan( range, limit, items );
+    scan.mStorageTime += stats::Clock::now() - started;
+    if( !scanned )
+    {
+        // Unordered storage
+        RegisterOperation( false, scan.mStorageTime );
+        mScan.reset();
+        QueueReply( Reply( mRequest, Status::stBadRequest ) );
+        ReadNext();
+        return;
+    }
+
+    std::string payload;
+    for( auto const& item : items )
+    {
+        if( !item.second )
+            continue; // damaged value, the scan goes on past it
+        AppendBatchEntry( payload, item.first, item.second->View() );
+        if( payload.size() >= SCAN_REPLY_SIZE )
+        {
+            QueueReply( Reply( mRequest, Status::stPartial, storage::Value::Create( payload ) ) );
+            payload.clear();
+        }
+    }
+    if( !payload.empty() )
+        QueueReply( Reply( mRequest, Status::stPartial, storage::Value::Create( payload ) ) );
+
+    scan.mRemaining -= items.size();
+    if( items.size() == limit && scan.mRemaining > 0 )
+    {
+        // The next chunk takes the lock again, after other requests had their turn and the replies went out
+        scan.mStart = std::move( items.back().first );
+        scan.mAfterStart = true;
+        if( mPendingSize > MAX_PENDING_REPLY_SIZE )
+            mScanPaused = true;
+        else
+            Post( [ keep = this->shared_from_this(), this ](){ ContinueScan(); } );
+        return;
+    }
+
+    // A full last chunk may be followed by more keys of the range, the client continues from the cursor
+    storage::ValueRef cursor;
+    if( items.size() == limit )
+        cursor = storage::Value::Create( items.back().first );
+    stats::Clock::duration storage_time = scan.mStorageTime;
+    mScan.reset();
+    QueueReply( Reply( mRequest, Status::stSuccess, std::move( cursor ) ) );
+    RegisterOperation( true, storage_time );
+    ReadNext();
+}
+
+std::vector< Reply > TcpConnection::ProcessBatch( DecodedHeader const& h, std::vector< BatchEntry > const& entries )
+{
+    Opcode o = h.mOpcode;
+    std::vector< Reply > replies;
+    replies.reserve( entries.size() );
+    if( o == Opcode::opMultiSet )
+    {
+        for( auto r : mStorage.MultiSet( entries, storage::ExpiryAfter( h.mTtl ) ) )
+            replies.emplace_back( h, ToStatus( r ) );
+        return replies;
+    }
+
+    std::vector< std::string_view > keys;
+    keys.reserve( entries.size() );
+    for( auto const& e : entries )
+        keys.push_back( e.first );
+    if( o == Opcode::opMultiGet )
+    {
+        for( auto& r : mStorage.MultiGet( keys ) )
+        {
+            if( r )
+                replies.emplace_back( h, Status::stSuccess, std::move( r ) );
+            else
+                replies.emplace_back( h, Status::stKeyNotFound );
+        }
+    }
+    else
+    {
+        for( auto r : mStorage.MultiDelete( keys ) )
+            replies.emplace_back( h, ToStatus( r ) );
+    }
+    return replies;
+}
+
+void TcpConnection::QueueReply( Reply&& reply )
+{
+    if( !mSocket.is_open() )
+        return; // a write failed, nothing more goes out
+    mPendingSize += reply.Size();
+    mReplies.push_back( std::move( reply ) );
+    if( !mWriting.empty() )
+        return; // will be sent by HandleWriteReply together with other queued replies
+
+    // Postpone the write while the header of the next pipelined request is already in the socket, so their replies go out together.
+    // A partial header could take the client any time to complete, Read flushes the replies if it has to wait for the rest.
+    boost::system::error_code e;
+    if( !mClosing && mSocket.available( e ) >= mHeader.size() && !e && mPendingSize < MAX_BATCHED_REPLY_SIZE )
+        return;
+
+    FlushReplies();
+}
+
+void TcpConnection::FlushReplies()
+{
+    if( !mWriting.empty() || mReplies.empty() )
+        return;
+
+    mWriting.swap( mReplies ); // both keep their capacity
+
+    // Header and value go out as separate buffers, so values are never copied into a combined message
+    std::vector< boost::asio::const_buffer >& buffers = mBuffers;
+    buffers.clear();
+    for( Reply const& r : mWriting )
+    {
+        buffers.push_back( boost::asio::buffer( r.mHeader.data(), r.mHeaderSize ) );
+        if( r.mValue && r.mValue->Size() > 0 )
+            buffers.push_back( boost::asio::buffer( r.mValue->View().data(), r.mValue->Size() ) );
+        for( Reply const& e : r.mEntries )
+        {
+            buffers.push_back( boost::asio::buffer( e.mHeader.data(), e.mHeaderSize ) );
+            if( e.mValue && e.mValue->Size() > 0 )
+                buffers.push_back( boost::asio::buffer( e.mValue->View().data(), e.mValue->Size() ) );
+        }
+    }
+
+    Write( BufferView{ buffers.data(), buffers.data() + buffers.size() } );
 }
 
 void TcpConnection::HandleWriteReply( boost::system::error_code const& ec, size_t bytes )
 {
-    // Just close connection for simplicity. Anyway, client supports only a single command per launch.
-    if( !ec )
+    if( ec )
+    {
+        if( ec != boost::asio::error::operation_aborted )
+            std::cerr << "ERROR " << ec << " while sending reply" << std::endl;
+        // The client gets no more replies, so the connection goes as soon as its pending reads fail
+        mWriting.clear();
+        mReplies.clear();
+        mPendingSize = 0;
+        mClosing = true;
+        mReadPaused = false;
+        mScanPaused = false;
+        boost::system::error_code e;
+        mSocket.close( e );
+        return;
+    }
+
+    mPendingSize -= bytes;
+    mWriting.clear();
+
+    if( !mReplies.empty() )
+    {
+        FlushReplies();
+    }
+    else if( mClosing )
     {
         boost::system::error_code e;
         mSocket.shutdown( boost::asio::ip::tcp::socket::shutdown_both, e );
+        return;
+    }
+
+    if( mReadPaused && mPendingSize <= MAX_PENDING_REPLY_SIZE )
+    {
+        mReadPaused = false;
+        Start();
+    }
+    else if( mScanPaused && mPendingSize <= MAX_PENDING_REPLY_SIZE )
+    {
+        mScanPaused = false;
+        ContinueScan();
     }
 }
 
-TcpListener::TcpListener( boost::asio::io_service& io_service, size_t port, storage::IStorage& strg, stats::IStats& stats )
+void TcpConnection::Close()
+{
+    // Stop reading requests, but first send replies to all requests received so far
+    mClosing = true;
+    mReadPaused = false;
+    if( !mWriting.empty() )
+        return;
+    if( !mReplies.empty() )
+    {
+        FlushReplies();
+        return;
+    }
+    boost::system::error_code e;
+    mSocket.shutdown( boost::asio::ip::tcp::socket::shutdown_both, e );
+}
+
+void TcpConnection::Reset()
+{
+    boost::system::error_code e;
+    mSocket.close( e );
+    mRequest = DecodedHeader( Opcode::opInvalid, 0, 0 );
+    mBody.Trim();
+    mReplies.clear();
+    mWriting.clear();
+    mBuffers.clear();
+    mPendingSize = 0;
+    mReadPaused = false;
+    mClosing = false;
+    mScan.reset();
+    mScanPaused = false;
+}
+
+constexpr size_t ConnectionPool::MAX_IDLE;
+
+ConnectionPool::ConnectionPool( boost::asio::io_service& io_service, bool shared, storage::IStorage& strg, stats::IStats& stats )
     : mIoService( io_service )
-    , mAcceptor( mIoService )
+    , mShared( shared )
     , mStorage( strg )
     , mStats( stats )
+{
+}
+
+std::shared_ptr< TcpConnection > ConnectionPool::Acquire()
+{
+    std::unique_ptr< TcpConnection > connection;
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+        if( !mIdle.empty() )
+        {
+            connection = std::move( mIdle.back() );
+            mIdle.pop_back();
+        }
+    }
+    if( !connection )
+        connection = std::make_unique< TcpConnection >( mIoService, mShared, mStorage, mStats );
+    // The deleter keeps the pool alive, connections may outlive the listener
+    return std::shared_ptr< TcpConnection >( connection.release(), [ pool = shared_from_this() ]( TcpConnection* c ){ pool->Release( c ); } );
+}
+
+void ConnectionPool::Release( TcpConnection* connection )
+{
+    std::unique_ptr< TcpConnection > c( connection ); // deleted after the lock if the pool is full
+    c->Reset();
+    std::lock_guard< std::mutex > lock( mMutex );
+    if( mIdle.size() < MAX_IDLE )
+        mIdle.push_back( std::move( c ) );
+}
+
+TcpListener::TcpListener( boost::asio::io_service& io_service, size_t port, bool reuse_port, bool shared, storage::IStorage& strg, stats::IStats& stats )
+    : mIoService( io_service )
+    , mAcceptor( mIoService )
+    , mPool( std::make_shared< ConnectionPool >( io_service, shared, strg, stats ) )
 {
     boost::asio::ip::tcp::endpoint endpoint{ boost::asio::ip::tcp::v4(), static_cast< unsigned short >( port ) };
     mAcceptor.open( endpoint.protocol() );
     mAcceptor.set_option( boost::asio::ip::tcp::acceptor::reuse_address( true ) );
+#ifdef SO_REUSEPORT
+    // The kernel spreads incoming connections over all listeners of the port
+    if( reuse_port )
+        mAcceptor.set_option( boost::asio::detail::socket_option::boolean< SOL_SOCKET, SO_REUSEPORT >( true ) );
+#else
+    ( void )reuse_port;
+#endif
     mAcceptor.bind( endpoint );
     mAcceptor.listen();
     StartAccept();
 }
 
-void TcpListener::Run( size_t threads )
+void TcpListener::Run( size_t threads, bool pin_threads )
 {
     std::vector< std::thread > thread_pool;
     for( size_t i = 0; i < threads; i++ )
-        thread_pool.emplace_back( [&](){ mIoService.run(); } );
+        thread_pool.emplace_back( [ &, i ](){ RunThread( mIoService, i, pin_threads ); } );
     for( std::thread &t : thread_pool )
         t.join();
 }
 
 void TcpListener::StartAccept()
 {
-    mConnection = std::make_shared< TcpConnection >( mIoService, mStorage, mStats );
+    mConnection = mPool->Acquire();
     mAcceptor.async_accept(
                 mConnection->Socket(),
                 [&]( boost::system::error_code const& ec ){ HandleAccept( ec ); }
@@ -256,16 +682,50 @@ void TcpListener::StartAccept()
 void TcpListener::HandleAccept( boost::system::error_code const& ec )
 {
     if( !ec )
+    {
+        // Replies go out whole, Nagle's algorithm would only hold the tail of a large one until the client acknowledges the head
+        boost::system::error_code ignored;
+        mConnection->Socket().set_option( boost::asio::ip::tcp::no_delay( true ), ignored );
         mConnection->Start();
+    }
 
     StartAccept();
 }
 
-void RunAsioServer( boost::asio::io_service& io_service, size_t port, size_t threads, storage::IStorage& strg, stats::IStats& stats )
+void RunAsioServer( boost::asio::io_service& io_service, size_t port, size_t threads, bool per_thread, bool pin_threads, storage::IStorage& strg, stats::IStats& stats )
 {
-    std::cout << "Start listening on TCP port " << port << " using " << threads << " threads..." << std::endl;
-    TcpListener listener( io_service, port, strg, stats );
-    listener.Run( threads );
+#ifndef SO_REUSEPORT
+    if( per_thread && threads > 1 )
+    {
+        per_thread = false;
+        std::cout << "Warning: SO_REUSEPORT is not supported, threads share one io_service" << std::endl;
+    }
+#endif
+    if( !per_thread )
+    {
+        std::cout << "Start listening on TCP port " << port << " using " << threads << " threads..." << std::endl;
+        TcpListener listener( io_service, port, false, threads > 1, strg, stats );
+        listener.Run( threads, pin_threads );
+        return;
+    }
+
+    // Every thread runs an io_service and a listener of its own, a connection stays on the thread that accepted it.
+    // The first thread takes io_service, with the timers already set on it.
+    std::cout << "Start listening on TCP port " << port << " using " << threads << " threads with an io_service each..." << std::endl;
+    std::vector< std::unique_ptr< boost::asio::io_service > > io_services;
+    std::vector< std::unique_ptr< TcpListener > > listeners;
+    for( size_t i = 0; i < threads; i++ )
+    {
+        if( i > 0 )
+            io_services.push_back( std::make_unique< boost::asio::io_service >( 1 ) );
+        boost::asio::io_service& thread_io_service = i == 0 ? io_service : *io_services.back();
+        listeners.push_back( std::make_unique< TcpListener >( thread_io_service, port, true, false, strg, stats ) );
+    }
+    std::vector< std::thread > thread_pool;
+    for( size_t i = 0; i < threads; i++ )
+        thread_pool.emplace_back( [ &, i ](){ RunThread( i == 0 ? io_service : *io_services[ i - 1 ], i, pin_threads ); } );
+    for( std::thread &t : thread_pool )
+        t.join();
 }
 
 } // namespace network
@@ -6,9 +6,15 @@
 #include <boost/asio/strand.hpp> // strand
 #include <memory> // shared_ptr
 #include <array> // array
+#include <vector> // vector
+#include <string> // string
+#include <optional> // optional
+#include <mutex> // mutex
 
 #include "../kvdb_data_models/kvdb_data_models.hpp"
 #include "kvdb_server_stats.hpp"
+#include "kvdb_server_value.hpp"
+#include "kvdb_server_pool.hpp"
 
 namespace storage
 {
@@ -20,10 +26,48 @@ class IStorage;
 namespace network
 {
 
+struct Reply
+{
+    Reply( DecodedHeader const& request, Status s, storage::ValueRef value = storage::ValueRef() );
+    Reply( DecodedHeader const& request, std::vector< Reply >&& entries ); // successful batch reply
+    size_t Size() const; // on the wire, including nested entries
+
+    std::array< char, sizeof( ResponseHeaderV2 ) > mHeader; // ResponseHeader or ResponseHeaderV2, as the request
+    size_t mHeaderSize;
+    storage::ValueRef mValue; // sent directly from storage memory
+    std::vector< Reply > mEntries;
+
+private:
+    void Encode( DecodedHeader const& request, Status s, size_t value_size );
+};
+
+// Buffer sequence over a vector of buffers, asio copies it into a write operation instead of the vector
+struct BufferView
+{
+    typedef boost::asio::const_buffer value_type;
+    typedef boost::asio::const_buffer const* const_iterator;
+
+    const_iterator begin() const
+    {
+        return mBegin;
+    }
+    const_iterator end() const
+    {
+        return mEnd;
+    }
+
+    const_iterator mBegin;
+    const_iterator mEnd;
+};
+
 class TcpConnection : public std::enable_shared_from_this< TcpConnection >
 {
 public:
-    TcpConnection( boost::asio::io_service &io_service, storage::IStorage& strg, stats::IStats& stats );
+    // A connection of an io_service run by several threads serializes its handlers on a strand,
+    // on an io_service of its own thread they run in order anyway.
+    // It is the io_service strand, which queues handlers in their own memory; strand<> allocates whenever a thread runs it
+    // after another, and different connections sharing one of the fixed strand implementations only costs some parallelism.
+    TcpConnection( boost::asio::io_service &io_service, bool shared, storage::IStorage& strg, stats::IStats& stats );
     boost::asio::ip::tcp::socket& Socket();
     void Start();
     void HandleReadHeader( boost::system::error_code const& error, size_t bytes_transferred );
@@ -31,11 +75,56 @@ public:
     void HandleWriteReply( boost::system::error_code const& error, size_t bytes_transferred );
 
 private:
-    boost::asio::io_service::strand mStrand;
+    static constexpr size_t MAX_BATCHED_REPLY_SIZE = 64 * 1024; // flush queued replies at least this often
+    static constexpr size_t MAX_PENDING_REPLY_SIZE = 4 * 1024 * 1024; // stop reading requests above this
+    static constexpr size_t SCAN_CHUNK_SIZE = 256; // items taken from storage under one lock
+    static constexpr size_t SCAN_REPLY_SIZE = 64 * 1024; // a streamed SCAN reply is closed at this many bytes of items
+
+    // SCAN in progress; the next request is read only after its last reply is queued
+    struct Scan
+    {
+        std::string mStart; // where the next chunk starts
+        bool mAfterStart;
+        std::string mBound;
+        bool mPrefix;
+        size_t mRemaining; // items left to the limit
+        stats::Clock::duration mStorageTime{}; // of all chunks
+    };
+
+    // Operations of the connection, with handlers in its HandlerMemory and on its strand if it has one
+    void Read( boost::asio::mutable_buffer buffer, void ( TcpConnection::*handle )( boost::system::error_code const&, size_t ) );
+    void Write( BufferView buffers );
+    template< typename Handler >
+    void Post( Handler&& handler );
+    std::vector< Reply > ProcessBatch( DecodedHeader const& h, std::vector< BatchEntry > const& entries );
+    bool StartScan( DecodedHeader const& h );
+    void ContinueScan();
+    void ReadNext();
+    void RegisterOperation( bool success, stats::Clock::duration storage_time );
+    void QueueReply( Reply&& reply );
+    void FlushReplies();
+    void Close();
+    void Reset(); // back to the state of a new connection, with buffers kept
+
+    friend class ConnectionPool;
+
+    std::optional< boost::asio::io_service::strand > mStrand; // none on an io_service of one thread
     boost::asio::ip::tcp::socket mSocket;
-    RequestHeader mHeader;
+    std::array< char, REQUEST_HEADER_SIZE > mHeader; // either version, told apart by magic
+    DecodedHeader mRequest;
+    stats::Clock::time_point mRequestStart; // when its header was read
     size_t mOffset;
-    std::vector< char > mBody;
+    RequestBuffer mBody;
+    std::vector< Reply > mReplies; // replies waiting for the next write
+    std::vector< Reply > mWriting; // replies of the write in progress, swapped with mReplies
+    std::vector< boost::asio::const_buffer > mBuffers; // of mWriting
+    HandlerMemory mReadMemory;
+    HandlerMemory mWriteMemory;
+    size_t mPendingSize; // bytes in mReplies and mWriting
+    bool mReadPaused;
+    bool mClosing;
+    std::unique_ptr< Scan > mScan;
+    bool mScanPaused; // waits for replies to be sent before the next chunk
     storage::IStorage& mStorage;
     stats::IStats& mStats;
 };
@@ -46,11 +135,33 @@ public:
     RequestProcessor();
 };
 
+// Connections of a listener that were closed, kept with their buffers and handler memory for the next accepted ones
+class ConnectionPool : public std::enable_shared_from_this< ConnectionPool >
+{
+public:
+    static constexpr size_t MAX_IDLE = 256;
+
+    ConnectionPool( boost::asio::io_service& io_service, bool shared, storage::IStorage& strg, stats::IStats& stats );
+    // The connection returns to the pool when its last reference is gone
+    std::shared_ptr< TcpConnection > Acquire();
+
+private:
+    void Release( TcpConnection* connection );
+
+    boost::asio::io_service& mIoService;
+    bool mShared;
+    storage::IStorage& mStorage;
+    stats::IStats& mStats;
+    std::mutex mMutex; // connections of a shared io_service are released by any of its threads
+    std::vector< std::unique_ptr< TcpConnection > > mIdle;
+};
+
 class TcpListener
 {
 public:
-    TcpListener( boost::asio::io_service& io_service, size_t port, storage::IStorage& strg, stats::IStats& stats );
-    void Run( size_t threads );
+    // With reuse_port several listeners, each on an io_service of its own thread, accept connections of the same port
+    TcpListener( boost::asio::io_service& io_service, size_t port, bool reuse_port, bool shared, storage::IStorage& strg, stats::IStats& stats );
+    void Run( size_t threads, bool pin_threads );
     void StartAccept();
     void HandleAccept( boost::system::error_code const& ec );
 
@@ -58,8 +169,7 @@ private:
     boost::asio::io_service& mIoService;
     boost::asio::ip::tcp::acceptor mAcceptor;
     std::shared_ptr< TcpConnection > mConnection;
-    storage::IStorage& mStorage;
-    stats::IStats& mStats;
+    std::shared_ptr< ConnectionPool > mPool;
 };
 
 } // namespace network
@@ -0,0 +1,102 @@
+#include "kvdb_server_pool.hpp"
+
+#include <array>
+#include <vector>
+
+namespace network
+{
+
+constexpr size_t HandlerMemory::SIZE;
+
+constexpr size_t BufferPool::MIN_CLASS_BITS;
+constexpr size_t BufferPool::CLASS_COUNT;
+constexpr size_t BufferPool::MAX_FREE_PER_CLASS;
+constexpr size_t BufferPool::MAX_KEPT_SIZE;
+
+constexpr size_t RequestBuffer::RETAINED_SIZE;
+
+namespace
+{
+
+thread_local std::array< std::vector< std::unique_ptr< char[] > >, BufferPool::CLASS_COUNT > tFreeBuffers; // only the classes up to MAX_KEPT_SIZE fill
+
+size_t ClassOf( size_t size )
+{
+    size_t c = 0;
+    while( c < BufferPool::CLASS_COUNT && ( size_t( 1 ) << ( BufferPool::MIN_CLASS_BITS + c ) ) < size )
+        c++;
+    return c; // CLASS_COUNT if above the largest class
+}
+
+} // namespace
+
+void* HandlerMemory::Allocate( size_t size )
+{
+    if( !mInUse && size <= SIZE )
+    {
+        mInUse = true;
+        return mStorage;
+    }
+    return ::operator new( size );
+}
+
+void HandlerMemory::Deallocate( void* p )
+{
+    if( p == mStorage )
+        mInUse = false;
+    else
+        ::operator delete( p );
+}
+
+std::unique_ptr< char[] > BufferPool::Acquire( size_t size, size_t& capacity )
+{
+    size_t c = ClassOf( size );
+    if( c == CLASS_COUNT )
+    {
+        capacity = size;
+        return std::unique_ptr< char[] >( new char[ size ] );
+    }
+    capacity = size_t( 1 ) << ( MIN_CLASS_BITS + c );
+    auto& free = tFreeBuffers[ c ];
+    if( free.empty() )
+        return std::unique_ptr< char[] >( new char[ capacity ] );
+    std::unique_ptr< char[] > data = std::move( free.back() );
+    free.pop_back();
+    return data;
+}
+
+void BufferPool::Release( std::unique_ptr< char[] > data, size_t capacity )
+{
+    size_t c = ClassOf( capacity );
+    if( capacity > MAX_KEPT_SIZE || ( size_t( 1 ) << ( MIN_CLASS_BITS + c ) ) != capacity )
+        return;
+    auto& free = tFreeBuffers[ c ];
+    if( free.size() < MAX_FREE_PER_CLASS )
+        free.push_back( std::move( data ) );
+}
+
+RequestBuffer::~RequestBuffer()
+{
+    Trim( 0 );
+}
+
+void RequestBuffer::Resize( size_t size )
+{
+    if( size > mCapacity )
+    {
+        Trim( 0 );
+        mData = BufferPool::Acquire( size, mCapacity );
+    }
+    mSize = size;
+}
+
+void RequestBuffer::Trim( size_t retained )
+{
+    if( mCapacity <= retained )
+        return;
+    BufferPool::Release( std::move( mData ), mCapacity );
+    mSize = 0;
+    mCapacity = 0;
+}
+
+} // namespace network
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstddef>
+#include <memory>
+#include <utility>
+#include <type_traits>
+
+namespace network
+{
+
+// Memory of one kind of asynchronous operation of a connection (read or write), so operations in flight do not go to the heap.
+// It serves one allocation at a time; one that finds it busy or too small falls back to operator new.
+// Asio frees an operation before its handler runs, so the handler may start the next operation of the kind in the same memory.
+class HandlerMemory
+{
+public:
+    static constexpr size_t SIZE = 1024;
+
+    HandlerMemory() = default;
+    HandlerMemory( HandlerMemory const& ) = delete;
+    HandlerMemory& operator=( HandlerMemory const& ) = delete;
+
+    void* Allocate( size_t size );
+    void Deallocate( void* p );
+
+private:
+    alignas( std::max_align_t ) char mStorage[ SIZE ];
+    bool mInUse = false;
+};
+
+template< typename T >
+class HandlerAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator( HandlerMemory& memory )
+        : mMemory( &memory )
+    {
+    }
+    template< typename U >
+    HandlerAllocator( HandlerAllocator< U > const& other )
+        : mMemory( other.mMemory )
+    {
+    }
+
+    T* allocate( size_t n ) const
+    {
+        return static_cast< T* >( mMemory->Allocate( sizeof( T ) * n ) );
+    }
+    void deallocate( T* p, size_t ) const
+    {
+        mMemory->Deallocate( p );
+    }
+
+    bool operator==( HandlerAllocator const& other ) const
+    {
+        return mMemory == other.mMemory;
+    }
+    bool operator!=( HandlerAllocator const& other ) const
+    {
+        return mMemory != other.mMemory;
+    }
+
+private:
+    template< typename > friend class HandlerAllocator;
+
+    HandlerMemory* mMemory;
+};
+
+// Completion handler whose associated allocator takes operation memory from HandlerMemory
+template< typename Handler >
+class AllocatingHandler
+{
+public:
+    typedef HandlerAllocator< Handler > allocator_type;
+
+    AllocatingHandler( HandlerMemory& memory, Handler&& handler )
+        : mMemory( memory )
+        , mHandler( std::move( handler ) )
+    {
+    }
+
+    allocator_type get_allocator() const noexcept
+    {
+        return allocator_type( mMemory );
+    }
+
+    template< typename... Args >
+    void operator()( Args&&... args )
+    {
+        mHandler( std::forward< Args >( args )... );
+    }
+
+private:
+    HandlerMemory& mMemory;
+    Handler mHandler;
+};
+
+template< typename Handler >
+AllocatingHandler< std::decay_t< Handler > > MakeAllocatingHandler( HandlerMemory& memory, Handler&& handler )
+{
+    return AllocatingHandler< std::decay_t< Handler > >( memory, std::forward< Handler >( handler ) );
+}
+
+// Request bodies in power of two size classes. Free buffers up to MAX_KEPT_SIZE are kept by the thread that released them,
+// a few of each class, so a thread holds less than half a megabyte of them; larger ones go back to the heap,
+// as a connection holds no more than RETAINED_SIZE between requests.
+class BufferPool
+{
+public:
+    static constexpr size_t MIN_CLASS_BITS = 12; // 4 KB
+    static constexpr size_t CLASS_COUNT = 14; // up to 32 MB
+    static constexpr size_t MAX_FREE_PER_CLASS = 4;
+    static constexpr size_t MAX_KEPT_SIZE = 64 * 1024;
+
+    // Capacity is set to the size of the class, or to size above the largest class
+    static std::unique_ptr< char[] > Acquire( size_t size, size_t& capacity );
+    static void Release( std::unique_ptr< char[] > data, size_t capacity );
+};
+
+// Receive buffer of a connection, contents are not kept when it grows
+class RequestBuffer
+{
+public:
+    static constexpr size_t RETAINED_SIZE = BufferPool::MAX_KEPT_SIZE;
+
+    RequestBuffer() = default;
+    ~RequestBuffer();
+    RequestBuffer( RequestBuffer const& ) = delete;
+    RequestBuffer& operator=( RequestBuffer const& ) = delete;
+
+    char* Data() const
+    {
+        return mData.get();
+    }
+    size_t Size() const
+    {
+        return mSize;
+    }
+    void Resize( size_t size );
+    // Gives memory above retained back to the pool
+    void Trim( size_t retained = RETAINED_SIZE );
+
+private:
+    std::unique_ptr< char[] > mData;
+    size_t mSize = 0;
+    size_t mCapacity = 0;
+};
+
+} // namespace network
@@ -0,0 +1,285 @@
+#include "kvdb_server_slab.hpp"
+
+#include <cstdint> // uintptr_t
+#include <algorithm>
+#include <new>
+
+namespace storage
+{
+
+constexpr size_t SlabAllocator::SLAB_SIZE;
+constexpr size_t SlabAllocator::SLAB_HEADER_SIZE;
+constexpr size_t SlabAllocator::ALIGNMENT;
+constexpr size_t SlabAllocator::MIN_CHUNK_SIZE;
+constexpr size_t SlabAllocator::MAX_CHUNK_SIZE;
+constexpr double SlabAllocator::GROWTH_FACTOR;
+constexpr size_t SlabAllocator::MAGAZINE_CHUNKS;
+constexpr size_t SlabAllocator::MAGAZINE_BYTES;
+
+namespace
+{
+
+// Set once the magazines of the thread are drained at its end, later calls of the thread take the locks
+thread_local bool tCacheGone = false;
+
+} // namespace
+
+SlabAllocator& SlabAllocator::Instance()
+{
+    static SlabAllocator instance;
+    return instance;
+}
+
+SlabAllocator::SlabAllocator()
+{
+    for( size_t size = MIN_CHUNK_SIZE; ; )
+    {
+        mChunkSizes.push_back( size );
+        if( size == MAX_CHUNK_SIZE )
+            break;
+        size_t next = static_cast< size_t >( size * GROWTH_FACTOR );
+        next = ( next + ALIGNMENT - 1 ) / ALIGNMENT * ALIGNMENT;
+        size = std::min( std::max( next, size + ALIGNMENT ), MAX_CHUNK_SIZE );
+    }
+    static_assert( sizeof( Slab ) <= SLAB_HEADER_SIZE, "slab header does not fit" );
+    mClasses.reset( new SizeClass[ mChunkSizes.size() ] );
+    for( size_t i = 0; i < mChunkSizes.size(); i++ )
+    {
+        SizeClass& c = mClasses[ i ];
+        c.mChunkSize = mChunkSizes[ i ];
+        c.mChunksPerSlab = ( SLAB_SIZE - SLAB_HEADER_SIZE ) / c.mChunkSize;
+        size_t magazine = std::min( MAGAZINE_CHUNKS, MAGAZINE_BYTES / c.mChunkSize );
+        c.mMagazineSize = magazine >= 2 ? magazine : 0;
+    }
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    for( size_t i = 0; i < mChunkSizes.size(); i++ )
+    {
+        for( Slab* list : { mClasses[ i ].mPartial, mClasses[ i ].mFull } )
+        {
+            while( list != nullptr )
+            {
+                Slab* next = list->mNext;
+                ::operator delete( list, std::align_val_t( SLAB_SIZE ) );
+                list = next;
+            }
+        }
+    }
+}
+
+SlabAllocator::ThreadCache::~ThreadCache()
+{
+    SlabAllocator& allocator = Instance();
+    for( size_t i = 0; i < mMagazines.size(); i++ )
+    {
+        SizeClass& c = allocator.mClasses[ i ];
+        std::lock_guard< std::mutex > lock( c.mMutex );
+        for( FreeChunk* chunk = mMagazines[ i ].mHead; chunk != nullptr; )
+        {
+            FreeChunk* next = chunk->mNext;
+            allocator.Put( c, chunk );
+            chunk = next;
+        }
+    }
+    tCacheGone = true;
+}
+
+SlabAllocator::Magazine* SlabAllocator::ThreadMagazines()
+{
+    if( tCacheGone )
+        return nullptr;
+    try
+    {
+        thread_local ThreadCache cache{ std::vector< Magazine >( Instance().mChunkSizes.size() ) };
+        return cache.mMagazines.data();
+    }
+    catch( std::bad_alloc const& )
+    {
+        return nullptr; // tried again by the next call
+    }
+}
+
+namespace
+{
+
+template< typename Node >
+void Unlink( Node*& head, Node* node )
+{
+    if( node->mPrev != nullptr )
+        node->mPrev->mNext = node->mNext;
+    else
+        head = node->mNext;
+    if( node->mNext != nullptr )
+        node->mNext->mPrev = node->mPrev;
+}
+
+template< typename Node >
+void PushFront( Node*& head, Node* node )
+{
+    node->mPrev = nullptr;
+    node->mNext = head;
+    if( head != nullptr )
+        head->mPrev = node;
+    head = node;
+}
+
+} // namespace
+
+void* SlabAllocator::Take( SizeClass& c )
+{
+    Slab* s = c.mPartial;
+    if( s == nullptr )
+    {
+        s = new( ::operator new( SLAB_SIZE, std::align_val_t( SLAB_SIZE ) ) ) Slab;
+        s->mCarve = reinterpret_cast< char* >( s ) + SLAB_HEADER_SIZE;
+        s->mCarveEnd = s->mCarve + c.mChunksPerSlab * c.mChunkSize;
+        PushFront( c.mPartial, s );
+        c.mSlabs++;
+    }
+    void* p = s->mFree;
+    if( p != nullptr )
+    {
+        s->mFree = s->mFree->mNext;
+    }
+    else
+    {
+        p = s->mCarve;
+        s->mCarve += c.mChunkSize;
+    }
+    s->mLive++;
+    c.mUsed++;
+    if( s->mLive == c.mChunksPerSlab )
+    {
+        Unlink( c.mPartial, s );
+        PushFront( c.mFull, s );
+        s->mFull = true;
+    }
+    return p;
+}
+
+void SlabAllocator::Put( SizeClass& c, void* p )
+{
+    Slab* s = reinterpret_cast< Slab* >( reinterpret_cast< std::uintptr_t >( p ) & ~( SLAB_SIZE - 1 ) );
+    s->mFree = new( p ) FreeChunk{ s->mFree };
+    s->mLive--;
+    c.mUsed--;
+    if( s->mFull )
+    {
+        Unlink( c.mFull, s );
+        PushFront( c.mPartial, s );
+        s->mFull = false;
+    }
+    if( s->mLive == 0 && ( s->mPrev != nullptr || s->mNext != nullptr ) )
+    {
+        Unlink( c.mPartial, s );
+        ::operator delete( s, std::align_val_t( SLAB_SIZE ) );
+        c.mSlabs--;
+        c.mReleased++;
+    }
+}
+
+size_t SlabAllocator::ClassIndex( size_t size ) const
+{
+    return std::lower_bound( mChunkSizes.begin(), mChunkSizes.end(), size ) - mChunkSizes.begin();
+}
+
+void* SlabAllocator::Allocate( size_t size )
+{
+    if( size > MAX_CHUNK_SIZE )
+    {
+        void* p = ::operator new( size );
+        mLargeCount.fetch_add( 1, std::memory_order_relaxed );
+        mLargeSize.fetch_add( size, std::memory_order_relaxed );
+        return p;
+    }
+
+    size_t index = ClassIndex( size );
+    SizeClass& c = mClasses[ index ];
+    Magazine* magazines = c.mMagazineSize != 0 ? ThreadMagazines() : nullptr;
+    if( magazines == nullptr )
+    {
+        std::lock_guard< std::mutex > lock( c.mMutex );
+        return Take( c );
+    }
+
+    Magazine& m = magazines[ index ];
+    if( m.mCount == 0 )
+    {
+        // Half a magazine, a new slab is taken only for the first chunk
+        std::lock_guard< std::mutex > lock( c.mMutex );
+        while( m.mCount < c.mMagazineSize / 2 && ( m.mCount == 0 || c.mPartial != nullptr ) )
+        {
+            m.mHead = new( Take( c ) ) FreeChunk{ m.mHead };
+            m.mCount++;
+        }
+    }
+    FreeChunk* p = m.mHead;
+    m.mHead = p->mNext;
+    m.mCount--;
+    return p;
+}
+
+void SlabAllocator::Deallocate( void* p, size_t size ) noexcept
+{
+    if( p == nullptr )
+        return;
+    if( size > MAX_CHUNK_SIZE )
+    {
+        mLargeCount.fetch_sub( 1, std::memory_order_relaxed );
+        mLargeSize.fetch_sub( size, std::memory_order_relaxed );
+        ::operator delete( p );
+        return;
+    }
+
+    size_t index = ClassIndex( size );
+    SizeClass& c = mClasses[ index ];
+    Magazine* magazines = c.mMagazineSize != 0 ? ThreadMagazines() : nullptr;
+    if( magazines == nullptr )
+    {
+        std::lock_guard< std::mutex > lock( c.mMutex );
+        Put( c, p );
+        return;
+    }
+
+    Magazine& m = magazines[ index ];
+    if( m.mCount == c.mMagazineSize )
+    {
+        std::lock_guard< std::mutex > lock( c.mMutex );
+        while( m.mCount > c.mMagazineSize / 2 )
+        {
+            FreeChunk* chunk = m.mHead;
+            m.mHead = chunk->mNext;
+            m.mCount--;
+            Put( c, chunk );
+        }
+    }
+    m.mHead = new( p ) FreeChunk{ m.mHead };
+    m.mCount++;
+}
+
+std::vector< SlabAllocator::ClassStats > SlabAllocator::GetStats() const
+{
+    std::vector< ClassStats > stats;
+    stats.reserve( mChunkSizes.size() );
+    for( size_t i = 0; i < mChunkSizes.size(); i++ )
+    {
+        SizeClass const& c = mClasses[ i ];
+        std::lock_guard< std::mutex > lock( c.mMutex );
+        stats.push_back( { c.mChunkSize, c.mSlabs, c.mUsed, c.mSlabs * c.mChunksPerSlab, c.mReleased } );
+    }
+    return stats;
+}
+
+size_t SlabAllocator::GetLargeCount() const
+{
+    return mLargeCount.load( std::memory_order_relaxed );
+}
+
+size_t SlabAllocator::GetLargeSize() const
+{
+    return mLargeSize.load( std::memory_order_relaxed );
+}
+
+} // namespace storage
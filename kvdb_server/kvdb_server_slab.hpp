@@ -0,0 +1,151 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+
+namespace storage
+{
+
+// Size class allocator for item memory of the in-memory storages.
+// Requests are rounded up to one of the chunk sizes, which grow by GROWTH_FACTOR, and served from SLAB_SIZE blocks
+// carved into equal chunks; a freed chunk goes back to the free list of its slab and is reused by the next request
+// of a similar size, so churn does not fragment the heap. Requests above MAX_CHUNK_SIZE go to operator new.
+// Every thread keeps a magazine of free chunks per class and takes the lock of the class only to refill or drain
+// half of it, so threads of different shards rarely meet on a lock. A slab whose chunks are all free is given back
+// unless it is the last one of its class with free chunks, which is kept so a class does not keep taking and releasing one.
+class SlabAllocator
+{
+public:
+    static constexpr size_t SLAB_SIZE = 1024 * 1024; // slabs are aligned to their size, a chunk finds its slab by its address
+    static constexpr size_t SLAB_HEADER_SIZE = 64;
+    static constexpr size_t ALIGNMENT = 8;
+    static constexpr size_t MIN_CHUNK_SIZE = 16;
+    static constexpr size_t MAX_CHUNK_SIZE = ( SLAB_SIZE - SLAB_HEADER_SIZE ) / 4;
+    static constexpr double GROWTH_FACTOR = 1.25;
+    static constexpr size_t MAGAZINE_CHUNKS = 32;
+    static constexpr size_t MAGAZINE_BYTES = 16 * 1024; // classes whose magazine would hold fewer than 2 chunks have none
+
+    struct ClassStats
+    {
+        size_t mChunkSize;
+        size_t mSlabs;
+        size_t mUsed; // chunks handed out, including the ones in magazines of threads
+        size_t mTotal; // chunks in all slabs of the class
+        size_t mReleased; // slabs given back since the start
+    };
+
+    static SlabAllocator& Instance();
+
+    void* Allocate( size_t size );
+    // Size must be the one given to Allocate
+    void Deallocate( void* p, size_t size ) noexcept;
+
+    std::vector< ClassStats > GetStats() const;
+    size_t GetLargeCount() const;
+    size_t GetLargeSize() const;
+
+    SlabAllocator( SlabAllocator const& ) = delete;
+    SlabAllocator& operator=( SlabAllocator const& ) = delete;
+
+private:
+    SlabAllocator();
+    ~SlabAllocator();
+
+    struct FreeChunk
+    {
+        FreeChunk* mNext;
+    };
+
+    // Header at the start of a slab
+    struct Slab
+    {
+        Slab* mPrev = nullptr;
+        Slab* mNext = nullptr;
+        FreeChunk* mFree = nullptr;
+        char* mCarve; // untouched tail
+        char* mCarveEnd;
+        size_t mLive = 0;
+        bool mFull = false; // in the list of full slabs rather than the one of slabs with free chunks
+    };
+
+    struct Magazine
+    {
+        FreeChunk* mHead = nullptr;
+        size_t mCount = 0;
+    };
+
+    // Magazines of a thread, drained when the thread ends
+    struct ThreadCache
+    {
+        std::vector< Magazine > mMagazines;
+        ~ThreadCache();
+    };
+
+    struct alignas( 64 ) SizeClass
+    {
+        mutable std::mutex mMutex;
+        size_t mChunkSize = 0;
+        size_t mChunksPerSlab = 0;
+        size_t mMagazineSize = 0;
+        Slab* mPartial = nullptr; // slabs with free chunks
+        Slab* mFull = nullptr;
+        size_t mSlabs = 0;
+        size_t mUsed = 0;
+        size_t mReleased = 0;
+    };
+
+    size_t ClassIndex( size_t size ) const;
+    static Magazine* ThreadMagazines();
+    // Both need the lock of the class
+    void* Take( SizeClass& c );
+    void Put( SizeClass& c, void* p );
+
+    std::vector< size_t > mChunkSizes;
+    std::unique_ptr< SizeClass[] > mClasses;
+    std::atomic< size_t > mLargeCount{ 0 };
+    std::atomic< size_t > mLargeSize{ 0 };
+};
+
+// Standard allocator over SlabAllocator for containers of the in-memory storages
+template< typename T >
+class SlabStdAllocator
+{
+public:
+    typedef T value_type;
+
+    SlabStdAllocator() noexcept = default;
+    template< typename U >
+    SlabStdAllocator( SlabStdAllocator< U > const& ) noexcept
+    {
+    }
+
+    T* allocate( size_t n )
+    {
+        static_assert( alignof( T ) <= SlabAllocator::ALIGNMENT, "type is over-aligned for slab chunks" );
+        return static_cast< T* >( SlabAllocator::Instance().Allocate( n * sizeof( T ) ) );
+    }
+    void deallocate( T* p, size_t n ) noexcept
+    {
+        SlabAllocator::Instance().Deallocate( p, n * sizeof( T ) );
+    }
+};
+
+template< typename T, typename U >
+bool operator==( SlabStdAllocator< T > const&, SlabStdAllocator< U > const& )
+{
+    return true;
+}
+
+template< typename T, typename U >
+bool operator!=( SlabStdAllocator< T > const&, SlabStdAllocator< U > const& )
+{
+    return false;
+}
+
+typedef std::basic_string< char, std::char_traits< char >, SlabStdAllocator< char > > SlabString;
+
+} // namespace storage
@@ -2,58 +2,487 @@
 
 #include <iostream>
 #include <cinttypes>
+#include <functional>
+#include <algorithm>
+#include <type_traits>
 
 namespace storage
 {
 
-TempStorage::TempStorage()
+template< typename Map >
+MemoryStorage< Map >::MemoryStorage( size_t shards, size_t cache_size, std::unique_ptr< WriteAheadLog > log, size_t compress_above )
+    : mShardCount( std::max< size_t >( shards, 1 ) )
+    , mShards( new Shard[ mShardCount ] )
+    , mCompression( compress_above )
+    , mLog( std::move( log ) )
 {
-    std::cout << "Temporal storage created..." << std::endl;
+    if( cache_size != 0 )
+    {
+        for( size_t i = 0; i < mShardCount; i++ )
+            mShards[ i ].mCache = std::make_unique< S3Fifo >( cache_size / mShardCount );
+    }
+    std::cout << ( std::is_same< MemoryStorage< Map >, HashStorage >::value ? "Hashed" : "Temporal" )
+              << " storage with " << mShardCount << " shards";
+    if( cache_size != 0 )
+        std::cout << " and a cache size of " << cache_size << " bytes";
+    if( compress_above != 0 )
+        std::cout << ", compressing values over " << compress_above << " bytes,";
+    std::cout << " created..." << std::endl;
+    if( mLog )
+        mLog->Open( *this );
 }
 
-IStorage::ErrorCode TempStorage::Insert( std::string_view key, std::string_view value )
+template< typename Map >
+MemoryStorage< Map >::~MemoryStorage()
 {
-    std::lock_guard< std::shared_mutex > lock( mMutex );
-    auto found = mMap.find( key );
-    if( found != mMap.end() )
-        return ecKeyAlreadyExists;
-    mMap.emplace( key, value );
-    return ecSuccess;
+    mLog.reset(); // stops the snapshot thread before the shards go away
 }
 
-IStorage::ErrorCode TempStorage::Update( std::string_view key, std::string_view value )
+template< typename Map >
+size_t MemoryStorage< Map >::ShardIndex( std::string_view key ) const
 {
-    std::lock_guard< std::shared_mutex > lock( mMutex );
-    auto found = mMap.find( key );
-    if( found == mMap.end() )
-        return ecKeyNotFound;
-    if( found->second == value )
-        return ecValueNotChanged;
-    found->second = value;
-    return ecSuccess;
+    return mShardCount == 1 ? 0 : std::hash< std::string_view >{}( key ) % mShardCount;
 }
 
-IStorage::ErrorCode TempStorage::Delete( std::string_view key )
+template< typename Map >
+std::vector< std::pair< size_t, size_t > > MemoryStorage< Map >::GroupByShard( std::vector< std::string_view > const& keys ) const
 {
-    std::lock_guard< std::shared_mutex > lock( mMutex );
-    if( mMap.erase( std::string( key ) ) == 0 )
-        return ecKeyNotFound;
-    return ecSuccess;
+    std::vector< std::pair< size_t, size_t > > order;
+    order.reserve( keys.size() );
+    for( size_t i = 0; i < keys.size(); i++ )
+        order.emplace_back( ShardIndex( keys[ i ] ), i );
+    if( mShardCount > 1 )
+        std::sort( order.begin(), order.end() );
+    return order;
 }
 
-std::optional< std::string > TempStorage::Get( std::string_view key )
+template< typename Map >
+bool MemoryStorage< Map >::WaitLogged( std::uint64_t position )
 {
-    std::shared_lock< std::shared_mutex > lock( mMutex );
-    auto found = mMap.find( key );
-    if( found == mMap.end() )
-        return {};
-    return found->second;
+    return !mLog || position == 0 || mLog->WaitDurable( position );
 }
 
-size_t TempStorage::GetItemCount()
+template< typename Map >
+void MemoryStorage< Map >::ScheduleExpiry( std::string_view key, Expiry expiry )
 {
-    std::shared_lock< std::shared_mutex > lock( mMutex );
-    return mMap.size();
+    if( expiry != NO_EXPIRY )
+        mExpiry.Schedule( key, expiry );
 }
 
+template< typename Map >
+void MemoryStorage< Map >::Account( Shard& shard, std::string_view key, Value const* old, Value const* v )
+{
+    if( !shard.mCache )
+        return;
+    if( old != nullptr && v != nullptr )
+        shard.mCache->Replaced( key, *old, *v );
+    else if( v != nullptr )
+        shard.mCache->Added( key, *v );
+    else if( old != nullptr )
+        shard.mCache->Removed( key, *old );
+}
+
+template< typename Map >
+void MemoryStorage< Map >::Evict( Shard& shard, std::vector< ValueRef >& released, bool log )
+{
+    if( !shard.mCache )
+        return;
+    auto current = [ &shard ]( std::string_view key ) -> Value const*
+    {
+        auto found = shard.mMap.find( key );
+        return found == shard.mMap.end() ? nullptr : found->second.get();
+    };
+    std::string key;
+    while( shard.mCache->NextVictim( current, key ) )
+    {
+        auto found = shard.mMap.find( std::string_view( key ) );
+        released.push_back( std::move( found->second ) );
+        shard.mMap.erase( found );
+        shard.mCache->Evicted( key, *released.back() );
+        // Not waited for, an evicted item that comes back after a crash is evicted again
+        if( mLog && log )
+            mLog->AppendDelete( key );
+        mEvicted.fetch_add( 1, std::memory_order_relaxed );
+    }
+    shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+}
+
+template< typename Map >
+IStorage::ErrorCode MemoryStorage< Map >::Insert( std::string_view key, std::string_view value, Expiry expiry )
+{
+    ValueRef v = Value::Create( value, expiry, mCompression ); // copy outside of the lock
+    ValueRef old;
+    std::vector< ValueRef > evicted;
+    std::uint64_t logged = 0;
+    Shard& shard = mShards[ ShardIndex( key ) ];
+    {
+        std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+        auto found = shard.mMap.find( key );
+        if( found != shard.mMap.end() )
+        {
+            if( !IsExpired( found->second->GetExpiry() ) )
+                return ecKeyAlreadyExists;
+            Account( shard, key, found->second.get(), v.get() );
+            old.swap( found->second ); // an expired item is replaced as if it was gone
+            found->second = std::move( v );
+        }
+        else
+        {
+            Account( shard, key, nullptr, v.get() );
+            shard.mMap.emplace( key, std::move( v ) );
+        }
+        shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+        if( mLog )
+            logged = mLog->AppendSet( key, value, expiry );
+        Evict( shard, evicted );
+    }
+    ScheduleExpiry( key, expiry );
+    // The reply is sent only for a durable change
+    return WaitLogged( logged ) ? ecSuccess : ecLogFailed;
+}
+
+template< typename Map >
+IStorage::ErrorCode MemoryStorage< Map >::Update( std::string_view key, std::string_view value, Expiry expiry )
+{
+    ValueRef v = Value::Create( value, expiry, mCompression );
+    ValueRef old; // released after the lock, readers may still hold it
+    std::vector< ValueRef > evicted;
+    std::uint64_t logged = 0;
+    Shard& shard = mShards[ ShardIndex( key ) ];
+    {
+        std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+        auto found = shard.mMap.find( key );
+        if( found == shard.mMap.end() || IsExpired( found->second->GetExpiry() ) )
+            return ecKeyNotFound;
+        // Packing is deterministic, so equal packed bytes are equal values
+        if( found->second->View() == v->View() && found->second->IsCompressed() == v->IsCompressed() && found->second->GetExpiry() == expiry )
+            return ecValueNotChanged;
+        Account( shard, key, found->second.get(), v.get() );
+        old.swap( found->second );
+        found->second = std::move( v );
+        if( mLog )
+            logged = mLog->AppendSet( key, value, expiry );
+        Evict( shard, evicted );
+    }
+    ScheduleExpiry( key, expiry );
+    return WaitLogged( logged ) ? ecSuccess : ecLogFailed;
+}
+
+template< typename Map >
+IStorage::ErrorCode MemoryStorage< Map >::Delete( std::string_view key )
+{
+    ValueRef old;
+    std::uint64_t logged = 0;
+    Shard& shard = mShards[ ShardIndex( key ) ];
+    {
+        std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+        auto found = shard.mMap.find( key );
+        if( found == shard.mMap.end() )
+            return ecKeyNotFound;
+        bool expired = IsExpired( found->second->GetExpiry() );
+        Account( shard, key, found->second.get(), nullptr );
+        old.swap( found->second );
+        shard.mMap.erase( found );
+        shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+        if( mLog )
+            logged = mLog->AppendDelete( key );
+        if( expired )
+            return ecKeyNotFound; // removed all the same, so the reaper has nothing left to do
+    }
+    return WaitLogged( logged ) ? ecSuccess : ecLogFailed;
+}
+
+template< typename Map >
+ValueRef MemoryStorage< Map >::Get( std::string_view key )
+{
+    ValueRef v;
+    {
+        Shard& shard = mShards[ ShardIndex( key ) ];
+        std::shared_lock< std::shared_mutex > lock( shard.mMutex );
+        auto found = shard.mMap.find( key );
+        if( found == shard.mMap.end() || IsExpired( found->second->GetExpiry() ) )
+            return {};
+        if( shard.mCache )
+            found->second->Touch();
+        v = found->second;
+    }
+    return v->Unpacked();
+}
+
+template< typename Map >
+std::vector< ValueRef > MemoryStorage< Map >::MultiGet( std::vector< std::string_view > const& keys )
+{
+    std::vector< ValueRef > values( keys.size() );
+    auto order = GroupByShard( keys );
+    for( size_t i = 0; i < order.size(); )
+    {
+        Shard& shard = mShards[ order[ i ].first ];
+        std::shared_lock< std::shared_mutex > lock( shard.mMutex );
+        for( size_t s = order[ i ].first; i < order.size() && order[ i ].first == s; i++ )
+        {
+            auto found = shard.mMap.find( keys[ order[ i ].second ] );
+            if( found != shard.mMap.end() && !IsExpired( found->second->GetExpiry() ) )
+            {
+                if( shard.mCache )
+                    found->second->Touch();
+                values[ order[ i ].second ] = found->second;
+            }
+        }
+    }
+    for( ValueRef& v : values )
+    {
+        if( v && v->IsCompressed() )
+            v = v->Unpacked();
+    }
+    return values;
+}
+
+template< typename Map >
+std::vector< IStorage::ErrorCode > MemoryStorage< Map >::MultiSet( std::vector< KeyValue > const& items, Expiry expiry )
+{
+    std::vector< std::string_view > keys;
+    std::vector< ValueRef > values;
+    keys.reserve( items.size() );
+    values.reserve( items.size() );
+    for( auto const& item : items )
+    {
+        keys.push_back( item.first );
+        values.push_back( Value::Create( item.second, expiry, mCompression ) );
+    }
+
+    std::vector< ErrorCode > results( items.size(), ecSuccess );
+    std::vector< ValueRef > evicted;
+    std::uint64_t logged = 0;
+    auto order = GroupByShard( keys );
+    for( size_t i = 0; i < order.size(); )
+    {
+        Shard& shard = mShards[ order[ i ].first ];
+        std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+        for( size_t s = order[ i ].first; i < order.size() && order[ i ].first == s; i++ )
+        {
+            std::string_view key = keys[ order[ i ].second ];
+            ValueRef& value = values[ order[ i ].second ];
+            auto found = shard.mMap.find( key );
+            if( found == shard.mMap.end() )
+            {
+                Account( shard, key, nullptr, value.get() );
+                shard.mMap.emplace( key, std::move( value ) );
+            }
+            else if( found->second->View() == value->View() && found->second->IsCompressed() == value->IsCompressed() && found->second->GetExpiry() == expiry )
+            {
+                results[ order[ i ].second ] = ecValueNotChanged;
+                continue;
+            }
+            else
+            {
+                Account( shard, key, found->second.get(), value.get() );
+                found->second.swap( value ); // old value is released with values, outside of the lock
+            }
+            if( mLog )
+                logged = mLog->AppendSet( key, items[ order[ i ].second ].second, expiry );
+        }
+        shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+        Evict( shard, evicted );
+    }
+    if( expiry != NO_EXPIRY )
+    {
+        for( size_t i = 0; i < items.size(); i++ )
+            if( results[ i ] == ecSuccess )
+                mExpiry.Schedule( keys[ i ], expiry );
+    }
+    if( !WaitLogged( logged ) )
+        std::replace( results.begin(), results.end(), ecSuccess, ecLogFailed );
+    return results;
+}
+
+template< typename Map >
+std::vector< IStorage::ErrorCode > MemoryStorage< Map >::MultiDelete( std::vector< std::string_view > const& keys )
+{
+    std::vector< ErrorCode > results( keys.size(), ecSuccess );
+    std::vector< ValueRef > removed; // released outside of the locks, as Delete does
+    removed.reserve( keys.size() );
+    std::uint64_t logged = 0;
+    auto order = GroupByShard( keys );
+    for( size_t i = 0; i < order.size(); )
+    {
+        Shard& shard = mShards[ order[ i ].first ];
+        std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+        for( size_t s = order[ i ].first; i < order.size() && order[ i ].first == s; i++ )
+        {
+            auto found = shard.mMap.find( keys[ order[ i ].second ] );
+            if( found == shard.mMap.end() )
+            {
+                results[ order[ i ].second ] = ecKeyNotFound;
+                continue;
+            }
+            if( IsExpired( found->second->GetExpiry() ) )
+                results[ order[ i ].second ] = ecKeyNotFound;
+            Account( shard, keys[ order[ i ].second ], found->second.get(), nullptr );
+            removed.push_back( std::move( found->second ) );
+            shard.mMap.erase( found );
+            if( mLog )
+                logged = mLog->AppendDelete( keys[ order[ i ].second ] );
+        }
+        shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+    }
+    if( !WaitLogged( logged ) )
+        std::replace( results.begin(), results.end(), ecSuccess, ecLogFailed );
+    return results;
+}
+
+template< typename Map >
+bool MemoryStorage< Map >::Scan( ScanRange const& range, size_t limit, std::vector< ScanItem >& items )
+{
+    items.clear();
+    if constexpr( std::is_same< MemoryStorage< Map >, HashStorage >::value )
+    {
+        return false;
+    }
+    else
+    {
+        // Shards split keys by hash, so every shard holds a part of the range and the chunk is merged from all of them
+        std::vector< ScanItem > shard_items;
+        for( size_t i = 0; i < mShardCount; i++ )
+        {
+            {
+                std::shared_lock< std::shared_mutex > lock( mShards[ i ].mMutex );
+                Map const& map = mShards[ i ].mMap;
+                auto it = range.mAfterStart ? map.upper_bound( range.mStart ) : map.lower_bound( range.mStart );
+                for( ; it != map.end() && shard_items.size() < limit; ++it )
+                {
+                    std::string_view key( it->first );
+                    // Keys after the last one of a full chunk would not survive the merge
+                    if( !range.Includes( key ) || ( items.size() == limit && key > items.back().first ) )
+                        break;
+                    if( !IsExpired( it->second->GetExpiry() ) )
+                        shard_items.emplace_back( key, it->second );
+                }
+            }
+            MergeScanItems( items, shard_items, limit );
+        }
+        // Unpacked after the locks, an item with a damaged value keeps its place with an empty reference
+        for( ScanItem& item : items )
+        {
+            if( item.second->IsCompressed() )
+                item.second = item.second->Unpacked();
+        }
+        return true;
+    }
+}
+
+template< typename Map >
+size_t MemoryStorage< Map >::GetItemCount()
+{
+    size_t count = 0;
+    for( size_t i = 0; i < mShardCount; i++ )
+        count += mShards[ i ].mCount.load( std::memory_order_relaxed );
+    return count;
+}
+
+template< typename Map >
+size_t MemoryStorage< Map >::ReapExpired( Expiry now, size_t limit )
+{
+    std::vector< ExpiryWheel::Entry > due;
+    mExpiry.TakeDue( now, limit, due );
+    for( auto const& entry : due )
+    {
+        ValueRef old;
+        std::string_view key( entry.mKey );
+        Shard& shard = mShards[ ShardIndex( key ) ];
+        std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+        auto found = shard.mMap.find( key );
+        // Written again or deleted since it was scheduled
+        if( found == shard.mMap.end() || found->second->GetExpiry() != entry.mExpiry )
+            continue;
+        Account( shard, key, found->second.get(), nullptr );
+        old.swap( found->second );
+        shard.mMap.erase( found );
+        shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+        if( mLog )
+            mLog->AppendDelete( key ); // not waited for, an expired item is dropped by the replay anyway
+    }
+    return due.size();
+}
+
+template< typename Map >
+size_t MemoryStorage< Map >::GetEvictedCount()
+{
+    return mEvicted.load( std::memory_order_relaxed );
+}
+
+template< typename Map >
+Compression::Info MemoryStorage< Map >::GetCompression()
+{
+    return mCompression.GetInfo();
+}
+
+template< typename Map >
+void MemoryStorage< Map >::ReplaySet( std::string_view key, std::string_view value, Expiry expiry )
+{
+    if( IsExpired( expiry ) )
+    {
+        ReplayDelete( key );
+        return;
+    }
+    ScheduleExpiry( key, expiry );
+    ValueRef v = Value::Create( value, expiry, mCompression );
+    std::vector< ValueRef > evicted;
+    Shard& shard = mShards[ ShardIndex( key ) ];
+    std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+    auto found = shard.mMap.find( key );
+    if( found == shard.mMap.end() )
+    {
+        Account( shard, key, nullptr, v.get() );
+        shard.mMap.emplace( key, std::move( v ) );
+    }
+    else
+    {
+        Account( shard, key, found->second.get(), v.get() );
+        found->second.swap( v );
+    }
+    shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+    Evict( shard, evicted, false ); // not logged while the log is read, a later replay evicts the same way
+}
+
+template< typename Map >
+void MemoryStorage< Map >::ReplayDelete( std::string_view key )
+{
+    Shard& shard = mShards[ ShardIndex( key ) ];
+    std::lock_guard< std::shared_mutex > lock( shard.mMutex );
+    auto found = shard.mMap.find( key );
+    if( found == shard.mMap.end() )
+        return;
+    Account( shard, key, found->second.get(), nullptr );
+    shard.mMap.erase( found );
+    shard.mCount.store( shard.mMap.size(), std::memory_order_relaxed );
+}
+
+template< typename Map >
+void MemoryStorage< Map >::Dump( std::function< void( std::string_view, std::string_view, Expiry ) > const& write )
+{
+    // Items of a shard are copied out under the read lock and written without it, so writers wait only for the copy
+    std::vector< std::pair< std::string, ValueRef > > items;
+    for( size_t i = 0; i < mShardCount; i++ )
+    {
+        {
+            std::shared_lock< std::shared_mutex > lock( mShards[ i ].mMutex );
+            items.reserve( mShards[ i ].mMap.size() );
+            for( auto const& item : mShards[ i ].mMap )
+                items.emplace_back( std::string_view( item.first ), item.second );
+        }
+        for( auto const& item : items )
+        {
+            if( IsExpired( item.second->GetExpiry() ) )
+                continue;
+            ValueRef raw = item.second->Unpacked();
+            if( raw )
+                write( item.first, raw->View(), raw->GetExpiry() );
+        }
+        items.clear();
+    }
+}
+
+template class MemoryStorage< TempMap >; // TempStorage
+template class MemoryStorage< FlatHashMap< ValueRef > >; // HashStorage
+
 } // namespace storage
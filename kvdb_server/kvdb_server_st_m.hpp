@@ -8,23 +8,81 @@
 #include <map>
 #include <shared_mutex>
 #include <optional>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "kvdb_server_flat_map.hpp"
+#include "kvdb_server_slab.hpp"
+#include "kvdb_server_wal.hpp"
+#include "kvdb_server_expiry.hpp"
+#include "kvdb_server_cache.hpp"
 
 namespace storage
 {
 
-class TempStorage : public IStorage
+// In-memory storage over any map with std::map-like find/emplace/erase, split into independently locked shards.
+// With a write-ahead log, changes are appended to it under the shard lock and the log is replayed on construction.
+// Values carry their expiry; expired values are skipped by lookups until the expiry wheel has them removed.
+// With a cache size, every shard keeps to its part of it and evicts items by S3Fifo after the writes that exceed it.
+// With compression, long values are packed before the shard lock is taken and unpacked by reads after it is released;
+// the cache counts packed sizes, and the log and snapshots keep raw values.
+template< typename Map >
+class MemoryStorage : public IStorage, public ILogTarget
 {
 public:
-    TempStorage();
-    IStorage::ErrorCode Insert( std::string_view key, std::string_view value ) override;
-    IStorage::ErrorCode Update( std::string_view key, std::string_view value ) override;
+    MemoryStorage( size_t shards = 1, size_t cache_size = 0, std::unique_ptr< WriteAheadLog > log = nullptr, size_t compress_above = 0 );
+    ~MemoryStorage();
+    IStorage::ErrorCode Insert( std::string_view key, std::string_view value, Expiry expiry ) override;
+    IStorage::ErrorCode Update( std::string_view key, std::string_view value, Expiry expiry ) override;
     IStorage::ErrorCode Delete( std::string_view key ) override;
-    std::optional< std::string > Get( std::string_view key ) override;
+    ValueRef Get( std::string_view key ) override;
+    std::vector< ValueRef > MultiGet( std::vector< std::string_view > const& keys ) override;
+    std::vector< IStorage::ErrorCode > MultiSet( std::vector< KeyValue > const& items, Expiry expiry ) override;
+    std::vector< IStorage::ErrorCode > MultiDelete( std::vector< std::string_view > const& keys ) override;
+    bool Scan( ScanRange const& range, size_t limit, std::vector< ScanItem >& items ) override;
     size_t GetItemCount() override;
+    size_t ReapExpired( Expiry now, size_t limit ) override;
+    size_t GetEvictedCount() override;
+    Compression::Info GetCompression() override;
+
+    void ReplaySet( std::string_view key, std::string_view value, Expiry expiry ) override;
+    void ReplayDelete( std::string_view key ) override;
+    void Dump( std::function< void( std::string_view, std::string_view, Expiry ) > const& write ) override;
 
 private:
-    std::map< std::string, std::string, std::less<> > mMap;
-    mutable std::shared_mutex mMutex;
+    // Every shard sits in its own cache lines, so threads working on different shards do not share lock state
+    struct alignas( 64 ) Shard
+    {
+        mutable std::shared_mutex mMutex;
+        std::atomic< size_t > mCount{ 0 }; // mirrors mMap.size() for lock-free GetItemCount
+        Map mMap;
+        std::unique_ptr< S3Fifo > mCache; // none without a cache size
+    };
+
+    size_t ShardIndex( std::string_view key ) const;
+    // Pairs of ( shard index, key index ) ordered by shard, so a batch locks every shard once
+    std::vector< std::pair< size_t, size_t > > GroupByShard( std::vector< std::string_view > const& keys ) const;
+    // False if the log has failed, so the change is not durable
+    bool WaitLogged( std::uint64_t position );
+    void ScheduleExpiry( std::string_view key, Expiry expiry );
+    // Cache bookkeeping of a change under the exclusive shard lock, old or v is nullptr for an added or a removed item
+    void Account( Shard& shard, std::string_view key, Value const* old, Value const* v );
+    // Evicts items while the shard is over its budget, their values go to released to be freed outside of the lock
+    void Evict( Shard& shard, std::vector< ValueRef >& released, bool log = true );
+
+    size_t mShardCount;
+    std::unique_ptr< Shard[] > mShards;
+    ExpiryWheel mExpiry;
+    std::atomic< size_t > mEvicted{ 0 };
+    Compression mCompression;
+    std::unique_ptr< WriteAheadLog > mLog;
 };
 
+// Tree nodes, long keys and values of the in-memory storages come from SlabAllocator
+typedef std::map< SlabString, ValueRef, std::less<>, SlabStdAllocator< std::pair< SlabString const, ValueRef > > > TempMap;
+
+typedef MemoryStorage< TempMap > TempStorage; // ordered red-black tree
+typedef MemoryStorage< FlatHashMap< ValueRef > > HashStorage; // unordered, cache friendly point lookups
+
 } // namespace storage
@@ -2,78 +2,681 @@
 
 #include <iostream>
 #include <cinttypes>
-#include <boost/interprocess/sync/sharable_lock.hpp>
+#include <algorithm>
+#include <fstream>
+#include <chrono>
+#include <cstdlib> // abort
+#include <stdexcept>
+#include <boost/interprocess/exceptions.hpp>
+
+#include "../kvdb_data_models/kvdb_data_models.hpp"
 
 namespace storage
 {
 
-struct ChangeValue
+namespace
+{
+
+boost::interprocess::file_lock LockFile( std::string const& path )
+{
+    std::ofstream( path, std::ios::app ); // file_lock needs an existing file
+    boost::interprocess::file_lock lock( path.c_str() );
+    if( !lock.try_lock() )
+        throw boost::interprocess::interprocess_exception( "storage file is used by another process" );
+    return lock;
+}
+
+std::string StripeName( size_t index )
 {
-    ChangeValue( std::string_view value )
-        : mValue( value )
+    return index == 0 ? "Map" : "Map." + std::to_string( index );
+}
+
+std::string ExpirationsName( size_t index )
+{
+    return "Expiry." + std::to_string( index );
+}
+
+std::string PackedName( size_t index )
+{
+    return "Packed." + std::to_string( index );
+}
+
+// Version of the objects in the segment, files without it keep key and value bytes in the heap of the process that wrote them.
+// Format 2 adds the packed key maps; a file of format 1 gets empty ones and the new number, so older builds do not misread it.
+constexpr std::uint32_t FILE_FORMAT = 2;
+constexpr std::chrono::seconds COMPACTION_CHECK_INTERVAL{ 60 };
+
+// Checks the format of the segment, creates the objects of a new one and returns the number of stripes
+size_t PrepareSegment( MemoryType& segment, size_t stripes )
+{
+    if( segment.find< std::uint32_t >( "Format" ).first == nullptr && segment.find< ItemMap >( "Map" ).first != nullptr )
+        throw boost::interprocess::interprocess_exception( "storage file was written by an older version and can not be read, remove it" );
+    std::uint32_t& format = *segment.find_or_construct< std::uint32_t >( "Format" )( FILE_FORMAT );
+    if( format != FILE_FORMAT && format != 1 )
+        throw boost::interprocess::interprocess_exception( "storage file has an unknown format" );
+    size_t count = *segment.find_or_construct< std::uint32_t >( "Stripes" )( static_cast< std::uint32_t >( std::max< size_t >( stripes, 1 ) ) );
+    for( size_t i = 0; i < count; i++ )
     {
+        segment.find_or_construct< ItemMap >( StripeName( i ).c_str() )( ItemMap::ctor_args_list(), segment.get_segment_manager() );
+        segment.find_or_construct< ExpirationMap >( ExpirationsName( i ).c_str() )( ExpirationMap::ctor_args_list(), segment.get_segment_manager() );
+        segment.find_or_construct< PackedKeyMap >( PackedName( i ).c_str() )( PackedKeyMap::ctor_args_list(), segment.get_segment_manager() );
     }
-    void operator()( Item& item )
+    format = FILE_FORMAT;
+    return count;
+}
+
+// Items come in key order, so every one is linked at the end without a search
+void CopyItems( ItemMap const& source, ItemMap& target, MemoryType& segment )
+{
+    for( Item const& item : source )
     {
-        item.value.assign( mValue.begin(), mValue.end() );
+        target.emplace_hint( target.end(), std::string_view( item.key.data(), item.key.size() ),
+                             std::string_view( item.value.data(), item.value.size() ), segment.get_segment_manager() );
     }
+}
 
-private:
-    std::string mValue;
-};
+void CopyExpirations( ExpirationMap const& source, ExpirationMap& target, MemoryType& segment )
+{
+    for( Expiration const& e : source )
+        target.emplace_hint( target.end(), std::string_view( e.key.data(), e.key.size() ), e.expiry, segment.get_segment_manager() );
+}
+
+void CopyPackedKeys( PackedKeyMap const& source, PackedKeyMap& target, MemoryType& segment )
+{
+    for( PackedKey const& p : source )
+        target.emplace_hint( target.end(), std::string_view( p.key.data(), p.key.size() ), segment.get_segment_manager() );
+}
+
+} // namespace
 
-PersistentStorage::PersistentStorage( size_t size )
+PersistentStorage::PersistentStorage( size_t size, size_t stripes, size_t grow_step, size_t compact_at, size_t compress_above )
     : mPath{ ( boost::filesystem::current_path() / "storage.bin" ).string() }
-    , mBuffer{ boost::interprocess::open_or_create, "storage.bin", size }
-    , mMap{ *mBuffer.find_or_construct< ItemMap >( "Map" )( ItemMap::ctor_args_list(), mBuffer.get_segment_manager() ) }
-    , mMutex{ boost::interprocess::open_or_create, "storage.bin.mutex" }
+    , mFileLock{ LockFile( mPath + ".lock" ) }
+    , mBuffer{ boost::interprocess::open_or_create, mPath.c_str(), size }
+    , mMinSize( size )
+    , mGrowStep( grow_step )
+    , mSize( mBuffer.get_size() )
+    , mCompression( compress_above )
+    , mCompactAt( compact_at )
 {
-    std::cout << "Persistent storage of size " << size << " bytes created..." << std::endl;
+    boost::filesystem::remove( mPath + ".compact" ); // left by a compaction that did not finish
+    mStripeCount = PrepareSegment( mBuffer, stripes );
+    mStripes.reset( new Stripe[ mStripeCount ] );
+    Attach();
+    if( mSize < size )
+        Grow( mSize, size - mSize ); // an existing file is opened with its own size
+    for( size_t i = 0; i < mStripeCount; i++ )
+    {
+        for( Expiration const& e : *mStripes[ i ].mExpirations )
+            mExpiry.Schedule( std::string_view( e.key.data(), e.key.size() ), e.expiry );
+    }
+    if( mCompactAt > 0 )
+        mCompactor = std::thread( [ this ](){ Compactor(); } );
+    std::cout << "Persistent storage of size " << mSize << " bytes with " << mStripeCount << " stripes";
+    if( compress_above != 0 )
+        std::cout << ", compressing values over " << compress_above << " bytes,";
+    std::cout << " created..." << std::endl;
 }
 
-IStorage::ErrorCode PersistentStorage::Insert( std::string_view key, std::string_view value )
+PersistentStorage::~PersistentStorage()
 {
-    boost::interprocess::scoped_lock< boost::interprocess::named_sharable_mutex > lock( mMutex );
-    auto found = mMap.find( key );
-    if( found != mMap.end() )
-        return ecKeyAlreadyExists;
-    mMap.emplace( key, value );
-    return ecSuccess;
+    {
+        std::lock_guard< std::mutex > lock( mCompactorMutex );
+        mStopping = true;
+    }
+    mCompactorStop.notify_all();
+    if( mCompactor.joinable() )
+        mCompactor.join();
 }
 
-IStorage::ErrorCode PersistentStorage::Update( std::string_view key, std::string_view value )
+void PersistentStorage::Remap()
 {
-    boost::interprocess::scoped_lock< boost::interprocess::named_sharable_mutex > lock( mMutex );
-    auto found = mMap.find( key );
-    if( found == mMap.end() )
-        return ecKeyNotFound;
-    if( std::string_view( found->value.begin(), found->value.size() ) == value )
-        return ecValueNotChanged;
-    mMap.modify( found, ChangeValue( value ) );
-    return ecSuccess;
+    try
+    {
+        MemoryType( boost::interprocess::open_only, mPath.c_str() ).swap( mBuffer );
+    }
+    catch( boost::interprocess::interprocess_exception const& ex )
+    {
+        // Every stripe points into the mapping, there is nothing left to serve from
+        std::cerr << "Error: persistent storage " << mPath << " cannot be mapped again: " << ex.what() << std::endl;
+        std::abort();
+    }
+    Attach();
+    mSize.store( mBuffer.get_size() );
+}
+
+void PersistentStorage::Attach()
+{
+    for( size_t i = 0; i < mStripeCount; i++ )
+    {
+        mStripes[ i ].mMap = mBuffer.find< ItemMap >( StripeName( i ).c_str() ).first;
+        mStripes[ i ].mExpirations = mBuffer.find< ExpirationMap >( ExpirationsName( i ).c_str() ).first;
+        mStripes[ i ].mPacked = mBuffer.find< PackedKeyMap >( PackedName( i ).c_str() ).first;
+    }
+}
+
+template< typename F >
+auto PersistentStorage::Growing( F const& change ) -> decltype( change() )
+{
+    for( ; ; )
+    {
+        size_t size = mSize.load();
+        try
+        {
+            return change();
+        }
+        catch( boost::interprocess::bad_alloc const& )
+        {
+            if( mGrowStep == 0 || !Grow( size, mGrowStep ) )
+                throw;
+        }
+        catch( std::length_error const& )
+        {
+            // A string of the segment refuses a size above the free memory of the segment before it allocates
+            if( mGrowStep == 0 || !Grow( size, mGrowStep ) )
+                throw boost::interprocess::bad_alloc();
+        }
+    }
+}
+
+bool PersistentStorage::Grow( size_t seen_size, size_t extra )
+{
+    // No stripe lock is held by the caller, and no lock of another stripe is taken under one, so the order is free
+    std::vector< std::unique_lock< std::shared_mutex > > locks;
+    locks.reserve( mStripeCount );
+    for( size_t i = 0; i < mStripeCount; i++ )
+        locks.emplace_back( mStripes[ i ].mMutex );
+    if( mSize.load() != seen_size )
+        return true; // grown by another thread meanwhile
+
+    MemoryType().swap( mBuffer ); // unmap
+    bool grown = MemoryType::grow( mPath.c_str(), extra );
+    Remap();
+    if( grown )
+        std::cout << "Persistent storage grown to " << mSize.load() << " bytes" << std::endl;
+    else
+        std::cerr << "Error: persistent storage could not grow beyond " << mSize.load() << " bytes" << std::endl;
+    return grown;
+}
+
+PersistentStorage::Stripe& PersistentStorage::GetStripe( std::string_view key ) const
+{
+    // The stripe of a key is part of the file format, so the hash must not depend on the standard library
+    return mStripes[ mStripeCount == 1 ? 0 : network::Crc32c( 0, key.data(), key.size() ) % mStripeCount ];
+}
+
+std::vector< std::pair< size_t, size_t > > PersistentStorage::GroupByStripe( std::vector< std::string_view > const& keys ) const
+{
+    std::vector< std::pair< size_t, size_t > > order;
+    order.reserve( keys.size() );
+    for( size_t i = 0; i < keys.size(); i++ )
+        order.emplace_back( &GetStripe( keys[ i ] ) - mStripes.get(), i );
+    if( mStripeCount > 1 )
+        std::sort( order.begin(), order.end() );
+    return order;
+}
+
+Expiry PersistentStorage::GetExpiry( Stripe const& stripe, std::string_view key )
+{
+    if( stripe.mExpirations->empty() )
+        return NO_EXPIRY;
+    auto found = stripe.mExpirations->find( key );
+    return found == stripe.mExpirations->end() ? NO_EXPIRY : found->expiry;
+}
+
+void PersistentStorage::SetExpiry( Stripe& stripe, std::string_view key, Expiry expiry )
+{
+    if( expiry == NO_EXPIRY && stripe.mExpirations->empty() )
+        return;
+    auto found = stripe.mExpirations->find( key );
+    if( expiry == NO_EXPIRY )
+    {
+        if( found != stripe.mExpirations->end() )
+            stripe.mExpirations->erase( found );
+    }
+    else if( found != stripe.mExpirations->end() )
+        found->expiry = expiry;
+    else
+        stripe.mExpirations->emplace( key, expiry, mBuffer.get_segment_manager() );
+}
+
+bool PersistentStorage::IsPacked( Stripe const& stripe, std::string_view key )
+{
+    return !stripe.mPacked->empty() && stripe.mPacked->find( key ) != stripe.mPacked->end();
+}
+
+void PersistentStorage::SetValue( Stripe& stripe, ItemMap::iterator found, std::string_view key, std::string_view bytes, bool packed )
+{
+    // Adding a packed key allocates and removing one does not: a key is added before the bytes and taken back
+    // if they do not fit, and removed after them, so a change that runs out of memory leaves the item as it was
+    bool was_packed = IsPacked( stripe, key );
+    if( packed && !was_packed )
+        stripe.mPacked->emplace( key, mBuffer.get_segment_manager() );
+    try
+    {
+        if( found == stripe.mMap->end() )
+            stripe.mMap->emplace( key, bytes, mBuffer.get_segment_manager() );
+        else
+            found->value.assign( bytes.begin(), bytes.end() ); // keeps the old bytes if it throws
+    }
+    catch( ... )
+    {
+        if( packed && !was_packed )
+            ClearPacked( stripe, key );
+        throw;
+    }
+    if( !packed && was_packed )
+        ClearPacked( stripe, key );
+}
+
+void PersistentStorage::ClearPacked( Stripe& stripe, std::string_view key )
+{
+    if( stripe.mPacked->empty() )
+        return;
+    auto found = stripe.mPacked->find( key );
+    if( found != stripe.mPacked->end() )
+        stripe.mPacked->erase( found );
+}
+
+void PersistentStorage::SetItem( Stripe& stripe, ItemMap::iterator found, std::string_view key, std::string_view bytes, bool packed, Expiry expiry )
+{
+    // Removing an expiry does not allocate, so it goes after the value; a new one goes first and is taken back
+    // if the value does not fit, which does not allocate either, as the expiration of the key is there by then
+    if( expiry == NO_EXPIRY )
+    {
+        SetValue( stripe, found, key, bytes, packed );
+        SetExpiry( stripe, key, NO_EXPIRY );
+        return;
+    }
+    Expiry old = GetExpiry( stripe, key );
+    SetExpiry( stripe, key, expiry );
+    try
+    {
+        SetValue( stripe, found, key, bytes, packed );
+    }
+    catch( ... )
+    {
+        SetExpiry( stripe, key, old );
+        throw;
+    }
+}
+
+ValueRef PersistentStorage::Load( Stripe const& stripe, Item const& item )
+{
+    std::string_view bytes( item.value.data(), item.value.size() );
+    if( IsPacked( stripe, std::string_view( item.key.data(), item.key.size() ) ) )
+        return Value::Unpack( bytes, NO_EXPIRY );
+    return Value::Create( bytes );
+}
+
+IStorage::ErrorCode PersistentStorage::Insert( std::string_view key, std::string_view value, Expiry expiry )
+{
+    std::string packed;
+    bool is_packed = mCompression.Pack( value, packed ); // outside of the lock
+    std::string_view bytes = is_packed ? std::string_view( packed ) : value;
+    ErrorCode result = ecNoSpace;
+    try
+    {
+        result = Growing( [ & ]()
+        {
+            Stripe& stripe = GetStripe( key );
+            std::lock_guard< std::shared_mutex > lock( stripe.mMutex );
+            auto found = stripe.mMap->find( key );
+            if( found != stripe.mMap->end() && !IsExpired( GetExpiry( stripe, key ) ) )
+                return ecKeyAlreadyExists;
+            // An item that runs out of memory is left as it was, so the retry finds the key still missing or expired
+            std::lock_guard< std::mutex > allocation( mAllocation );
+            SetItem( stripe, found, key, bytes, is_packed, expiry ); // an expired item is replaced as if it was gone
+            stripe.mChanges++;
+            return ecSuccess;
+        } );
+    }
+    catch( boost::interprocess::bad_alloc const& )
+    {
+    }
+    if( result == ecSuccess && expiry != NO_EXPIRY )
+        mExpiry.Schedule( key, expiry );
+    return result;
+}
+
+IStorage::ErrorCode PersistentStorage::Update( std::string_view key, std::string_view value, Expiry expiry )
+{
+    std::string packed;
+    bool is_packed = mCompression.Pack( value, packed );
+    std::string_view bytes = is_packed ? std::string_view( packed ) : value;
+    ErrorCode result = ecNoSpace;
+    try
+    {
+        result = Growing( [ & ]()
+        {
+            Stripe& stripe = GetStripe( key );
+            std::lock_guard< std::shared_mutex > lock( stripe.mMutex );
+            auto found = stripe.mMap->find( key );
+            if( found == stripe.mMap->end() )
+                return ecKeyNotFound;
+            Expiry current = GetExpiry( stripe, key );
+            if( IsExpired( current ) )
+                return ecKeyNotFound;
+            // Packing is deterministic, so equal packed bytes are equal values
+            if( std::string_view( found->value.data(), found->value.size() ) == bytes && IsPacked( stripe, key ) == is_packed && current == expiry )
+                return ecValueNotChanged;
+            std::lock_guard< std::mutex > allocation( mAllocation );
+            SetItem( stripe, found, key, bytes, is_packed, expiry );
+            stripe.mChanges++;
+            return ecSuccess;
+        } );
+    }
+    catch( boost::interprocess::bad_alloc const& )
+    {
+    }
+    if( result == ecSuccess && expiry != NO_EXPIRY )
+        mExpiry.Schedule( key, expiry );
+    return result;
 }
 
 IStorage::ErrorCode PersistentStorage::Delete( std::string_view key )
 {
-    boost::interprocess::scoped_lock< boost::interprocess::named_sharable_mutex > lock( mMutex );
-    if( mMap.erase( boost::interprocess::string( key.begin(), key.end() ) ) == 0 )
+    Stripe& stripe = GetStripe( key );
+    std::lock_guard< std::shared_mutex > lock( stripe.mMutex );
+    auto found = stripe.mMap->find( key );
+    if( found == stripe.mMap->end() )
         return ecKeyNotFound;
-    return ecSuccess;
+    bool expired = IsExpired( GetExpiry( stripe, key ) );
+    std::lock_guard< std::mutex > allocation( mAllocation );
+    SetExpiry( stripe, key, NO_EXPIRY );
+    ClearPacked( stripe, key );
+    stripe.mMap->erase( found );
+    stripe.mChanges++;
+    return expired ? ecKeyNotFound : ecSuccess;
 }
 
-std::optional< std::string > PersistentStorage::Get( std::string_view key )
+ValueRef PersistentStorage::Get( std::string_view key )
 {
-    boost::interprocess::sharable_lock< boost::interprocess::named_sharable_mutex > lock( mMutex );
-    auto found = mMap.find( key );
-    if( found == mMap.end() )
+    // Mapped memory can not be pinned past the lock, so the value is copied (or unpacked) once into a shared buffer
+    Stripe& stripe = GetStripe( key );
+    std::shared_lock< std::shared_mutex > lock( stripe.mMutex );
+    auto found = stripe.mMap->find( key );
+    if( found == stripe.mMap->end() || IsExpired( GetExpiry( stripe, key ) ) )
         return {};
-    return std::string( found->value.begin(), found->value.end() );
+    return Load( stripe, *found );
+}
+
+std::vector< ValueRef > PersistentStorage::MultiGet( std::vector< std::string_view > const& keys )
+{
+    std::vector< ValueRef > values( keys.size() );
+    auto order = GroupByStripe( keys );
+    for( size_t i = 0; i < order.size(); )
+    {
+        Stripe& stripe = mStripes[ order[ i ].first ];
+        std::shared_lock< std::shared_mutex > lock( stripe.mMutex );
+        for( size_t s = order[ i ].first; i < order.size() && order[ i ].first == s; i++ )
+        {
+            auto found = stripe.mMap->find( keys[ order[ i ].second ] );
+            if( found != stripe.mMap->end() && !IsExpired( GetExpiry( stripe, keys[ order[ i ].second ] ) ) )
+                values[ order[ i ].second ] = Load( stripe, *found );
+        }
+    }
+    return values;
+}
+
+std::vector< IStorage::ErrorCode > PersistentStorage::MultiSet( std::vector< KeyValue > const& items, Expiry expiry )
+{
+    std::vector< std::string_view > keys;
+    keys.reserve( items.size() );
+    for( auto const& item : items )
+        keys.push_back( item.first );
+
+    std::vector< std::string > packed( items.size() );
+    std::vector< bool > is_packed( items.size() );
+    for( size_t i = 0; i < items.size(); i++ )
+        is_packed[ i ] = mCompression.Pack( items[ i ].second, packed[ i ] );
+
+    std::vector< ErrorCode > results( items.size(), ecSuccess );
+    auto order = GroupByStripe( keys );
+    for( size_t i = 0; i < order.size(); )
+    {
+        // After the file grows, the stripe is locked again and continues from the item that failed;
+        // an item that does not fit even so is skipped, as the next ones may be smaller
+        try
+        {
+            Growing( [ & ]()
+            {
+                Stripe& stripe = mStripes[ order[ i ].first ];
+                std::lock_guard< std::shared_mutex > lock( stripe.mMutex );
+                for( size_t s = order[ i ].first; i < order.size() && order[ i ].first == s; i++ )
+                {
+                    size_t k = order[ i ].second;
+                    std::string_view key = items[ k ].first;
+                    std::string_view bytes = is_packed[ k ] ? std::string_view( packed[ k ] ) : items[ k ].second;
+                    auto found = stripe.mMap->find( key );
+                    if( found != stripe.mMap->end() && std::string_view( found->value.data(), found->value.size() ) == bytes
+                            && IsPacked( stripe, key ) == is_packed[ k ] && GetExpiry( stripe, key ) == expiry )
+                    {
+                        results[ k ] = ecValueNotChanged;
+                        continue;
+                    }
+                    std::lock_guard< std::mutex > allocation( mAllocation );
+                    SetItem( stripe, found, key, bytes, is_packed[ k ], expiry );
+                    stripe.mChanges++;
+                }
+            } );
+        }
+        catch( boost::interprocess::bad_alloc const& )
+        {
+            results[ order[ i++ ].second ] = ecNoSpace;
+        }
+    }
+    if( expiry != NO_EXPIRY )
+    {
+        for( size_t i = 0; i < items.size(); i++ )
+            if( results[ i ] == ecSuccess )
+                mExpiry.Schedule( keys[ i ], expiry );
+    }
+    return results;
+}
+
+std::vector< IStorage::ErrorCode > PersistentStorage::MultiDelete( std::vector< std::string_view > const& keys )
+{
+    std::vector< ErrorCode > results( keys.size(), ecSuccess );
+    auto order = GroupByStripe( keys );
+    for( size_t i = 0; i < order.size(); )
+    {
+        Stripe& stripe = mStripes[ order[ i ].first ];
+        std::lock_guard< std::shared_mutex > lock( stripe.mMutex );
+        for( size_t s = order[ i ].first; i < order.size() && order[ i ].first == s; i++ )
+        {
+            auto found = stripe.mMap->find( keys[ order[ i ].second ] );
+            if( found == stripe.mMap->end() )
+            {
+                results[ order[ i ].second ] = ecKeyNotFound;
+                continue;
+            }
+            if( IsExpired( GetExpiry( stripe, keys[ order[ i ].second ] ) ) )
+                results[ order[ i ].second ] = ecKeyNotFound;
+            std::lock_guard< std::mutex > allocation( mAllocation );
+            SetExpiry( stripe, keys[ order[ i ].second ], NO_EXPIRY );
+            ClearPacked( stripe, keys[ order[ i ].second ] );
+            stripe.mMap->erase( found );
+            stripe.mChanges++;
+        }
+    }
+    return results;
+}
+
+bool PersistentStorage::Scan( ScanRange const& range, size_t limit, std::vector< ScanItem >& items )
+{
+    // Stripes split keys by hash, so every stripe holds a part of the range and the chunk is merged from all of them
+    items.clear();
+    std::vector< ScanItem > stripe_items;
+    for( size_t i = 0; i < mStripeCount; i++ )
+    {
+        {
+            Stripe& stripe = mStripes[ i ];
+            std::shared_lock< std::shared_mutex > lock( stripe.mMutex );
+            auto it = range.mAfterStart ? stripe.mMap->upper_bound( range.mStart ) : stripe.mMap->lower_bound( range.mStart );
+            for( ; it != stripe.mMap->end() && stripe_items.size() < limit; ++it )
+            {
+                std::string_view key( it->key.data(), it->key.size() );
+                // Keys after the last one of a full chunk would not survive the merge, so their values are not copied
+                if( !range.Includes( key ) || ( items.size() == limit && key > items.back().first ) )
+                    break;
+                if( !IsExpired( GetExpiry( stripe, key ) ) )
+                    stripe_items.emplace_back( key, Load( stripe, *it ) );
+            }
+        }
+        MergeScanItems( items, stripe_items, limit );
+    }
+    return true;
 }
 
 size_t PersistentStorage::GetItemCount()
 {
-    boost::interprocess::sharable_lock< boost::interprocess::named_sharable_mutex > lock( mMutex );
-    return mMap.size();
+    size_t count = 0;
+    for( size_t i = 0; i < mStripeCount; i++ )
+    {
+        std::shared_lock< std::shared_mutex > lock( mStripes[ i ].mMutex );
+        count += mStripes[ i ].mMap->size();
+    }
+    return count;
+}
+
+IStorage::SpaceInfo PersistentStorage::GetSpace()
+{
+    // A stripe lock keeps the file from being remapped, the allocation lock keeps the free space still
+    std::shared_lock< std::shared_mutex > lock( mStripes[ 0 ].mMutex );
+    std::lock_guard< std::mutex > allocation( mAllocation );
+    SpaceInfo space;
+    space.mSize = mBuffer.get_size();
+    space.mFree = mBuffer.get_free_memory();
+    // Asked for everything with a limit of one byte, the allocator hands out its largest free block
+    auto* segment = mBuffer.get_segment_manager();
+    MemoryType::size_type size = segment->get_size();
+    char* reuse = nullptr;
+    char* block = segment->allocation_command< char >( boost::interprocess::allocate_new | boost::interprocess::nothrow_allocation, 1, size, reuse );
+    if( block != nullptr )
+    {
+        space.mLargestFree = size;
+        segment->deallocate( block );
+    }
+    return space;
+}
+
+size_t PersistentStorage::ReapExpired( Expiry now, size_t limit )
+{
+    std::vector< ExpiryWheel::Entry > due;
+    mExpiry.TakeDue( now, limit, due );
+    for( auto const& entry : due )
+    {
+        Stripe& stripe = GetStripe( entry.mKey );
+        std::lock_guard< std::shared_mutex > lock( stripe.mMutex );
+        auto expiration = stripe.mExpirations->find( entry.mKey );
+        // Written again or deleted since it was scheduled
+        if( expiration == stripe.mExpirations->end() || expiration->expiry != entry.mExpiry )
+            continue;
+        std::lock_guard< std::mutex > allocation( mAllocation );
+        stripe.mExpirations->erase( expiration );
+        ClearPacked( stripe, entry.mKey );
+        auto found = stripe.mMap->find( entry.mKey );
+        if( found != stripe.mMap->end() )
+            stripe.mMap->erase( found );
+        stripe.mChanges++;
+    }
+    return due.size();
+}
+
+Compression::Info PersistentStorage::GetCompression()
+{
+    return mCompression.GetInfo();
+}
+
+bool PersistentStorage::Compact()
+{
+    std::lock_guard< std::mutex > compaction( mCompaction );
+    size_t used;
+    {
+        std::shared_lock< std::shared_mutex > lock( mStripes[ 0 ].mMutex );
+        std::lock_guard< std::mutex > allocation( mAllocation );
+        used = mBuffer.get_size() - mBuffer.get_free_memory();
+    }
+    std::string path = mPath + ".compact";
+    std::vector< std::unique_lock< std::shared_mutex > > locks;
+    try
+    {
+        // Live items take at most what is used now, the rest is room to grow
+        MemoryType fresh( boost::interprocess::create_only, path.c_str(), std::max( used + used / 4, mMinSize ) );
+        PrepareSegment( fresh, mStripeCount );
+        std::vector< std::uint64_t > copied( mStripeCount );
+        for( size_t i = 0; i < mStripeCount; i++ )
+        {
+            std::shared_lock< std::shared_mutex > lock( mStripes[ i ].mMutex );
+            copied[ i ] = mStripes[ i ].mChanges;
+            CopyItems( *mStripes[ i ].mMap, *fresh.find< ItemMap >( StripeName( i ).c_str() ).first, fresh );
+            CopyExpirations( *mStripes[ i ].mExpirations, *fresh.find< ExpirationMap >( ExpirationsName( i ).c_str() ).first, fresh );
+            CopyPackedKeys( *mStripes[ i ].mPacked, *fresh.find< PackedKeyMap >( PackedName( i ).c_str() ).first, fresh );
+        }
+
+        // The pause: writers wait while the changed stripes are copied again and the files are swapped
+        locks.reserve( mStripeCount );
+        for( size_t i = 0; i < mStripeCount; i++ )
+            locks.emplace_back( mStripes[ i ].mMutex );
+        for( size_t i = 0; i < mStripeCount; i++ )
+        {
+            if( mStripes[ i ].mChanges == copied[ i ] )
+                continue;
+            ItemMap& map = *fresh.find< ItemMap >( StripeName( i ).c_str() ).first;
+            map.clear();
+            CopyItems( *mStripes[ i ].mMap, map, fresh );
+            ExpirationMap& expirations = *fresh.find< ExpirationMap >( ExpirationsName( i ).c_str() ).first;
+            expirations.clear();
+            CopyExpirations( *mStripes[ i ].mExpirations, expirations, fresh );
+            PackedKeyMap& packed = *fresh.find< PackedKeyMap >( PackedName( i ).c_str() ).first;
+            packed.clear();
+            CopyPackedKeys( *mStripes[ i ].mPacked, packed, fresh );
+        }
+        fresh.flush();
+    }
+    catch( std::exception const& ex )
+    {
+        locks.clear();
+        boost::system::error_code ignored;
+        boost::filesystem::remove( path, ignored );
+        std::cerr << "Error: compaction of persistent storage failed: " << ex.what() << std::endl;
+        return false;
+    }
+
+    // If the fresh file cannot replace the old one, the storage goes on with the old file
+    size_t old_size = mBuffer.get_size();
+    MemoryType().swap( mBuffer ); // unmap
+    boost::system::error_code ec;
+    boost::filesystem::rename( path, mPath, ec );
+    if( ec )
+    {
+        boost::system::error_code ignored;
+        boost::filesystem::remove( path, ignored );
+    }
+    else
+        SyncDirectory( boost::filesystem::path( mPath ).parent_path().string() );
+    Remap();
+    if( ec )
+    {
+        std::cerr << "Error: compaction of persistent storage failed: " << ec.message() << std::endl;
+        return false;
+    }
+    std::cout << "Persistent storage compacted from " << old_size << " to " << mSize.load() << " bytes" << std::endl;
+    return true;
+}
+
+void PersistentStorage::Compactor()
+{
+    std::unique_lock< std::mutex > lock( mCompactorMutex );
+    while( !mCompactorStop.wait_for( lock, COMPACTION_CHECK_INTERVAL, [ this ](){ return mStopping; } ) )
+    {
+        lock.unlock();
+        SpaceInfo space = GetSpace();
+        if( space.mFree > 0 && 100 - space.mLargestFree * 100 / space.mFree >= mCompactAt )
+            Compact();
+        lock.lock();
+    }
 }
 
 } // namespace storage
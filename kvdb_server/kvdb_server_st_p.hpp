@@ -1,25 +1,17 @@
 #pragma once
 
 #include "kvdb_server_storage.hpp"
+#include "kvdb_server_expiry.hpp"
 
 #include <cinttypes> // size_t
-#include <boost/interprocess/containers/string.hpp>
 #include <string_view>
-
-namespace std
-{
-
-template<>
-struct less< boost::interprocess::string >
-{
-    template< typename S1, typename S2 >
-    constexpr auto operator()( S1 && lhs, S2 && rhs ) const
-    {
-        return string_view( lhs.begin(), lhs.size() ) < string_view( rhs.begin(), rhs.size() );
-    }
-};
-
-} // namespace std
+#include <shared_mutex>
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
 
 #include <boost/filesystem.hpp>
 #define USE_MMF
@@ -34,8 +26,9 @@ struct less< boost::interprocess::string >
 #include <boost/interprocess/sync/null_mutex.hpp>
 #include <boost/interprocess/indexes/iset_index.hpp>
 #include <boost/interprocess/allocators/allocator.hpp>
+#include <boost/interprocess/containers/string.hpp>
 #include <boost/interprocess/segment_manager.hpp>
-#include <boost/interprocess/sync/named_sharable_mutex.hpp>
+#include <boost/interprocess/sync/file_lock.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/member.hpp>
@@ -43,17 +36,6 @@ struct less< boost::interprocess::string >
 namespace storage
 {
 
-struct Item
-{
-    Item( std::string_view k, std::string_view v )
-        : key( k.begin(), k.end() )
-        , value( v.begin(), v.end() )
-    {
-    }
-    boost::interprocess::string key;
-    boost::interprocess::string value;
-};
-
 struct idx_key{};
 
 #if defined USE_MMF
@@ -76,36 +58,186 @@ typedef boost::interprocess::basic_managed_shared_memory <
 > MemoryType;
 #endif
 
+typedef boost::interprocess::allocator<
+    char,
+    MemoryType::segment_manager
+> CharAllocator;
+
+// Key and value bytes live in the segment next to the item, so they survive a restart and move with a remap
+typedef boost::interprocess::basic_string< char, std::char_traits< char >, CharAllocator > SegmentString;
+
+struct Item
+{
+    Item( std::string_view k, std::string_view v, CharAllocator const& allocator )
+        : key( k.begin(), k.end(), allocator )
+        , value( v.begin(), v.end(), allocator )
+    {
+    }
+    SegmentString key;
+    mutable SegmentString value; // not part of the index, so it is changed in place
+};
+
+struct KeyLess
+{
+    typedef void is_transparent;
+
+    template< typename S1, typename S2 >
+    bool operator()( S1 const& lhs, S2 const& rhs ) const
+    {
+        return std::string_view( lhs.data(), lhs.size() ) < std::string_view( rhs.data(), rhs.size() );
+    }
+};
+
 typedef boost::interprocess::allocator<
     Item,
     MemoryType::segment_manager
 > ItemAllocator;
 
+// Expiry of an item that has one. Kept apart from Item, so files written before expiry support open unchanged
+// and stripes without expiring items cost nothing more.
+struct Expiration
+{
+    Expiration( std::string_view k, Expiry e, CharAllocator const& allocator )
+        : key( k.begin(), k.end(), allocator )
+        , expiry( e )
+    {
+    }
+    SegmentString key;
+    mutable std::uint64_t expiry;
+};
+
+typedef boost::interprocess::allocator<
+    Expiration,
+    MemoryType::segment_manager
+> ExpirationAllocator;
+
+// Key of an item whose value bytes are packed. Kept apart from Item like Expiration, so files written before
+// compression support need no conversion and items with raw values cost nothing more.
+struct PackedKey
+{
+    PackedKey( std::string_view k, CharAllocator const& allocator )
+        : key( k.begin(), k.end(), allocator )
+    {
+    }
+    SegmentString key;
+};
+
+typedef boost::interprocess::allocator<
+    PackedKey,
+    MemoryType::segment_manager
+> PackedKeyAllocator;
+
 typedef struct boost::multi_index_container<
     Item,
     boost::multi_index::indexed_by<
         boost::multi_index::ordered_unique<
-            boost::multi_index::tag< idx_key >, BOOST_MULTI_INDEX_MEMBER( Item, boost::interprocess::string, key )
+            boost::multi_index::tag< idx_key >, BOOST_MULTI_INDEX_MEMBER( Item, SegmentString, key ), KeyLess
         >
     >,
     ItemAllocator
 > ItemMap;
 
+typedef struct boost::multi_index_container<
+    Expiration,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            boost::multi_index::tag< idx_key >, BOOST_MULTI_INDEX_MEMBER( Expiration, SegmentString, key ), KeyLess
+        >
+    >,
+    ExpirationAllocator
+> ExpirationMap;
+
+typedef struct boost::multi_index_container<
+    PackedKey,
+    boost::multi_index::indexed_by<
+        boost::multi_index::ordered_unique<
+            boost::multi_index::tag< idx_key >, BOOST_MULTI_INDEX_MEMBER( PackedKey, SegmentString, key ), KeyLess
+        >
+    >,
+    PackedKeyAllocator
+> PackedKeyMap;
+
+// Items are split into stripes, each an ItemMap of its own in the segment with an in-process read/write lock.
+// The number of stripes is fixed when the file is created.
+// The segment allocator has no lock of its own, so changes that allocate or free take mAllocation as well.
+// When the segment is full, the file grows by grow_step bytes: every stripe is locked while the file is remapped,
+// then the change is retried. A change that still does not fit fails with ecNoSpace and leaves the item as it was.
+// Compaction copies live items into a fresh file stripe by stripe under read locks; only stripes changed meanwhile
+// are copied again with every stripe locked, right before the fresh file replaces the old one.
+// A background thread starts it when free space fragmentation reaches compact_at percent.
+// Expiring keys are scheduled in an in-memory expiry wheel, which is filled from the expirations on startup.
+// With compression, long values are packed before the stripe lock is taken and unpacked straight from the segment by reads.
+// A file lock keeps other processes from opening the same file.
 class PersistentStorage : public IStorage
 {
 public:
-    PersistentStorage( size_t size );
-    IStorage::ErrorCode Insert( std::string_view key, std::string_view value ) override;
-    IStorage::ErrorCode Update( std::string_view key, std::string_view value ) override;
+    PersistentStorage( size_t size, size_t stripes = 1, size_t grow_step = 0, size_t compact_at = 0, size_t compress_above = 0 );
+    ~PersistentStorage();
+    IStorage::ErrorCode Insert( std::string_view key, std::string_view value, Expiry expiry ) override;
+    IStorage::ErrorCode Update( std::string_view key, std::string_view value, Expiry expiry ) override;
     IStorage::ErrorCode Delete( std::string_view key ) override;
-    std::optional< std::string > Get( std::string_view key ) override;
+    ValueRef Get( std::string_view key ) override;
+    std::vector< ValueRef > MultiGet( std::vector< std::string_view > const& keys ) override;
+    std::vector< IStorage::ErrorCode > MultiSet( std::vector< KeyValue > const& items, Expiry expiry ) override;
+    std::vector< IStorage::ErrorCode > MultiDelete( std::vector< std::string_view > const& keys ) override;
+    bool Scan( ScanRange const& range, size_t limit, std::vector< ScanItem >& items ) override;
     size_t GetItemCount() override;
+    SpaceInfo GetSpace() override;
+    size_t ReapExpired( Expiry now, size_t limit ) override;
+    Compression::Info GetCompression() override;
+    bool Compact();
 
 private:
+    struct alignas( 64 ) Stripe
+    {
+        mutable std::shared_mutex mMutex;
+        ItemMap* mMap = nullptr;
+        ExpirationMap* mExpirations = nullptr;
+        PackedKeyMap* mPacked = nullptr;
+        std::uint64_t mChanges = 0; // tells compaction which stripes changed after they were copied
+    };
+
+    Stripe& GetStripe( std::string_view key ) const;
+    static Expiry GetExpiry( Stripe const& stripe, std::string_view key );
+    // Needs the stripe and allocation locks
+    void SetExpiry( Stripe& stripe, std::string_view key, Expiry expiry );
+    static bool IsPacked( Stripe const& stripe, std::string_view key );
+    // Needs the stripe and allocation locks; found is the item of the key or the end of the map for a new one
+    void SetValue( Stripe& stripe, ItemMap::iterator found, std::string_view key, std::string_view bytes, bool packed );
+    static void ClearPacked( Stripe& stripe, std::string_view key );
+    // Sets the value and the expiry of an item with the locks of SetValue; an item that runs out of memory keeps both as they were
+    void SetItem( Stripe& stripe, ItemMap::iterator found, std::string_view key, std::string_view bytes, bool packed, Expiry expiry );
+    // Raw copy of the value of an item, empty if its packed bytes are damaged
+    static ValueRef Load( Stripe const& stripe, Item const& item );
+    // Pairs of ( stripe index, key index ) ordered by stripe, so a batch locks every stripe once
+    std::vector< std::pair< size_t, size_t > > GroupByStripe( std::vector< std::string_view > const& keys ) const;
+    // Runs change, growing the file and running it again while the segment is out of memory
+    template< typename F >
+    auto Growing( F const& change ) -> decltype( change() );
+    bool Grow( size_t seen_size, size_t extra );
+    void Attach();
+    // Maps the file again after it was unmapped, needs every stripe locked
+    void Remap();
+    void Compactor();
+
     std::string mPath;
+    boost::interprocess::file_lock mFileLock;
     MemoryType mBuffer;
-    ItemMap& mMap;
-    boost::interprocess::named_sharable_mutex mMutex;
+    size_t mStripeCount;
+    std::unique_ptr< Stripe[] > mStripes;
+    std::mutex mAllocation;
+    size_t mMinSize;
+    size_t mGrowStep;
+    std::atomic< size_t > mSize; // current file size, changes only with all stripes locked
+    ExpiryWheel mExpiry;
+    Compression mCompression;
+
+    size_t mCompactAt;
+    std::mutex mCompaction; // one compaction at a time
+    std::mutex mCompactorMutex;
+    std::condition_variable mCompactorStop;
+    bool mStopping = false;
+    std::thread mCompactor;
 };
 
 } // namespace storage
@@ -2,34 +2,102 @@
 
 #include <boost/asio/io_service.hpp>
 #include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <algorithm>
 
 #include "kvdb_server_storage.hpp"
+#include "kvdb_server_slab.hpp"
 
 namespace stats
 {
 
+constexpr std::array< double, 3 > Stats::PERCENTILES;
+constexpr size_t Stats::OPCODES;
+
+namespace
+{
+
+template< typename T >
+void Increment( std::atomic< T >& counter, T value = 1 )
+{
+    counter.store( counter.load( std::memory_order_relaxed ) + value, std::memory_order_relaxed ); // the only writer
+}
+
+double Seconds( std::uint64_t nanoseconds )
+{
+    return static_cast< double >( nanoseconds ) / 1e9;
+}
+
+// One before any value is packed
+double CompressionRatio( storage::Compression::Info const& info )
+{
+    return info.mPackedBytes == 0 ? 1.0 : static_cast< double >( info.mRawBytes ) / static_cast< double >( info.mPackedBytes );
+}
+
+std::uint64_t Nanoseconds( Clock::duration d )
+{
+    return static_cast< std::uint64_t >( std::max< std::int64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( d ).count(), 0 ) );
+}
+
+} // namespace
+
 IStats::~IStats()
 {
 }
 
 Stats::Stats( boost::asio::io_service& io_service, storage::IStorage& storage, size_t interval_seconds )
-    : mInterval( interval_seconds )
+    : mIntervalSeconds( interval_seconds )
+    , mInterval( interval_seconds )
     , mTimer( io_service, mInterval )
     , mStorage( storage )
 {
-    for( size_t i = 0; i < static_cast< size_t >( Opcode::op__MaxCount ); i++ )
+}
+
+Stats::ThreadCounters& Stats::GetThreadCounters()
+{
+    thread_local Stats* owner = nullptr;
+    thread_local ThreadCounters* counters = nullptr;
+    if( owner != this )
     {
-        mSuccess[ i ].store( 0 );
-        mFailure[ i ].store( 0 );
+        std::lock_guard< std::mutex > lock( mMutex );
+        mThreads.push_back( std::make_unique< ThreadCounters >() );
+        counters = mThreads.back().get();
+        owner = this;
     }
+    return *counters;
+}
+
+void Stats::RegisterOperation( Opcode type, bool success, Clock::duration storage_time, Clock::duration request_time )
+{
+    size_t i = static_cast< size_t >( type );
+    if( i >= OPCODES )
+        return;
+    ThreadCounters& counters = GetThreadCounters();
+    Increment< size_t >( success ? counters.mSuccess[ i ] : counters.mFailure[ i ] );
+    std::uint64_t storage_ns = Nanoseconds( storage_time );
+    std::uint64_t request_ns = Nanoseconds( request_time );
+    Histogram::Record( counters.mStorageTime[ i ], storage_ns );
+    Histogram::Record( counters.mRequestTime[ i ], request_ns );
+    Increment( counters.mStorageSum[ i ], storage_ns );
+    Increment( counters.mRequestSum[ i ], request_ns );
 }
 
-void Stats::RegisterOperation( Opcode type, bool success )
+void Stats::Collect( Totals& totals )
 {
-    if( success )
-        mSuccess[ static_cast< size_t >( type ) ].fetch_add( 1, std::memory_order_release );
-    else
-        mFailure[ static_cast< size_t >( type ) ].fetch_add( 1, std::memory_order_release );
+    std::lock_guard< std::mutex > lock( mMutex );
+    for( auto const& t : mThreads )
+    {
+        for( size_t i = 0; i < OPCODES; i++ )
+        {
+            totals.mSuccess[ i ] += t->mSuccess[ i ].load( std::memory_order_relaxed );
+            totals.mFailure[ i ] += t->mFailure[ i ].load( std::memory_order_relaxed );
+            totals.mStorageTime[ i ].Add( t->mStorageTime[ i ] );
+            totals.mRequestTime[ i ].Add( t->mRequestTime[ i ] );
+            totals.mStorageSum[ i ] += t->mStorageSum[ i ].load( std::memory_order_relaxed );
+            totals.mRequestSum[ i ] += t->mRequestSum[ i ].load( std::memory_order_relaxed );
+        }
+    }
 }
 
 void Stats::TimedReporting( boost::system::error_code const& ec )
@@ -39,21 +107,162 @@ void Stats::TimedReporting( boost::system::error_code const& ec )
 
     mTimer.expires_from_now( mInterval );
 
+    auto totals = std::make_unique< Totals >();
+    Collect( *totals );
+    std::array< size_t, OPCODES > const& succeeded = totals->mSuccess;
+    std::array< size_t, OPCODES > const& failed = totals->mFailure;
+    std::array< Histogram, OPCODES > const& storage_time = totals->mStorageTime;
+    std::array< Histogram, OPCODES > const& request_time = totals->mRequestTime;
+
     std::cerr << "Records: " << mStorage.GetItemCount()
+              << ", Evicted: " << mStorage.GetEvictedCount()
               << ", Succeeded/Failed operations:";
-    for( size_t i = 0; i < static_cast< size_t >( Opcode::op__MaxCount ); i++ )
+    for( size_t i = 0; i < OPCODES; i++ )
+        std::cerr << " " << mNames[ i ] << ": " << succeeded[ i ] << "/" << failed[ i ] << ",";
+    std::cerr << std::endl;
+
+    // Percentiles of the interval, in microseconds, as request/storage time
+    std::streamsize precision = std::cerr.precision();
+    std::cerr << "Latency, p" << PERCENTILES[ 0 ] << "/p" << PERCENTILES[ 1 ] << "/p" << PERCENTILES[ 2 ] << " us:" << std::fixed << std::setprecision( 1 );
+    for( size_t i = 0; i < OPCODES; i++ )
     {
-        std::cerr << " " << mNames[ i ] << ": "
-                  << mSuccess[ i ].load( std::memory_order_consume ) << "/"
-                  << mFailure[ i ].load( std::memory_order_consume ) << ",";
+        Histogram request = request_time[ i ];
+        Histogram storage = storage_time[ i ];
+        request.Subtract( mRequestTime[ i ] );
+        storage.Subtract( mStorageTime[ i ] );
+        if( request.GetCount() == 0 )
+            continue;
+        std::cerr << " " << mNames[ i ] << ":";
+        for( double p : PERCENTILES )
+            std::cerr << " " << request.Percentile( p ) / 1000.0 << "/" << storage.Percentile( p ) / 1000.0;
+        std::cerr << ",";
+    }
+    std::cerr << std::defaultfloat << std::setprecision( precision ) << std::endl;
+    mRequestTime = request_time;
+    mStorageTime = storage_time;
+
+    // Occupancy of the slab classes in use, as chunk size: used/total chunks, and the slabs given back since the start
+    storage::SlabAllocator const& slabs = storage::SlabAllocator::Instance();
+    std::cerr << "Slabs:";
+    size_t released = 0;
+    for( auto const& c : slabs.GetStats() )
+    {
+        if( c.mSlabs != 0 )
+            std::cerr << " " << c.mChunkSize << ": " << c.mUsed << "/" << c.mTotal << ",";
+        released += c.mReleased;
+    }
+    std::cerr << " released: " << released << ", large: " << slabs.GetLargeCount() << " (" << slabs.GetLargeSize() << " bytes)" << std::endl;
+
+    // Fragmentation is the share of free space outside of the largest free block
+    storage::IStorage::SpaceInfo space = mStorage.GetSpace();
+    if( space.mSize != 0 )
+    {
+        std::cerr << "File: " << space.mSize << " bytes, free: " << space.mFree << ", largest free block: " << space.mLargestFree
+                  << ", fragmentation: " << ( space.mFree == 0 ? 0 : 100 - space.mLargestFree * 100 / space.mFree ) << "%" << std::endl;
+    }
+
+    // Ratio of the raw to the packed bytes of the values compressed since the start
+    storage::Compression::Info compression = mStorage.GetCompression();
+    if( compression.mEnabled )
+    {
+        std::cerr << "Compression: " << compression.mPacked << " values packed, " << compression.mSkipped << " skipped, "
+                  << compression.mRawBytes << " bytes to " << compression.mPackedBytes << ", ratio: "
+                  << std::fixed << std::setprecision( 2 ) << CompressionRatio( compression )
+                  << std::defaultfloat << std::setprecision( precision ) << std::endl;
     }
-    std::cerr << std::endl;
 
     mTimer.async_wait( [ this ]( boost::system::error_code const& ec ){ TimedReporting( ec ); } );
 }
 
+std::string Stats::Export()
+{
+    auto totals = std::make_unique< Totals >();
+    Collect( *totals );
+
+    std::ostringstream out;
+    out << "# HELP kvdb_records Records in the storage\n"
+        << "# TYPE kvdb_records gauge\n"
+        << "kvdb_records " << mStorage.GetItemCount() << "\n"
+        << "# HELP kvdb_evicted_total Records evicted by the cache\n"
+        << "# TYPE kvdb_evicted_total counter\n"
+        << "kvdb_evicted_total " << mStorage.GetEvictedCount() << "\n";
+
+    out << "# HELP kvdb_operations_total Operations by opcode and result\n"
+        << "# TYPE kvdb_operations_total counter\n";
+    for( size_t i = 0; i < OPCODES; i++ )
+    {
+        out << "kvdb_operations_total{op=\"" << mNames[ i ] << "\",result=\"success\"} " << totals->mSuccess[ i ] << "\n"
+            << "kvdb_operations_total{op=\"" << mNames[ i ] << "\",result=\"failure\"} " << totals->mFailure[ i ] << "\n";
+    }
+
+    // Summaries with the quantiles since the start, empty opcodes are left out
+    auto summary = [ & ]( char const* name, char const* help, std::array< Histogram, OPCODES > const& histograms,
+                          std::array< std::uint64_t, OPCODES > const& sums )
+    {
+        out << "# HELP " << name << " " << help << "\n"
+            << "# TYPE " << name << " summary\n";
+        for( size_t i = 0; i < OPCODES; i++ )
+        {
+            if( histograms[ i ].GetCount() == 0 )
+                continue;
+            for( double p : PERCENTILES )
+                out << name << "{op=\"" << mNames[ i ] << "\",quantile=\"" << p / 100 << "\"} " << Seconds( histograms[ i ].Percentile( p ) ) << "\n";
+            out << name << "_sum{op=\"" << mNames[ i ] << "\"} " << Seconds( sums[ i ] ) << "\n"
+                << name << "_count{op=\"" << mNames[ i ] << "\"} " << histograms[ i ].GetCount() << "\n";
+        }
+    };
+    summary( "kvdb_request_latency_seconds", "Time from the request header to the reply", totals->mRequestTime, totals->mRequestSum );
+    summary( "kvdb_storage_latency_seconds", "Time spent in storage calls", totals->mStorageTime, totals->mStorageSum );
+
+    storage::SlabAllocator const& slabs = storage::SlabAllocator::Instance();
+    size_t used = 0, total = 0, released = 0;
+    for( auto const& c : slabs.GetStats() )
+    {
+        used += c.mUsed * c.mChunkSize;
+        total += c.mTotal * c.mChunkSize;
+        released += c.mReleased;
+    }
+    out << "# HELP kvdb_slab_bytes Memory of the slab classes, large values are allocated apart\n"
+        << "# TYPE kvdb_slab_bytes gauge\n"
+        << "kvdb_slab_bytes{state=\"used\"} " << used << "\n"
+        << "kvdb_slab_bytes{state=\"total\"} " << total << "\n"
+        << "kvdb_slab_bytes{state=\"large\"} " << slabs.GetLargeSize() << "\n"
+        << "# HELP kvdb_slab_released_total Slabs given back once all of their chunks were free\n"
+        << "# TYPE kvdb_slab_released_total counter\n"
+        << "kvdb_slab_released_total " << released << "\n";
+
+    storage::IStorage::SpaceInfo space = mStorage.GetSpace();
+    if( space.mSize != 0 )
+    {
+        out << "# HELP kvdb_file_bytes Space of the storage file\n"
+            << "# TYPE kvdb_file_bytes gauge\n"
+            << "kvdb_file_bytes{state=\"size\"} " << space.mSize << "\n"
+            << "kvdb_file_bytes{state=\"free\"} " << space.mFree << "\n"
+            << "kvdb_file_bytes{state=\"largest_free\"} " << space.mLargestFree << "\n";
+    }
+
+    storage::Compression::Info compression = mStorage.GetCompression();
+    if( compression.mEnabled )
+    {
+        out << "# HELP kvdb_compressed_values_total Values over the compression threshold, packed or kept raw as they did not shrink enough\n"
+            << "# TYPE kvdb_compressed_values_total counter\n"
+            << "kvdb_compressed_values_total{result=\"packed\"} " << compression.mPacked << "\n"
+            << "kvdb_compressed_values_total{result=\"skipped\"} " << compression.mSkipped << "\n"
+            << "# HELP kvdb_compressed_bytes_total Bytes of the packed values before and after compression\n"
+            << "# TYPE kvdb_compressed_bytes_total counter\n"
+            << "kvdb_compressed_bytes_total{state=\"raw\"} " << compression.mRawBytes << "\n"
+            << "kvdb_compressed_bytes_total{state=\"packed\"} " << compression.mPackedBytes << "\n"
+            << "# HELP kvdb_compression_ratio Raw to packed bytes of the values packed since the start\n"
+            << "# TYPE kvdb_compression_ratio gauge\n"
+            << "kvdb_compression_ratio " << CompressionRatio( compression ) << "\n";
+    }
+    return out.str();
+}
+
 void Stats::Launch()
 {
+    if( mIntervalSeconds == 0 )
+        return;
     mTimer.expires_from_now( boost::posix_time::seconds( 1 ) );
     mTimer.async_wait( [ this ]( boost::system::error_code const& ec ){ TimedReporting( ec ); } );
 }
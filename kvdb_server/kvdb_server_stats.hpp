@@ -4,10 +4,16 @@
 #include <string_view>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <boost/date_time/posix_time/posix_time_duration.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/io_service.hpp>
 #include "../kvdb_data_models/kvdb_data_models.hpp"
+#include "kvdb_server_histogram.hpp"
 
 constexpr std::string_view operator ""_sv( const char* str, std::size_t len ) noexcept
 {
@@ -24,27 +30,68 @@ class IStorage;
 namespace stats
 {
 
+typedef std::chrono::steady_clock Clock;
+
 class IStats
 {
 public:
     virtual ~IStats();
-    virtual void RegisterOperation( Opcode type, bool success ) = 0;
+    // Storage time is spent in storage calls, request time from the request header to the reply
+    virtual void RegisterOperation( Opcode type, bool success, Clock::duration storage_time, Clock::duration request_time ) = 0;
+    // Counters, storage usage and latency since the start in the Prometheus text format
+    virtual std::string Export() = 0;
 };
 
 class Stats : public IStats
 {
 public:
-    static constexpr std::array< std::string_view, 4 > mNames{ "Insert"_sv, "Update"_sv, "Delete"_sv, "Get"_sv };
+    static constexpr std::array< std::string_view, static_cast< size_t >( Opcode::op__MaxCount ) > mNames{ "Insert"_sv, "Update"_sv, "Delete"_sv, "Get"_sv, "MultiGet"_sv, "MultiSet"_sv, "MultiDelete"_sv, "Scan"_sv, "Stats"_sv };
+
+    static constexpr std::array< double, 3 > PERCENTILES{ 50, 99, 99.9 };
 
+    // An interval of 0 turns the periodic report off
     Stats( boost::asio::io_service& io_service, storage::IStorage& storage, size_t interval_seconds );
-    void RegisterOperation( Opcode type, bool success ) override;
+    void RegisterOperation( Opcode type, bool success, Clock::duration storage_time, Clock::duration request_time ) override;
+    std::string Export() override;
     void TimedReporting( boost::system::error_code const& ec );
     void Launch();
 
 private:
-    std::array< std::atomic< size_t >, static_cast< size_t >( Opcode::op__MaxCount ) > mSuccess;
-    std::array< std::atomic< size_t >, static_cast< size_t >( Opcode::op__MaxCount ) > mFailure;
+    static constexpr size_t OPCODES = static_cast< size_t >( Opcode::op__MaxCount );
+
+    // Counters of one thread, written by it alone and merged at report time, so threads share no cache lines
+    struct alignas( 64 ) ThreadCounters
+    {
+        std::array< std::atomic< size_t >, OPCODES > mSuccess{};
+        std::array< std::atomic< size_t >, OPCODES > mFailure{};
+        std::array< Histogram::Counters, OPCODES > mStorageTime{};
+        std::array< Histogram::Counters, OPCODES > mRequestTime{};
+        std::array< std::atomic< std::uint64_t >, OPCODES > mStorageSum{}; // nanoseconds
+        std::array< std::atomic< std::uint64_t >, OPCODES > mRequestSum{};
+    };
+
+    // Counters of all threads since the start
+    struct Totals
+    {
+        std::array< size_t, OPCODES > mSuccess{};
+        std::array< size_t, OPCODES > mFailure{};
+        std::array< Histogram, OPCODES > mStorageTime;
+        std::array< Histogram, OPCODES > mRequestTime;
+        std::array< std::uint64_t, OPCODES > mStorageSum{};
+        std::array< std::uint64_t, OPCODES > mRequestSum{};
+    };
+
+    ThreadCounters& GetThreadCounters();
+    // Reads the counters while the threads go on writing them, the lock only keeps new threads out
+    void Collect( Totals& totals );
+
+    std::mutex mMutex; // of mThreads
+    std::vector< std::unique_ptr< ThreadCounters > > mThreads;
+    // Histograms merged by the previous report, percentiles are of the interval since
+    std::array< Histogram, OPCODES > mStorageTime;
+    std::array< Histogram, OPCODES > mRequestTime;
 
+    size_t mIntervalSeconds;
     boost::posix_time::seconds mInterval;
     boost::asio::deadline_timer mTimer;
 
@@ -2,6 +2,8 @@
 
 #include <cinttypes>
 #include <iostream>
+#include <algorithm>
+#include <iterator>
 #include "kvdb_server_st_m.hpp"
 #include "kvdb_server_st_p.hpp"
 
@@ -12,14 +14,63 @@ IStorage::~IStorage()
 {
 }
 
-std::unique_ptr< IStorage > InitializeStorage( size_t size, IStorage::Type type )
+IStorage::SpaceInfo IStorage::GetSpace()
 {
+    return {};
+}
+
+size_t IStorage::ReapExpired( Expiry, size_t )
+{
+    return 0;
+}
+
+size_t IStorage::GetEvictedCount()
+{
+    return 0;
+}
+
+Compression::Info IStorage::GetCompression()
+{
+    return {};
+}
+
+bool IStorage::Scan( ScanRange const&, size_t, std::vector< ScanItem >& )
+{
+    return false;
+}
+
+bool IStorage::ScanRange::Includes( std::string_view key ) const
+{
+    if( !mEnd.empty() && key >= mEnd )
+        return false;
+    return key.substr( 0, mPrefix.size() ) == mPrefix;
+}
+
+void MergeScanItems( std::vector< IStorage::ScanItem >& items, std::vector< IStorage::ScanItem >& shard_items, size_t limit )
+{
+    size_t size = items.size();
+    items.insert( items.end(), std::make_move_iterator( shard_items.begin() ), std::make_move_iterator( shard_items.end() ) );
+    shard_items.clear();
+    std::inplace_merge( items.begin(), items.begin() + size, items.end(),
+                        []( IStorage::ScanItem const& lhs, IStorage::ScanItem const& rhs ){ return lhs.first < rhs.first; } );
+    if( items.size() > limit )
+        items.resize( limit );
+}
+
+std::unique_ptr< IStorage > InitializeStorage( size_t size, IStorage::Type type, size_t shards, size_t grow_step, size_t compact_at, size_t cache_size, std::optional< LogOptions > const& log,
+                                               size_t compress_above )
+{
+    std::unique_ptr< WriteAheadLog > wal;
+    if( log && type != IStorage::tPersistent )
+        wal = std::make_unique< WriteAheadLog >( *log );
     switch( type )
     {
         case IStorage::tTemporal:
-            return std::make_unique< TempStorage >();
+            return std::make_unique< TempStorage >( shards, cache_size, std::move( wal ), compress_above );
         case IStorage::tPersistent:
-            return std::make_unique< PersistentStorage >( size );
+            return std::make_unique< PersistentStorage >( size, shards, grow_step, compact_at, compress_above );
+        case IStorage::tHashed:
+            return std::make_unique< HashStorage >( shards, cache_size, std::move( wal ), compress_above );
     }
     return nullptr;
 }
@@ -6,6 +6,12 @@
 #include <map>
 #include <shared_mutex>
 #include <optional>
+#include <memory>
+#include <vector>
+#include <utility>
+
+#include "kvdb_server_value.hpp"
+#include "kvdb_server_wal.hpp"
 
 namespace storage
 {
@@ -16,23 +22,72 @@ public:
     enum Type
     {
         tTemporal,
-        tPersistent
+        tPersistent,
+        tHashed
     };
     enum ErrorCode
     {
         ecSuccess,
         ecKeyNotFound,
         ecKeyAlreadyExists,
-        ecValueNotChanged
+        ecValueNotChanged,
+        ecLogFailed, // the change is made in memory, but the write-ahead log could not make it durable
+        ecNoSpace // persistent storage is full and could not grow
+    };
+    typedef std::pair< std::string_view, std::string_view > KeyValue;
+    typedef std::pair< std::string, ValueRef > ScanItem;
+    // Keys from mStart up to mEnd (excluded) or while they start with mPrefix; empty end and prefix leave the range open
+    struct ScanRange
+    {
+        std::string_view mStart;
+        bool mAfterStart = false; // mStart itself is excluded, as when a scan continues from the last key it sent
+        std::string_view mEnd;
+        std::string_view mPrefix;
+
+        bool Includes( std::string_view key ) const; // for keys not before the start
     };
+    // Space of a storage file, all zero for storages without one
+    struct SpaceInfo
+    {
+        size_t mSize = 0;
+        size_t mFree = 0;
+        size_t mLargestFree = 0; // largest allocation that can succeed without growing the file
+    };
+
     virtual ~IStorage() = 0;
-    virtual ErrorCode Insert( std::string_view key, std::string_view value ) = 0;
-    virtual ErrorCode Update( std::string_view key, std::string_view value ) = 0;
+    // Written items expire at expiry; an expired item is found by no operation and is removed by ReapExpired
+    virtual ErrorCode Insert( std::string_view key, std::string_view value, Expiry expiry ) = 0;
+    virtual ErrorCode Update( std::string_view key, std::string_view value, Expiry expiry ) = 0;
     virtual ErrorCode Delete( std::string_view key ) = 0;
-    virtual std::optional< std::string > Get( std::string_view key ) = 0;
+    // Returned value stays valid and unchanged after the storage lock is released, empty reference if key not found
+    virtual ValueRef Get( std::string_view key ) = 0;
+    // Batch variants take the storage lock once for all keys.
+    // MultiSet inserts missing keys and updates existing ones.
+    virtual std::vector< ValueRef > MultiGet( std::vector< std::string_view > const& keys ) = 0;
+    virtual std::vector< ErrorCode > MultiSet( std::vector< KeyValue > const& items, Expiry expiry ) = 0;
+    virtual std::vector< ErrorCode > MultiDelete( std::vector< std::string_view > const& keys ) = 0;
+    // Up to limit items of the range in key order. The storage lock is taken for this call only,
+    // so a long scan goes in chunks, each continuing after the last key of the previous one.
+    // An item whose value is damaged comes with an empty reference, so a full chunk still has limit items.
+    // Returns false if the storage is not ordered.
+    virtual bool Scan( ScanRange const& range, size_t limit, std::vector< ScanItem >& items );
     virtual size_t GetItemCount() = 0;
+    virtual SpaceInfo GetSpace();
+    // Removes items expired by now, looking at no more than limit keys that became due; returns the number of keys looked at
+    virtual size_t ReapExpired( Expiry now, size_t limit );
+    // Items evicted to keep within the cache size since the start, zero for storages without one
+    virtual size_t GetEvictedCount();
+    // Values compressed since the start, disabled for storages without compression
+    virtual Compression::Info GetCompression();
 };
 
-std::unique_ptr< IStorage > InitializeStorage( size_t size, IStorage::Type type );
+// Merges items of one shard, sorted by key, into the sorted items of the previous shards and keeps the first limit of them
+void MergeScanItems( std::vector< IStorage::ScanItem >& items, std::vector< IStorage::ScanItem >& shard_items, size_t limit );
+
+// Size, grow step and compaction threshold apply to persistent storage, cache size and the write-ahead log to temporal and hashed storage.
+// A cache size of zero leaves the storage unbounded.
+// Values longer than compress_above bytes are kept compressed by every storage, zero turns compression off.
+std::unique_ptr< IStorage > InitializeStorage( size_t size, IStorage::Type type, size_t shards = 1, size_t grow_step = 0, size_t compact_at = 0,
+                                               size_t cache_size = 0, std::optional< LogOptions > const& log = std::nullopt, size_t compress_above = 0 );
 
 } // namespace storage
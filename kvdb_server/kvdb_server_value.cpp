@@ -0,0 +1,93 @@
+#include "kvdb_server_value.hpp"
+
+#include <cstring> // memcpy
+#include <new>
+#include <chrono>
+#include <string>
+#include <iostream>
+
+#include "kvdb_server_slab.hpp"
+#include "../kvdb_data_models/kvdb_data_models.hpp"
+
+namespace storage
+{
+
+constexpr std::uint8_t Value::MAX_FREQUENCY;
+
+Expiry ExpiryNow()
+{
+    return static_cast< Expiry >( std::chrono::duration_cast< std::chrono::milliseconds >(
+                                      std::chrono::system_clock::now().time_since_epoch() ).count() );
+}
+
+Expiry ExpiryAfter( std::uint32_t ttl_seconds )
+{
+    return ttl_seconds == 0 ? NO_EXPIRY : ExpiryNow() + ttl_seconds * Expiry( 1000 );
+}
+
+Value::Value( size_t size, Expiry expiry, bool compressed )
+    : mRefs( 0 )
+    , mSize( static_cast< std::uint32_t >( size ) )
+    , mExpiry( expiry )
+    , mCompressed( compressed )
+{
+}
+
+Value* Value::Allocate( size_t size, Expiry expiry, bool compressed )
+{
+    void* p = SlabAllocator::Instance().Allocate( sizeof( Value ) + size );
+    return new( p ) Value( size, expiry, compressed );
+}
+
+ValueRef Value::Create( std::string_view data, Expiry expiry )
+{
+    Value* v = Allocate( data.size(), expiry, false );
+    ::memcpy( v->Data(), data.data(), data.size() );
+    return ValueRef( v );
+}
+
+ValueRef Value::Create( std::string_view data, Expiry expiry, Compression& compression )
+{
+    thread_local std::string packed; // keeps its capacity for the next value of the thread
+    if( !compression.Pack( data, packed ) )
+        return Create( data, expiry );
+    Value* v = Allocate( packed.size(), expiry, true );
+    ::memcpy( v->Data(), packed.data(), packed.size() );
+    return ValueRef( v );
+}
+
+ValueRef Value::Unpack( std::string_view packed, Expiry expiry )
+{
+    // The raw size comes from the packed bytes, a damaged one must not make a huge allocation
+    size_t size = Compression::GetRawSize( packed );
+    ValueRef v;
+    if( size != 0 && size <= static_cast< size_t >( network::DecodedHeader::MAX_VALUE_SIZE ) )
+        v.reset( Allocate( size, expiry, false ) );
+    if( !v || !Compression::Unpack( packed, v->Data() ) )
+    {
+        std::cerr << "Error: compressed value is damaged" << std::endl;
+        return {};
+    }
+    return v;
+}
+
+ValueRef Value::Unpacked() const
+{
+    return mCompressed ? Unpack( View(), mExpiry ) : ValueRef( this );
+}
+
+void intrusive_ptr_add_ref( Value const* v )
+{
+    v->mRefs.fetch_add( 1, std::memory_order_relaxed );
+}
+
+void intrusive_ptr_release( Value const* v )
+{
+    if( v->mRefs.fetch_sub( 1, std::memory_order_acq_rel ) != 1 )
+        return;
+    size_t size = sizeof( Value ) + v->mSize;
+    v->~Value();
+    SlabAllocator::Instance().Deallocate( const_cast< Value* >( v ), size );
+}
+
+} // namespace storage
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <atomic>
+#include <string_view>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+
+#include "kvdb_server_codec.hpp"
+
+namespace storage
+{
+
+class Value;
+class S3Fifo;
+
+typedef boost::intrusive_ptr< Value const > ValueRef;
+
+// Time an item expires at, in milliseconds since the epoch of the system clock, so it means the same after a restart
+typedef std::uint64_t Expiry;
+constexpr Expiry NO_EXPIRY = 0;
+
+Expiry ExpiryNow();
+// Expiry of an item written now with a time to live in seconds, NO_EXPIRY for zero
+Expiry ExpiryAfter( std::uint32_t ttl_seconds );
+
+inline bool IsExpired( Expiry expiry )
+{
+    return expiry != NO_EXPIRY && expiry <= ExpiryNow();
+}
+
+// Immutable value bytes with a reference counter, allocated as one block together with the bytes.
+// Readers keep a value alive after the storage lock is released, so it can be sent straight from storage memory;
+// an update replaces the stored reference and the old bytes go away with the last reader.
+// A stored value may hold packed bytes, which only Unpacked copies give out.
+class Value
+{
+public:
+    static ValueRef Create( std::string_view data, Expiry expiry = NO_EXPIRY );
+    // Packs data if the compression policy says so
+    static ValueRef Create( std::string_view data, Expiry expiry, Compression& compression );
+    // Raw value of packed bytes, empty if they are damaged
+    static ValueRef Unpack( std::string_view packed, Expiry expiry );
+
+    std::string_view View() const
+    {
+        return std::string_view( Data(), mSize );
+    }
+    size_t Size() const
+    {
+        return mSize;
+    }
+    Expiry GetExpiry() const
+    {
+        return mExpiry;
+    }
+    bool IsCompressed() const
+    {
+        return mCompressed;
+    }
+    // The value itself, or a raw copy of a compressed one
+    ValueRef Unpacked() const;
+    // Counts a read for the eviction policy; racing readers may lose a count, which does not matter
+    void Touch() const
+    {
+        std::uint8_t frequency = mFrequency.load( std::memory_order_relaxed );
+        if( frequency < MAX_FREQUENCY )
+            mFrequency.store( frequency + 1, std::memory_order_relaxed );
+    }
+
+    Value( Value const& ) = delete;
+    Value& operator=( Value const& ) = delete;
+
+private:
+    Value( size_t size, Expiry expiry, bool compressed );
+    static Value* Allocate( size_t size, Expiry expiry, bool compressed );
+    char* Data() const
+    {
+        return const_cast< char* >( reinterpret_cast< char const* >( this + 1 ) );
+    }
+
+    friend void intrusive_ptr_add_ref( Value const* v );
+    friend void intrusive_ptr_release( Value const* v );
+    friend class S3Fifo;
+
+    static constexpr std::uint8_t MAX_FREQUENCY = 3;
+
+    mutable std::atomic< std::uint32_t > mRefs;
+    std::uint32_t mSize;
+    Expiry mExpiry;
+    // Eviction state of a stored value, changed under the exclusive shard lock except for the read counter
+    mutable std::uint32_t mStamp = 0; // tells the queue entry of the item from stale ones of the same key
+    mutable std::atomic< std::uint8_t > mFrequency{ 0 };
+    mutable bool mMain = false; // in the main queue rather than the small one
+    bool mCompressed; // fits in the padding, so values are no larger
+};
+
+void intrusive_ptr_add_ref( Value const* v );
+void intrusive_ptr_release( Value const* v );
+
+} // namespace storage
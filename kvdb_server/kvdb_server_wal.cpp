@@ -0,0 +1,443 @@
+#include "kvdb_server_wal.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <algorithm>
+#include <system_error>
+#include <cerrno>
+#include <cstdio> // sscanf
+#include <cstring> // strerror
+#include <boost/filesystem.hpp>
+#if defined _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "../kvdb_data_models/kvdb_data_models.hpp"
+
+namespace storage
+{
+
+namespace
+{
+
+// Record: CRC-32C of the rest of the record (4), type (1), key length (2), value length (4), key, value; integers are little-endian.
+// The value of an expiring item starts with its expiry (8), which is counted in the value length.
+constexpr size_t RECORD_HEADER_SIZE = 11;
+constexpr size_t EXPIRY_SIZE = 8;
+constexpr char RECORD_SET = 'S';
+constexpr char RECORD_SET_EXPIRING = 'E';
+constexpr char RECORD_DELETE = 'D';
+constexpr size_t FLUSH_SIZE = 4 * 1024 * 1024; // buffer size that wakes the writer before the sync interval
+
+template< size_t N >
+void PutLittleEndian( char* p, std::uint64_t value )
+{
+    for( size_t i = 0; i < N; i++ )
+        p[ i ] = static_cast< char >( ( value >> ( 8 * i ) ) & 0xff );
+}
+
+template< size_t N >
+std::uint64_t GetLittleEndian( char const* p )
+{
+    std::uint64_t value = 0;
+    for( size_t i = 0; i < N; i++ )
+        value |= static_cast< std::uint64_t >( static_cast< unsigned char >( p[ i ] ) ) << ( 8 * i );
+    return value;
+}
+
+size_t AppendRecord( std::string& out, char type, std::string_view key, std::string_view value, Expiry expiry )
+{
+    if( type == RECORD_SET && expiry != NO_EXPIRY )
+        type = RECORD_SET_EXPIRING;
+    size_t prefix = type == RECORD_SET_EXPIRING ? EXPIRY_SIZE : 0;
+    size_t start = out.size();
+    out.resize( start + RECORD_HEADER_SIZE + key.size() + prefix + value.size() );
+    char* p = &out[ start ];
+    p[ 4 ] = type;
+    PutLittleEndian< 2 >( p + 5, key.size() );
+    PutLittleEndian< 4 >( p + 7, prefix + value.size() );
+    std::copy( key.begin(), key.end(), p + RECORD_HEADER_SIZE );
+    if( prefix != 0 )
+        PutLittleEndian< EXPIRY_SIZE >( p + RECORD_HEADER_SIZE + key.size(), expiry );
+    std::copy( value.begin(), value.end(), p + RECORD_HEADER_SIZE + key.size() + prefix );
+    PutLittleEndian< 4 >( p, network::Crc32c( 0, p + 4, out.size() - start - 4 ) );
+    return out.size() - start;
+}
+
+int OpenFile( std::string const& path, bool truncate )
+{
+#if defined _WIN32
+    return ::_open( path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY | ( truncate ? _O_TRUNC : _O_APPEND ), _S_IREAD | _S_IWRITE );
+#else
+    return ::open( path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | ( truncate ? O_TRUNC : O_APPEND ), 0644 );
+#endif
+}
+
+bool WriteFile( int fd, std::string const& data )
+{
+    for( size_t done = 0; done < data.size(); )
+    {
+#if defined _WIN32
+        int n = ::_write( fd, data.data() + done, static_cast< unsigned >( std::min< size_t >( data.size() - done, 1 << 30 ) ) );
+#else
+        ssize_t n = ::write( fd, data.data() + done, data.size() - done );
+#endif
+        if( n < 0 && errno == EINTR )
+            continue;
+        if( n <= 0 )
+            return false;
+        done += static_cast< size_t >( n );
+    }
+    return true;
+}
+
+bool SyncFile( int fd )
+{
+#if defined _WIN32
+    return ::_commit( fd ) == 0;
+#elif defined __APPLE__
+    return ::fsync( fd ) == 0;
+#else
+    return ::fdatasync( fd ) == 0;
+#endif
+}
+
+void CloseFile( int fd )
+{
+#if defined _WIN32
+    ::_close( fd );
+#else
+    ::close( fd );
+#endif
+}
+
+// Log segment and snapshot names carry a number: the segment number, and for a snapshot the first segment written after it
+bool ParseName( std::string const& name, char const* format, std::uint64_t& number )
+{
+    unsigned long long n = 0;
+    int length = 0;
+    if( std::sscanf( name.c_str(), format, &n, &length ) != 1 || static_cast< size_t >( length ) != name.size() )
+        return false;
+    number = n;
+    return true;
+}
+
+constexpr char const* SEGMENT_FORMAT = "wal-%llu.log%n";
+constexpr char const* SNAPSHOT_FORMAT = "snapshot-%llu.dat%n";
+
+} // namespace
+
+void SyncDirectory( std::string const& path )
+{
+#if !defined _WIN32
+    int fd = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if( fd < 0 )
+        return;
+    ::fsync( fd );
+    ::close( fd );
+#endif
+}
+
+ILogTarget::~ILogTarget()
+{
+}
+
+WriteAheadLog::WriteAheadLog( LogOptions const& options )
+    : mOptions( options )
+{
+}
+
+WriteAheadLog::~WriteAheadLog()
+{
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+        mStopping = true;
+    }
+    mStop.notify_all();
+    mWake.notify_all();
+    mDurable.notify_all();
+    if( mSnapshotter.joinable() )
+        mSnapshotter.join(); // before the writer, a snapshot may wait for it
+    if( mWriter.joinable() )
+        mWriter.join();
+    if( mFile >= 0 )
+        CloseFile( mFile );
+}
+
+std::string WriteAheadLog::SegmentPath( std::uint64_t number ) const
+{
+    char name[ 64 ];
+    std::snprintf( name, sizeof( name ), "wal-%016llu.log", static_cast< unsigned long long >( number ) );
+    return ( boost::filesystem::path( mOptions.mDirectory ) / name ).string();
+}
+
+std::string WriteAheadLog::SnapshotPath( std::uint64_t number ) const
+{
+    char name[ 64 ];
+    std::snprintf( name, sizeof( name ), "snapshot-%016llu.dat", static_cast< unsigned long long >( number ) );
+    return ( boost::filesystem::path( mOptions.mDirectory ) / name ).string();
+}
+
+void WriteAheadLog::Open( ILogTarget& target )
+{
+    mTarget = &target;
+    boost::filesystem::create_directories( mOptions.mDirectory );
+
+    std::vector< std::uint64_t > segments, snapshots;
+    std::vector< boost::filesystem::path > unfinished;
+    for( auto const& entry : boost::filesystem::directory_iterator( mOptions.mDirectory ) )
+    {
+        std::string name = entry.path().filename().string();
+        std::uint64_t number = 0;
+        if( entry.path().extension() == ".tmp" )
+            unfinished.push_back( entry.path() ); // snapshot interrupted by a crash
+        else if( ParseName( name, SEGMENT_FORMAT, number ) )
+            segments.push_back( number );
+        else if( ParseName( name, SNAPSHOT_FORMAT, number ) )
+            snapshots.push_back( number );
+    }
+    for( auto const& file : unfinished )
+        boost::filesystem::remove( file );
+    std::sort( segments.begin(), segments.end() );
+    std::sort( snapshots.begin(), snapshots.end() );
+
+    std::uint64_t start = snapshots.empty() ? 0 : snapshots.back();
+    if( !snapshots.empty() )
+        Replay( SnapshotPath( start ), target, false );
+    for( std::uint64_t number : snapshots )
+        if( number != start )
+            boost::filesystem::remove( SnapshotPath( number ) );
+    size_t replayed = 0;
+    for( std::uint64_t number : segments )
+    {
+        if( number < start )
+        {
+            boost::filesystem::remove( SegmentPath( number ) ); // already in the snapshot
+            continue;
+        }
+        Replay( SegmentPath( number ), target, true );
+        replayed++;
+    }
+
+    // The tail of the last segment is cut to whole records above, so new records can follow them
+    mSegment = segments.empty() ? start : std::max( start, segments.back() );
+    mFile = OpenFile( SegmentPath( mSegment ), false );
+    if( mFile < 0 )
+        throw std::system_error( errno, std::generic_category(), "could not open " + SegmentPath( mSegment ) );
+    std::cout << "Write-ahead log in " << mOptions.mDirectory << " opened, "
+              << ( snapshots.empty() ? 0 : 1 ) << " snapshot and " << replayed << " log segments loaded..." << std::endl;
+
+    mWriter = std::thread( [ this ](){ Writer(); } );
+    if( mOptions.mSnapshotInterval.count() > 0 )
+        mSnapshotter = std::thread( [ this ](){ Snapshots(); } );
+}
+
+void WriteAheadLog::Replay( std::string const& path, ILogTarget& target, bool truncate )
+{
+    std::ifstream in( path, std::ios::binary );
+    std::string record( RECORD_HEADER_SIZE, '\0' );
+    std::uint64_t good = 0;
+    while( in.read( &record[ 0 ], RECORD_HEADER_SIZE ) )
+    {
+        char type = record[ 4 ];
+        size_t key_size = GetLittleEndian< 2 >( &record[ 5 ] );
+        size_t value_size = GetLittleEndian< 4 >( &record[ 7 ] );
+        size_t prefix = type == RECORD_SET_EXPIRING ? EXPIRY_SIZE : 0;
+        if( ( type != RECORD_SET && type != RECORD_SET_EXPIRING && type != RECORD_DELETE )
+                || value_size < prefix || value_size > network::DecodedHeader::MAX_VALUE_SIZE + prefix )
+            break;
+        record.resize( RECORD_HEADER_SIZE + key_size + value_size );
+        if( !in.read( &record[ RECORD_HEADER_SIZE ], static_cast< std::streamsize >( key_size + value_size ) ) )
+            break;
+        if( GetLittleEndian< 4 >( &record[ 0 ] ) != network::Crc32c( 0, &record[ 4 ], record.size() - 4 ) )
+            break;
+
+        std::string_view key( &record[ RECORD_HEADER_SIZE ], key_size );
+        if( type != RECORD_DELETE )
+        {
+            Expiry expiry = prefix == 0 ? NO_EXPIRY : GetLittleEndian< EXPIRY_SIZE >( &record[ RECORD_HEADER_SIZE + key_size ] );
+            target.ReplaySet( key, std::string_view( &record[ RECORD_HEADER_SIZE + key_size + prefix ], value_size - prefix ), expiry );
+        }
+        else
+            target.ReplayDelete( key );
+        good += record.size();
+        record.resize( RECORD_HEADER_SIZE );
+    }
+    in.close();
+
+    std::uint64_t size = boost::filesystem::file_size( path );
+    if( good == size )
+        return;
+    // A crash leaves a partly written record at the end of the last segment
+    std::cout << "Warning: " << size - good << " damaged bytes at the end of " << path << " are dropped" << std::endl;
+    if( truncate )
+        boost::filesystem::resize_file( path, good );
+}
+
+std::uint64_t WriteAheadLog::AppendSet( std::string_view key, std::string_view value, Expiry expiry )
+{
+    return Append( RECORD_SET, key, value, expiry );
+}
+
+std::uint64_t WriteAheadLog::AppendDelete( std::string_view key )
+{
+    return Append( RECORD_DELETE, key, std::string_view(), NO_EXPIRY );
+}
+
+std::uint64_t WriteAheadLog::Append( char type, std::string_view key, std::string_view value, Expiry expiry )
+{
+    std::lock_guard< std::mutex > lock( mMutex );
+    mAppended += AppendRecord( mBuffer, type, key, value, expiry );
+    if( mOptions.mSync == LogOptions::spAlways || mBuffer.size() >= FLUSH_SIZE )
+        mWake.notify_one();
+    return mAppended;
+}
+
+bool WriteAheadLog::WaitDurable( std::uint64_t position )
+{
+    if( mOptions.mSync != LogOptions::spAlways )
+        return !mFailed.load( std::memory_order_relaxed );
+    std::unique_lock< std::mutex > lock( mMutex );
+    mDurable.wait( lock, [ & ](){ return mSynced >= position || mFailed || mStopping; } );
+    return mSynced >= position;
+}
+
+void WriteAheadLog::Writer()
+{
+    std::string batch, sealed;
+    std::unique_lock< std::mutex > lock( mMutex );
+    for( ; ; )
+    {
+        // While one batch is written and synced, the next one collects the records of all concurrent mutations
+        if( mOptions.mSync == LogOptions::spAlways )
+            mWake.wait( lock, [ this ](){ return mStopping || mRotate || !mBuffer.empty(); } );
+        else
+            mWake.wait_for( lock, mOptions.mSyncInterval, [ this ](){ return mStopping || mRotate || mBuffer.size() >= FLUSH_SIZE; } );
+        bool rotate = mRotate;
+        bool stopping = mStopping;
+        std::uint64_t segment = mSegment;
+        std::uint64_t position = mAppended;
+        mRotate = false;
+        batch.swap( mBuffer );
+        sealed.swap( mSealed );
+        lock.unlock();
+
+        // errno of the first failed call, before other calls change it
+        int error = 0;
+        auto check = [ &error ]( bool done )
+        {
+            if( !done && error == 0 )
+                error = errno != 0 ? errno : EIO;
+        };
+        errno = 0;
+        if( rotate )
+        {
+            check( WriteFile( mFile, sealed ) && SyncFile( mFile ) );
+            CloseFile( mFile );
+            mFile = OpenFile( SegmentPath( segment ), false );
+            check( mFile >= 0 );
+        }
+        if( !batch.empty() && mFile >= 0 )
+            check( WriteFile( mFile, batch ) && ( mOptions.mSync == LogOptions::spNone || SyncFile( mFile ) ) );
+        batch.clear();
+        sealed.clear();
+
+        lock.lock();
+        if( error != 0 && !mFailed )
+        {
+            mFailed = true;
+            std::cerr << "Error: write-ahead log in " << mOptions.mDirectory << " failed (" << std::strerror( error )
+                      << "), changes are no longer durable" << std::endl;
+        }
+        if( !mFailed )
+            mSynced = position;
+        mDurable.notify_all();
+        if( stopping )
+            break;
+    }
+}
+
+void WriteAheadLog::Snapshots()
+{
+    std::unique_lock< std::mutex > lock( mMutex );
+    std::uint64_t last = mAppended;
+    while( !mStop.wait_for( lock, mOptions.mSnapshotInterval, [ this ](){ return mStopping; } ) )
+    {
+        if( mAppended == last )
+            continue; // nothing changed
+        last = mAppended;
+        lock.unlock();
+        if( !WriteSnapshot() )
+            std::cerr << "Error: snapshot in " << mOptions.mDirectory << " failed" << std::endl;
+        lock.lock();
+    }
+}
+
+bool WriteAheadLog::WriteSnapshot()
+{
+    // Seal the current segment: everything appended before this point is applied to the storage before the dump reaches it
+    std::uint64_t start, position;
+    {
+        std::lock_guard< std::mutex > lock( mMutex );
+        mSealed.swap( mBuffer );
+        mRotate = true;
+        start = ++mSegment;
+        position = mAppended;
+    }
+    mWake.notify_one();
+
+    std::string path = SnapshotPath( start );
+    std::string temp = path + ".tmp";
+    int fd = OpenFile( temp, true );
+    if( fd < 0 )
+        return false;
+    bool ok = true;
+    std::string buffer;
+    mTarget->Dump( [ & ]( std::string_view key, std::string_view value, Expiry expiry )
+    {
+        AppendRecord( buffer, RECORD_SET, key, value, expiry );
+        if( buffer.size() >= FLUSH_SIZE )
+        {
+            ok = WriteFile( fd, buffer ) && ok;
+            buffer.clear();
+        }
+    } );
+    ok = WriteFile( fd, buffer ) && SyncFile( fd ) && ok;
+    CloseFile( fd );
+    boost::system::error_code ec;
+    if( ok )
+        boost::filesystem::rename( temp, path, ec );
+    if( !ok || ec )
+    {
+        boost::filesystem::remove( temp, ec );
+        return false;
+    }
+    SyncDirectory( mOptions.mDirectory );
+
+    // Older files are dropped once the sealed segment is on disk and the new one is open
+    {
+        std::unique_lock< std::mutex > lock( mMutex );
+        mDurable.wait( lock, [ & ](){ return mSynced >= position || mFailed || mStopping; } );
+        if( mSynced < position )
+            return false; // the old files are all there is
+    }
+    std::vector< boost::filesystem::path > obsolete;
+    for( auto const& entry : boost::filesystem::directory_iterator( mOptions.mDirectory ) )
+    {
+        std::uint64_t number = 0;
+        std::string name = entry.path().filename().string();
+        if( ( ParseName( name, SEGMENT_FORMAT, number ) || ParseName( name, SNAPSHOT_FORMAT, number ) ) && number < start )
+            obsolete.push_back( entry.path() );
+    }
+    for( auto const& file : obsolete )
+        boost::filesystem::remove( file, ec );
+    return true;
+}
+
+} // namespace storage
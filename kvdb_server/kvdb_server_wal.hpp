@@ -0,0 +1,101 @@
+#pragma once
+
+#include <cinttypes> // size_t
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "kvdb_server_value.hpp"
+
+namespace storage
+{
+
+// Makes a rename in the directory durable, Windows has no such call and does not need it
+void SyncDirectory( std::string const& path );
+
+// Storage side of the log: target of the replay on startup and source of the snapshots
+class ILogTarget
+{
+public:
+    virtual ~ILogTarget();
+    virtual void ReplaySet( std::string_view key, std::string_view value, Expiry expiry ) = 0;
+    virtual void ReplayDelete( std::string_view key ) = 0;
+    // Calls write for every item. Items may change meanwhile, those changes are in the log tail that is replayed after the snapshot.
+    virtual void Dump( std::function< void( std::string_view, std::string_view, Expiry ) > const& write ) = 0;
+};
+
+struct LogOptions
+{
+    enum SyncPolicy
+    {
+        spAlways,   // a mutation returns after the fdatasync that covers it, concurrent mutations share one fdatasync
+        spInterval, // the log is written and synced every mSyncInterval, a crash loses at most that much
+        spNone      // the log is written every mSyncInterval and synced by the OS
+    };
+
+    std::string mDirectory;
+    SyncPolicy mSync = spAlways;
+    std::chrono::milliseconds mSyncInterval{ 100 };
+    std::chrono::seconds mSnapshotInterval{ 300 }; // zero disables snapshots
+};
+
+// Append-only redo log of an in-memory storage with group commit and background snapshots.
+// Mutations append records to a memory buffer, a writer thread writes the whole buffer with one write and one fdatasync.
+// A snapshot starts a new log segment and then dumps the storage; once it is complete, older segments and snapshots are removed,
+// so the startup loads the latest snapshot and replays only the segments started after it.
+// Records are the resulting values rather than the operations, so replaying changes that the snapshot already caught is harmless.
+class WriteAheadLog
+{
+public:
+    explicit WriteAheadLog( LogOptions const& options );
+    ~WriteAheadLog();
+
+    WriteAheadLog( WriteAheadLog const& ) = delete;
+    WriteAheadLog& operator=( WriteAheadLog const& ) = delete;
+
+    // Loads the latest snapshot and the log tail into target, then starts the writer and snapshot threads
+    void Open( ILogTarget& target );
+
+    // Both return the log position to wait for. They must be called under the lock that orders the mutations of the key.
+    std::uint64_t AppendSet( std::string_view key, std::string_view value, Expiry expiry );
+    std::uint64_t AppendDelete( std::string_view key );
+    // Blocks until the position is on disk, if the sync policy asks for it; false once the log has failed
+    bool WaitDurable( std::uint64_t position );
+
+private:
+    std::uint64_t Append( char type, std::string_view key, std::string_view value, Expiry expiry );
+    void Replay( std::string const& path, ILogTarget& target, bool truncate );
+    std::string SegmentPath( std::uint64_t number ) const;
+    std::string SnapshotPath( std::uint64_t number ) const;
+    void Writer();
+    void Snapshots();
+    bool WriteSnapshot();
+
+    LogOptions mOptions;
+    ILogTarget* mTarget = nullptr;
+
+    std::mutex mMutex;
+    std::condition_variable mWake; // writer: new records, rotation or stop
+    std::condition_variable mDurable; // mutations waiting for mSynced
+    std::condition_variable mStop; // snapshot thread sleeps on it
+    std::string mBuffer; // records not yet handed to the writer
+    std::string mSealed; // records of the previous segment, written before the segment is switched
+    std::uint64_t mSegment = 0; // number of the segment the buffer goes to
+    std::uint64_t mAppended = 0; // log position after the last appended record
+    std::uint64_t mSynced = 0; // stops at the last position written before a failure
+    bool mRotate = false;
+    bool mStopping = false;
+    std::atomic< bool > mFailed{ false }; // for good, read without the lock by mutations that do not wait
+
+    int mFile = -1; // segment the writer writes to, owned by the writer thread
+    std::thread mWriter;
+    std::thread mSnapshotter;
+};
+
+} // namespace storage
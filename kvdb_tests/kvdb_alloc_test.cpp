@@ -0,0 +1,207 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <boost/asio.hpp>
+#include "../kvdb_server/kvdb_server_network.hpp"
+#include "../kvdb_server/kvdb_server_storage.hpp"
+#include "../kvdb_server/kvdb_server_stats.hpp"
+
+// The request path of the server does not touch the heap once connections and buffers are warm.
+// Counts operator new on every thread but the client one over pipelined GET, INSERT and UPDATE round trips
+// in each threading mode of the server.
+
+namespace
+{
+
+std::atomic< bool > gCounting{ false };
+std::atomic< size_t > gAllocations{ 0 };
+thread_local bool tClient = false;
+
+} // namespace
+
+void* operator new( size_t size )
+{
+    if( gCounting.load( std::memory_order_relaxed ) && !tClient )
+        gAllocations.fetch_add( 1, std::memory_order_relaxed );
+    void* p = std::malloc( size != 0 ? size : 1 );
+    if( p == nullptr )
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete( void* p ) noexcept
+{
+    std::free( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+    std::free( p );
+}
+
+namespace
+{
+
+using boost::asio::ip::tcp;
+
+constexpr size_t KEYS = 256;
+constexpr size_t PIPELINE = 32; // requests in flight
+constexpr size_t WARM_UP_ROUNDS = 200;
+constexpr size_t ROUNDS = 2000;
+constexpr size_t VALUE_SIZE = 100;
+constexpr size_t REPLY_HEADER_SIZE = sizeof( network::ResponseHeaderV2 );
+
+std::string Key( size_t i )
+{
+    return "key" + std::to_string( 1000 + i % KEYS );
+}
+
+void AppendRequest( std::string& out, Opcode opcode, std::string const& key, std::string const& value )
+{
+    network::DecodedHeader h( opcode, static_cast< unsigned short >( key.size() ), static_cast< unsigned int >( value.size() ) );
+    h.mVersion = 2;
+    network::RequestHeaderV2 header( h );
+    out.append( reinterpret_cast< char const* >( &header ), sizeof( header ) );
+    out += key;
+    out += value;
+}
+
+// Requests of all rounds are encoded up front, so the client thread only writes and reads
+class Client
+{
+public:
+    explicit Client( unsigned short port )
+        : mSocket( mIoService )
+    {
+        mSocket.connect( tcp::endpoint( boost::asio::ip::address_v4::loopback(), port ) );
+        mSocket.set_option( tcp::no_delay( true ) );
+        std::string value( VALUE_SIZE, 'v' );
+        for( size_t i = 0; i < KEYS; i++ )
+            AppendRequest( mLoad, Opcode::opInsert, Key( i ), value );
+        for( size_t i = 0; i < PIPELINE; i++ )
+        {
+            switch( i % 4 )
+            {
+                case 0:
+                    AppendRequest( mRound, Opcode::opInsert, Key( i ), value ); // the key exists, so it is refused
+                    break;
+                case 1:
+                    AppendRequest( mRound, Opcode::opUpdate, Key( i ), std::string( VALUE_SIZE, static_cast< char >( 'a' + i % 2 ) ) );
+                    break;
+                default:
+                    AppendRequest( mRound, Opcode::opGet, Key( i ), std::string() );
+            }
+        }
+        mReply.resize( REPLY_HEADER_SIZE + VALUE_SIZE );
+    }
+
+    void Load()
+    {
+        boost::asio::write( mSocket, boost::asio::buffer( mLoad ) );
+        ReadReplies( KEYS );
+    }
+
+    void Round()
+    {
+        boost::asio::write( mSocket, boost::asio::buffer( mRound ) );
+        ReadReplies( PIPELINE );
+    }
+
+private:
+    void ReadReplies( size_t count )
+    {
+        for( size_t i = 0; i < count; i++ )
+        {
+            boost::asio::read( mSocket, boost::asio::buffer( &mReply[ 0 ], REPLY_HEADER_SIZE ) );
+            network::DecodedResponseHeader h( *reinterpret_cast< network::ResponseHeaderV2 const* >( mReply.data() ) );
+            if( h.mStatus == Status::stInvalid || h.mValueLength > VALUE_SIZE )
+                throw std::runtime_error( "unexpected reply" );
+            boost::asio::read( mSocket, boost::asio::buffer( &mReply[ REPLY_HEADER_SIZE ], h.mValueLength ) );
+        }
+    }
+
+    boost::asio::io_service mIoService;
+    tcp::socket mSocket;
+    std::string mLoad;
+    std::string mRound;
+    std::string mReply;
+};
+
+unsigned short FreePort()
+{
+    boost::asio::io_service io_service;
+    tcp::acceptor acceptor( io_service, tcp::endpoint( tcp::v4(), 0 ) );
+    return acceptor.local_endpoint().port();
+}
+
+// Allocations on the server side during the measured rounds
+size_t Measure( char const* mode, size_t threads, bool per_thread )
+{
+    std::unique_ptr< storage::IStorage > strg = storage::InitializeStorage( 0, storage::IStorage::tTemporal, 4 );
+    unsigned short port = FreePort();
+    // Every thread has an io_service and a listener of its own with per_thread, as RunAsioServer sets them up
+    std::vector< std::unique_ptr< boost::asio::io_service > > io_services( per_thread ? threads : 1 );
+    std::vector< std::unique_ptr< stats::Stats > > stats;
+    std::vector< std::unique_ptr< network::TcpListener > > listeners;
+    for( auto& io_service : io_services )
+    {
+        io_service = std::make_unique< boost::asio::io_service >();
+        stats.push_back( std::make_unique< stats::Stats >( *io_service, *strg, 0 ) );
+        listeners.push_back( std::make_unique< network::TcpListener >( *io_service, port, per_thread, !per_thread && threads > 1, *strg, *stats.back() ) );
+    }
+    std::vector< std::thread > server;
+    for( size_t i = 0; i < io_services.size(); i++ )
+    {
+        size_t listener_threads = per_thread ? 1 : threads;
+        server.emplace_back( [ &, i, listener_threads ](){ listeners[ i ]->Run( listener_threads, false ); } );
+    }
+
+    size_t allocations = 0;
+    std::thread client( [ & ]()
+    {
+        tClient = true;
+        // Several connections, so the threads of the server all take a share
+        std::vector< std::unique_ptr< Client > > clients;
+        for( size_t i = 0; i < 2 * threads; i++ )
+            clients.push_back( std::make_unique< Client >( port ) );
+        clients.front()->Load();
+        for( size_t round = 0; round < WARM_UP_ROUNDS; round++ )
+            clients[ round % clients.size() ]->Round();
+        gAllocations = 0;
+        gCounting = true;
+        for( size_t round = 0; round < ROUNDS; round++ )
+            clients[ round % clients.size() ]->Round();
+        gCounting = false;
+        allocations = gAllocations;
+    } );
+    client.join();
+
+    for( auto& io_service : io_services )
+        io_service->stop();
+    for( std::thread& t : server )
+        t.join();
+    std::cout << mode << ": " << allocations << " allocations in " << ROUNDS * PIPELINE << " requests" << std::endl;
+    return allocations;
+}
+
+} // namespace
+
+int main()
+{
+    size_t failed = 0;
+    failed += Measure( "one thread", 1, false ) != 0;
+    failed += Measure( "two threads sharing an io_service", 2, false ) != 0;
+    failed += Measure( "two threads with an io_service each", 2, true ) != 0;
+    if( failed != 0 )
+    {
+        std::cerr << "FAILED: the request path allocates" << std::endl;
+        return 1;
+    }
+    std::cout << "kvdb_alloc_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,131 @@
+#include <iostream>
+#include <string>
+#include <memory>
+#include "../kvdb_server/kvdb_server_storage.hpp"
+#include "../kvdb_server/kvdb_server_cache.hpp"
+
+// Eviction of a memory-bounded storage. Items evicted from the small queue are remembered in the ghost queue
+// and go to the main queue when they are written again. Build with -D_GLIBCXX_DEBUG to catch bad iterators.
+
+namespace
+{
+
+using storage::IStorage;
+
+constexpr size_t ITEM_COST = 1000; // of the items below with their queue entries, so a budget is a number of items
+
+int gFailures = 0;
+
+void Check( bool condition, std::string const& what )
+{
+    if( condition )
+        return;
+    std::cerr << "FAILED: " << what << std::endl;
+    gFailures++;
+}
+
+std::string Key( char prefix, size_t i )
+{
+    return prefix + std::to_string( 1000 + i );
+}
+
+std::string ValueOf( std::string const& key )
+{
+    return key + std::string( ITEM_COST - storage::S3Fifo::ITEM_OVERHEAD - storage::S3Fifo::ENTRY_OVERHEAD - 3 * key.size(), '.' );
+}
+
+bool Holds( IStorage& s, std::string const& key )
+{
+    storage::ValueRef v = s.Get( key );
+    return v && v->View() == ValueOf( key );
+}
+
+// The ghost queue remembers about as many keys as there are items, so each item brings room for one
+std::unique_ptr< IStorage > CreateCache( size_t items )
+{
+    return storage::InitializeStorage( 0, IStorage::tTemporal, 1, 0, 0, items * ( ITEM_COST + storage::S3Fifo::GHOST_OVERHEAD ) );
+}
+
+// A key written again soon after eviction outlives a run of keys written once
+void TestReadmission()
+{
+    std::unique_ptr< IStorage > s = CreateCache( 10 );
+    std::string hot = Key( 'h', 0 );
+    s->Insert( hot, ValueOf( hot ), storage::NO_EXPIRY );
+    for( size_t i = 0; i < 10; i++ )
+        s->Insert( Key( 'a', i ), ValueOf( Key( 'a', i ) ), storage::NO_EXPIRY );
+    Check( !s->Get( hot ), "the oldest item of the small queue is evicted first" );
+    Check( s->GetEvictedCount() == 1, "one item evicted" );
+
+    s->Insert( hot, ValueOf( hot ), storage::NO_EXPIRY );
+    std::string once = Key( 'o', 0 );
+    s->Insert( once, ValueOf( once ), storage::NO_EXPIRY );
+    for( size_t i = 0; i < 40; i++ )
+        s->Insert( Key( 'b', i ), ValueOf( Key( 'b', i ) ), storage::NO_EXPIRY );
+    Check( Holds( *s, hot ), "a key re-admitted from the ghost queue stays in the main queue" );
+    Check( !s->Get( once ), "a key written once is flushed from the small queue" );
+    Check( s->GetItemCount() <= 10, "the cache keeps to its budget" );
+}
+
+// Keys evicted, re-admitted and evicted again, so the ghost queue holds forgotten hashes when they come to its front
+void TestChurn()
+{
+    std::unique_ptr< IStorage > s = CreateCache( 16 );
+    for( size_t round = 0; round < 50; round++ )
+    {
+        for( size_t i = 0; i < 40; i++ )
+        {
+            std::string key = Key( 'k', i );
+            if( s->Update( key, ValueOf( key ), storage::NO_EXPIRY ) == IStorage::ecKeyNotFound )
+                s->Insert( key, ValueOf( key ), storage::NO_EXPIRY );
+        }
+        Check( s->GetItemCount() <= 16, "the cache keeps to its budget in round " + std::to_string( round ) );
+    }
+    size_t held = 0;
+    for( size_t i = 0; i < 40; i++ )
+    {
+        if( s->Get( Key( 'k', i ) ) )
+        {
+            Check( Holds( *s, Key( 'k', i ) ), "an item keeps its value" );
+            held++;
+        }
+    }
+    Check( held == s->GetItemCount(), "every counted item is found" );
+    Check( s->GetEvictedCount() > 0, "items are evicted" );
+}
+
+// Long keys are charged for their copies in the queues, and entries of deleted items do not flush the live ones
+void TestLongKeys()
+{
+    constexpr size_t KEY_SIZE = 1000;
+    constexpr size_t BUDGET = 20000;
+    std::unique_ptr< IStorage > s = storage::InitializeStorage( 0, IStorage::tTemporal, 1, 0, 0, BUDGET );
+    auto key = [ & ]( size_t i ){ return Key( 'l', i ) + std::string( KEY_SIZE - 5, '.' ); };
+    size_t most = BUDGET / ( 2 * KEY_SIZE + storage::S3Fifo::ITEM_OVERHEAD + storage::S3Fifo::ENTRY_OVERHEAD );
+    for( size_t i = 0; i < 40; i++ )
+        s->Insert( key( i ), "v", storage::NO_EXPIRY );
+    Check( s->GetItemCount() <= most, "key copies of the queues count against the budget" );
+    for( size_t round = 0; round < 20; round++ )
+    {
+        for( size_t i = 0; i < 40; i++ )
+        {
+            s->Delete( key( i ) );
+            s->Insert( key( i ), "v", storage::NO_EXPIRY );
+        }
+    }
+    Check( s->GetItemCount() <= most, "the cache keeps to its budget with deleted items" );
+    Check( s->GetItemCount() >= most / 2, "entries of deleted items are dropped rather than live items" );
+}
+
+} // namespace
+
+int main()
+{
+    TestReadmission();
+    TestChurn();
+    TestLongKeys();
+    if( gFailures != 0 )
+        return 1;
+    std::cout << "kvdb_cache_test passed" << std::endl;
+    return 0;
+}